@@ -0,0 +1,1000 @@
+//
+//  bench.cpp
+//  raytracer-bench
+//
+//  Micro benchmarks of the CPU tracer core, each one compares variants of
+//  a single part on the same scene and the same rays.
+//
+
+#include "bvh_layout.h"
+#include "bvh_report.h"
+#include "bvh_update.h"
+#include "cache_sim.h"
+#include "common.h"
+#include "ray_packet.h"
+#include "scene.h"
+#include "soa_leaves.h"
+#include "tile_frustum.h"
+#include "tracer.h"
+#include "wavefront.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace
+{
+
+struct Options
+{
+    std::string benchmark;
+    int width = 320;
+    int height = 180;
+    int sceneSize = 100;
+    uint sceneSeed = 1;
+    SceneBuildOptions build;
+    int repeat = 3;
+    int l1KB = 32;
+    int l2KB = 1024;
+    int lineBytes = 64;
+    int instances = 256;
+    int frames = 60;
+    int moving = 64;
+    int samples = 4;
+    // 0 compares several queue sizes
+    int queueSize = 0;
+};
+
+void printUsage(const char* program)
+{
+    std::printf("usage: %s <benchmark> [options]\n"
+                "benchmarks:\n"
+                "  layouts                          cache misses per ray and speed of the binary bvh layouts\n"
+                "  instances                        build time, memory and speed of instanced and copied meshes\n"
+                "  refit                            per frame bvh updates of moving spheres against full rebuilds\n"
+                "  wavefront                        path tracing bounce by bounce against one path at a time\n"
+                "  ray-sorting                      node cache hits and speed of sorted secondary rays\n"
+                "  tile-frustum                     primary rays against the leaves of their tile frustum\n"
+                "  leaf-width                       trees built for simd leaves of 4 and 8 spheres against scalar leaves\n"
+                "  ground                           the ground as an analytic plane against a sphere of radius 1000\n"
+                "options:\n"
+                "  -w, --width <n>                  width of the grid of primary rays (default 320)\n"
+                "  -h, --height <n>                 height of the grid of primary rays (default 180)\n"
+                "      --scene-size <n>             half extent of the grid of small spheres (default 100)\n"
+                "      --scene-seed <n>             seed used to generate the scene (default 1)\n"
+                "      --builder <type>             bvh builder, sah, sah-tree or lbvh (default sah)\n"
+                "      --repeat <n>                 timed runs, the fastest counts (default 3)\n"
+                "      --l1-kb <n>                  simulated L1 size (default 32)\n"
+                "      --l2-kb <n>                  simulated L2 size (default 1024)\n"
+                "      --line <n>                   simulated cache line size (default 64)\n"
+                "      --instances <n>              instances of the mesh (default 256)\n"
+                "      --frames <n>                 frames of the animation (default 60)\n"
+                "      --moving <n>                 spheres moving in every frame (default 64)\n"
+                "      --spp <n>                    samples per pixel of the rendering benchmarks (default 4)\n"
+                "      --queue <n>                  paths in flight of the wavefront tracer (default several)\n"
+                "      --help                       show this message\n",
+                program);
+}
+
+bool parseArgs(int argc, char** argv, Options& opts)
+{
+    if (argc < 2 || argv[1][0] == '-') {
+        printUsage(argv[0]);
+        return false;
+    }
+    opts.benchmark = argv[1];
+
+    for (int i = 2; i < argc; ++i) {
+        const char* arg = argv[i];
+        auto isArg = [arg](const char* shortName, const char* longName) {
+            return (shortName && !std::strcmp(arg, shortName)) || !std::strcmp(arg, longName);
+        };
+        auto nextInt = [&](int minValue, int& value) {
+            if (i + 1 >= argc) {
+                std::fprintf(stderr, "missing value for %s\n", arg);
+                return false;
+            }
+            const char* str = argv[++i];
+            if (!parseInt(str, minValue, value)) {
+                std::fprintf(stderr, "invalid value for %s: %s\n", arg, str);
+                return false;
+            }
+            return true;
+        };
+
+        int value;
+        bool ok = true;
+        if (isArg("-w", "--width")) {
+            ok = nextInt(1, opts.width);
+        } else if (isArg("-h", "--height")) {
+            ok = nextInt(1, opts.height);
+        } else if (isArg(nullptr, "--scene-size")) {
+            ok = nextInt(0, opts.sceneSize);
+        } else if (isArg(nullptr, "--scene-seed")) {
+            ok = nextInt(0, value);
+            opts.sceneSeed = (uint)value;
+        } else if (isArg(nullptr, "--builder")) {
+            const char* str = i + 1 < argc ? argv[++i] : "";
+            if (!std::strcmp(str, "sah")) {
+                opts.build.builder = BVHBuilder::SAH;
+            } else if (!std::strcmp(str, "sah-tree")) {
+                opts.build.builder = BVHBuilder::SAHTree;
+            } else if (!std::strcmp(str, "lbvh")) {
+                opts.build.builder = BVHBuilder::LBVH;
+            } else {
+                std::fprintf(stderr, "unknown bvh builder %s\n", str);
+                ok = false;
+            }
+        } else if (isArg(nullptr, "--repeat")) {
+            ok = nextInt(1, opts.repeat);
+        } else if (isArg(nullptr, "--l1-kb")) {
+            ok = nextInt(1, opts.l1KB);
+        } else if (isArg(nullptr, "--l2-kb")) {
+            ok = nextInt(1, opts.l2KB);
+        } else if (isArg(nullptr, "--line")) {
+            ok = nextInt(1, opts.lineBytes);
+        } else if (isArg(nullptr, "--instances")) {
+            ok = nextInt(1, opts.instances);
+        } else if (isArg(nullptr, "--frames")) {
+            ok = nextInt(1, opts.frames);
+        } else if (isArg(nullptr, "--moving")) {
+            ok = nextInt(0, opts.moving);
+        } else if (isArg(nullptr, "--spp")) {
+            ok = nextInt(1, opts.samples);
+        } else if (isArg(nullptr, "--queue")) {
+            ok = nextInt(1, opts.queueSize);
+        } else {
+            if (std::strcmp(arg, "--help")) {
+                std::fprintf(stderr, "unknown option %s\n", arg);
+            }
+            printUsage(argv[0]);
+            return false;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct RaySet
+{
+    const char* name;
+    std::vector<tracer::Ray> rays;
+};
+
+// primary rays through the pixel centers in the tile order of the renderer
+// and a diffuse bounce from every primary hit, which is far less coherent
+std::vector<RaySet> makeRays(const Options& opts, const tracer::Scene& scene)
+{
+    constexpr int TileSize = 16;
+    tracer::Camera camera = makeCamera(opts.width, opts.height);
+    RaySet primary{ "primary", {} };
+    RaySet diffuse{ "diffuse", {} };
+    for (int ty = 0; ty < opts.height; ty += TileSize) {
+        for (int tx = 0; tx < opts.width; tx += TileSize) {
+            for (int y = ty; y < std::min(ty + TileSize, opts.height); ++y) {
+                for (int x = tx; x < std::min(tx + TileSize, opts.width); ++x) {
+                    primary.rays.push_back(camera.getRay(math::float2(x + 0.5f, y + 0.5f)));
+                }
+            }
+        }
+    }
+
+    tracer::Random random(opts.sceneSeed);
+    for (const tracer::Ray& ray : primary.rays) {
+        tracer::HitRecord rec;
+        if (scene.hit<false>(ray, tracer::MinHitDistance, INFINITY, rec)) {
+            diffuse.rays.push_back({ rec.pt, rec.normal + random.inUnitSphere() });
+        }
+    }
+    return { primary, diffuse };
+}
+
+// closest sphere of every ray, for checking that all variants agree
+template<typename SceneT>
+std::vector<int> traceAll(const SceneT& scene, const std::vector<tracer::Ray>& rays)
+{
+    std::vector<int> hits(rays.size());
+    for (size_t i = 0; i < rays.size(); ++i) {
+        float tmax = INFINITY;
+        hits[i] = scene.closestHit(rays[i], tracer::MinHitDistance, tmax);
+    }
+    return hits;
+}
+
+template<typename SceneT>
+double bestTime(const Options& opts, const SceneT& scene, const std::vector<tracer::Ray>& rays)
+{
+    double best = INFINITY;
+    for (int i = 0; i < opts.repeat; ++i) {
+        auto start = Clock::now();
+        traceAll(scene, rays);
+        best = std::min(best, secondsSince(start));
+    }
+    return best;
+}
+
+template<typename NodeT>
+void benchLayout(const Options& opts, tracer::BVHLayout layout, const tracer::Scene& scene,
+                 const std::vector<NodeT>& nodes, const std::vector<RaySet>& raySets,
+                 const std::vector<std::vector<int>>& expected)
+{
+    tracer::LayoutScene<NodeT> layoutScene(scene, nodes.data());
+    for (size_t r = 0; r < raySets.size(); ++r) {
+        const auto& rays = raySets[r].rays;
+        if (traceAll(layoutScene, rays) != expected[r]) {
+            std::fprintf(stderr, "%s layout disagrees with the preorder one\n", layoutName(layout));
+        }
+
+        // every ray set starts from a cold cache
+        CacheSim l2((size_t)opts.l2KB * 1024, opts.lineBytes, 16);
+        CacheSim l1((size_t)opts.l1KB * 1024, opts.lineBytes, 8, &l2);
+        std::uint64_t nodeFetches = 0;
+        auto probe = [&](const void* p, size_t bytes) {
+            nodeFetches += bytes == sizeof(NodeT);
+            l1.access(p, bytes);
+        };
+        for (const auto& ray : rays) {
+            float tmax = INFINITY;
+            layoutScene.closestHit(ray, tracer::MinHitDistance, tmax, probe);
+        }
+
+        double n = (double)std::max<size_t>(1, rays.size());
+        double time = bestTime(opts, layoutScene, rays);
+        std::printf("%-8s %-12s %6zu %10.1f %10.2f %10.2f %9.2f\n",
+                    raySets[r].name, layoutName(layout), sizeof(NodeT),
+                    nodeFetches / n, l1.misses() / n, l2.misses() / n, n / time * 1e-6);
+    }
+}
+
+int benchLayouts(const Options& opts, const SceneBuffer& buffer)
+{
+    tracer::Scene scene = sceneView(buffer);
+    auto raySets = makeRays(opts, scene);
+    std::vector<std::vector<int>> expected;
+    for (const auto& set : raySets) {
+        expected.push_back(traceAll(scene, set.rays));
+        std::printf("%zu %s rays\n", set.rays.size(), set.name);
+    }
+    std::printf("simulated %d KB L1 and %d KB L2 with %d byte lines, misses include the spheres\n\n",
+                opts.l1KB, opts.l2KB, opts.lineBytes);
+    std::printf("%-8s %-12s %6s %10s %10s %10s %9s\n",
+                "rays", "layout", "bytes", "nodes/ray", "L1 miss", "L2 miss", "Mrays/s");
+
+    using tracer::BVHLayout;
+    benchLayout(opts, BVHLayout::Preorder, scene, buffer.nodes, raySets, expected);
+    benchLayout(opts, BVHLayout::Aligned, scene, tracer::makeLinkedNodes(buffer.nodes, BVHLayout::Aligned),
+                raySets, expected);
+    benchLayout(opts, BVHLayout::DepthFirst, scene, tracer::makeDepthFirstNodes(buffer.nodes),
+                raySets, expected);
+    benchLayout(opts, BVHLayout::VanEmdeBoas, scene, tracer::makeLinkedNodes(buffer.nodes, BVHLayout::VanEmdeBoas),
+                raySets, expected);
+    benchLayout(opts, BVHLayout::Compressed, scene, tracer::makeCompressedNodes(buffer.nodes),
+                raySets, expected);
+    return EXIT_SUCCESS;
+}
+
+// a torus of 2 * rings * segments triangles
+TriangleMesh makeTorus(int rings, int segments)
+{
+    TriangleMesh mesh;
+    for (int i = 0; i < rings; ++i) {
+        float u = 2 * tracer::Pi * i / rings;
+        for (int j = 0; j < segments; ++j) {
+            float v = 2 * tracer::Pi * j / segments;
+            float r = 1 + 0.35f * std::cos(v);
+            mesh.positions.emplace_back(r * std::cos(u), 0.35f * std::sin(v), r * std::sin(u));
+        }
+    }
+    auto index = [&](int i, int j) { return (i % rings) * segments + j % segments; };
+    for (int i = 0; i < rings; ++i) {
+        for (int j = 0; j < segments; ++j) {
+            int quad[4] = { index(i, j), index(i, j + 1), index(i + 1, j + 1), index(i + 1, j) };
+            mesh.indices.insert(mesh.indices.end(), { quad[0], quad[1], quad[2], quad[0], quad[2], quad[3] });
+        }
+    }
+    return mesh;
+}
+
+size_t bufferBytes(const SceneBuffer& buffer)
+{
+    return buffer.nodes.size() * sizeof(Node) + buffer.objects.size() * sizeof(Sphere)
+         + buffer.materials.size() * sizeof(Material) + buffer.triangles.size() * sizeof(Triangle)
+         + buffer.instances.size() * sizeof(Instance);
+}
+
+// the same mesh placed many times either as instances of one bottom level
+// bvh or as copies of its triangles in one flat bvh
+int benchInstances(const Options& opts)
+{
+    TriangleMesh mesh = makeTorus(128, 64);
+    Material material;
+    material.type = Diffuse;
+    material.albedo = glm::vec3(0.7f);
+    material.prop = 0;
+
+    auto placeInstances = [&](Scene& scene, int geometry, float turn) {
+        scene.instances.clear();
+        for (int i = 0; i < opts.instances; ++i) {
+            math::uint4 bits = tracer::philox(math::uint4((uint)i, 0, 0, 0), math::uint2(opts.sceneSeed, 0));
+            glm::vec3 position(20 * tracer::toUnitFloat(bits.x) - 10, 0, 20 * tracer::toUnitFloat(bits.y) - 10);
+            glm::mat4 toWorld = glm::translate(glm::mat4(1.0f), position);
+            toWorld = glm::rotate(toWorld, 2 * tracer::Pi * tracer::toUnitFloat(bits.z) + turn, glm::vec3(0, 1, 0));
+            toWorld = glm::scale(toWorld, glm::vec3(0.5f + tracer::toUnitFloat(bits.w)));
+            scene.instances.push_back({ geometry, toWorld });
+        }
+    };
+
+    Scene instanced = createScene(2, opts.build, opts.sceneSeed);
+    placeInstances(instanced, addGeometry(instanced, mesh, material), 0);
+
+    // the copies are the triangles of the geometry moved by every instance
+    Scene copied = createScene(2, opts.build, opts.sceneSeed);
+    copied.meshMaterials = instanced.meshMaterials;
+    for (const SceneInstance& instance : instanced.instances) {
+        for (const TriangleObject& tri : instanced.geometries[0].triangles) {
+            auto move = [&](const glm::vec3& p) { return glm::vec3(instance.toWorld * glm::vec4(p, 1.0f)); };
+            copied.triangles.emplace_back(move(tri.v0), move(tri.v1), move(tri.v2), tri.material);
+        }
+    }
+    std::printf("%zu triangles, %d instances\n\n", instanced.geometries[0].triangles.size(), opts.instances);
+    std::printf("%-10s %10s %10s %9s\n", "variant", "build ms", "MB", "Mrays/s");
+
+    std::vector<tracer::Ray> rays;
+    tracer::Camera camera = makeCamera(opts.width, opts.height);
+    for (int y = 0; y < opts.height; ++y) {
+        for (int x = 0; x < opts.width; ++x) {
+            rays.push_back(camera.getRay(math::float2(x + 0.5f, y + 0.5f)));
+        }
+    }
+
+    auto run = [&](const char* name, const Scene& scene) {
+        auto start = Clock::now();
+        auto buffer = std::make_unique<SceneBuffer>(scene);
+        double buildTime = secondsSince(start);
+        tracer::Scene view = sceneView(*buffer);
+        double time = bestTime(opts, view, rays);
+        std::printf("%-10s %10.2f %10.2f %9.2f\n", name, buildTime * 1e3,
+                    bufferBytes(*buffer) / (1024.0 * 1024.0), rays.size() / time * 1e-6);
+        return buffer;
+    };
+    run("copied", copied);
+    auto buffer = run("instanced", instanced);
+
+    // moving instances only needs a new top level
+    placeInstances(instanced, 0, 0.5f);
+    double best = INFINITY;
+    for (int i = 0; i < opts.repeat; ++i) {
+        auto start = Clock::now();
+        buffer->rebuildTopLevel(instanced);
+        best = std::min(best, secondsSince(start));
+    }
+    std::printf("\ntop level rebuild after moving every instance: %.3f ms\n", best * 1e3);
+    return EXIT_SUCCESS;
+}
+
+// an animation in which a few small spheres drift away, one appears and
+// one disappears every frame. The updater keeps the bvh valid, which is
+// compared with building it from scratch for every frame.
+int benchRefit(const Options& opts, SceneBuffer& buffer)
+{
+    bvh_updater updater(buffer, opts.build.sah);
+    int numIds = (int)buffer.objects.size();
+    auto random = [&](int frame, int i) {
+        math::uint4 bits = tracer::philox(math::uint4((uint)i, (uint)frame, 0, 0), math::uint2(opts.sceneSeed, 1));
+        return glm::vec3(tracer::toUnitFloat(bits.x), tracer::toUnitFloat(bits.y), tracer::toUnitFloat(bits.z));
+    };
+
+    // the large spheres stay where they are
+    std::vector<int> moving;
+    std::vector<glm::vec3> velocity;
+    std::vector<char> fixed(numIds);
+    for (int id = 0; id < numIds && (int)moving.size() < opts.moving; id += std::max(1, numIds / std::max(1, opts.moving))) {
+        if (buffer.objects[updater.slot(id)].radius <= 1.0f) {
+            glm::vec3 u = random(0, id);
+            moving.push_back(id);
+            velocity.emplace_back(u.x - 0.5f, 0, u.z - 0.5f);
+            fixed[id] = 1;
+        }
+    }
+    std::printf("%d frames, %zu moving spheres, 1 inserted and 1 removed per frame\n\n", opts.frames, moving.size());
+
+    std::vector<aabb3> boxes;
+    std::vector<Node> nodes;
+    std::vector<int> order;
+    auto rebuild = [&]() {
+        boxes.clear();
+        for (const Sphere& sphere : buffer.objects) {
+            // freed slots have no radius
+            if (sphere.radius > 0.0f) {
+                boxes.emplace_back(sphere.center, sphere.radius);
+            }
+        }
+        build_flat_bvh(boxes.data(), (int)boxes.size(), opts.build.sah, PrimitiveSphere, nodes, order);
+    };
+
+    double updateTotal = 0.0;
+    double updateMax = 0.0;
+    double rebuildTotal = 0.0;
+    double rebuildMax = 0.0;
+    int kinds[4] = {};
+    int removed = numIds - 1;
+    for (int frame = 1; frame <= opts.frames; ++frame) {
+        for (size_t i = 0; i < moving.size(); ++i) {
+            glm::vec3 center = buffer.objects[updater.slot(moving[i])].center;
+            updater.move_sphere(moving[i], center + velocity[i]);
+        }
+        glm::vec3 u = random(frame, -1);
+        Sphere sphere{ glm::vec3(2 * opts.sceneSize * (u.x - 0.5f), 0.2f, 2 * opts.sceneSize * (u.z - 0.5f)), 0.2f };
+        int source = frame % numIds;
+        while (updater.slot(source) == -1) {
+            source = (source + 1) % numIds;
+        }
+        updater.insert_sphere(sphere, buffer.materials[updater.slot(source)]);
+        while (removed > 0 && (fixed[removed] || buffer.objects[updater.slot(removed)].radius > 1.0f)) {
+            --removed;
+        }
+        if (removed > 0) {
+            updater.remove_sphere(removed--);
+        }
+
+        auto start = Clock::now();
+        bvh_updater::update_stats stats = updater.update();
+        double time = secondsSince(start);
+        updateTotal += time;
+        updateMax = std::max(updateMax, time);
+        ++kinds[(int)stats.kind];
+
+        start = Clock::now();
+        rebuild();
+        time = secondsSince(start);
+        rebuildTotal += time;
+        rebuildMax = std::max(rebuildMax, time);
+    }
+
+    std::vector<tracer::Ray> rays;
+    tracer::Camera camera = makeCamera(opts.width, opts.height);
+    for (int y = 0; y < opts.height; ++y) {
+        for (int x = 0; x < opts.width; ++x) {
+            rays.push_back(camera.getRay(math::float2(x + 0.5f, y + 0.5f)));
+        }
+    }
+    int numSlots = (int)buffer.objects.size();
+    tracer::Scene updated(buffer.nodes.data(), buffer.objects.data(), buffer.materials.data(), numSlots);
+
+    // the fresh tree needs the spheres in the order of its leaves
+    std::vector<Sphere> spheres;
+    for (const Sphere& sphere : buffer.objects) {
+        if (sphere.radius > 0.0f) {
+            spheres.push_back(sphere);
+        }
+    }
+    std::vector<Sphere> ordered(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        ordered[i] = spheres[order[i]];
+    }
+    std::vector<Material> materials(ordered.size(), buffer.materials[0]);
+    tracer::Scene fresh(nodes.data(), ordered.data(), materials.data(), (int)ordered.size());
+
+    // the updated tree has to find what testing every sphere finds
+    int mismatches = 0;
+    for (size_t i = 0; i < rays.size(); i += 16) {
+        tracer::HitRecord a, b;
+        bool hitA = updated.hit<false>(rays[i], tracer::MinHitDistance, INFINITY, a);
+        bool hitB = updated.hit<true>(rays[i], tracer::MinHitDistance, INFINITY, b);
+        mismatches += hitA != hitB || (hitA && a.pt != b.pt);
+    }
+
+    std::printf("%-8s %10s %10s %9s %9s\n", "variant", "ms/frame", "max ms", "SAH cost", "Mrays/s");
+    std::printf("%-8s %10.3f %10.3f %9.2f %9.2f\n", "rebuild", rebuildTotal / opts.frames * 1e3, rebuildMax * 1e3,
+                make_bvh_report(nodes, opts.build.sah).sah_cost, rays.size() / bestTime(opts, fresh, rays) * 1e-6);
+    std::printf("%-8s %10.3f %10.3f %9.2f %9.2f\n", "update", updateTotal / opts.frames * 1e3, updateMax * 1e3,
+                updater.sah_cost(), rays.size() / bestTime(opts, updated, rays) * 1e-6);
+    std::printf("\nupdates: %d refits, %d partial rebuilds, %d full rebuilds, %d mismatches against brute force\n",
+                kinds[(int)bvh_updater::update_kind::refit], kinds[(int)bvh_updater::update_kind::partial_rebuild],
+                kinds[(int)bvh_updater::update_kind::full_rebuild], mismatches);
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// the pixels of the image in tiles of 16
+std::vector<math::uint2> tilePixels(const Options& opts)
+{
+    constexpr int TileSize = 16;
+    std::vector<math::uint2> pixels;
+    for (int ty = 0; ty < opts.height; ty += TileSize) {
+        for (int tx = 0; tx < opts.width; tx += TileSize) {
+            for (int y = ty; y < std::min(ty + TileSize, opts.height); ++y) {
+                for (int x = tx; x < std::min(tx + TileSize, opts.width); ++x) {
+                    pixels.emplace_back(x, y);
+                }
+            }
+        }
+    }
+    return pixels;
+}
+
+std::vector<tracer::Random> pixelSamplers(const Options& opts, const std::vector<math::uint2>& pixels)
+{
+    std::vector<tracer::Random> samplers;
+    for (const math::uint2& pixel : pixels) {
+        samplers.emplace_back(tracer::pixelSeed(0, pixel.x, pixel.y, opts.width));
+    }
+    return samplers;
+}
+
+// traces the paths of the pixels one after the other, sums receives the
+// samples of every pixel. Returns the number of rays.
+template<typename SceneT>
+std::uint64_t renderPaths(const Options& opts, const SceneT& scene, const std::vector<math::uint2>& pixels,
+                          std::vector<math::float3>& sums)
+{
+    tracer::Camera camera = makeCamera(opts.width, opts.height);
+    std::vector<tracer::Random> samplers = pixelSamplers(opts, pixels);
+    sums.assign(pixels.size(), math::float3(0));
+    std::uint64_t numRays = 0;
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        tracer::BasicRayTracer<SceneT> tracer(samplers[i], camera, scene, BackgroundColor);
+        for (int s = 0; s < opts.samples; ++s) {
+            samplers[i].startSample(pixels[i], s);
+            int pathRays;
+            sums[i] += tracer.template trace<false>(math::float2(pixels[i].x, pixels[i].y) + samplers[i].inUnitRect(), pathRays);
+            numRays += pathRays;
+        }
+    }
+    return numRays;
+}
+
+// the same with the wavefront tracer, its batches are runs of queue size
+// pixels
+template<typename SceneT>
+void renderWavefront(const Options& opts, tracer::WavefrontTracer<SceneT, tracer::Random>& wavefront,
+                     const std::vector<math::uint2>& pixels, std::vector<math::float3>& sums)
+{
+    int numPixels = (int)pixels.size();
+    int queueSize = wavefront.queueSize();
+    std::vector<tracer::Random> samplers = pixelSamplers(opts, pixels);
+    std::vector<math::float3> colors(queueSize);
+    std::vector<int> pathRays(queueSize);
+    sums.assign(numPixels, math::float3(0));
+    for (int first = 0; first < numPixels; first += queueSize) {
+        int count = std::min(queueSize, numPixels - first);
+        for (int s = 0; s < opts.samples; ++s) {
+            wavefront.template trace<false>(&pixels[first], &samplers[first], s, count, colors.data(), pathRays.data());
+            for (int i = 0; i < count; ++i) {
+                sums[first + i] += colors[i];
+            }
+        }
+    }
+}
+
+template<typename Render>
+double bestTime(const Options& opts, Render&& render)
+{
+    double best = INFINITY;
+    for (int r = 0; r < opts.repeat; ++r) {
+        auto start = Clock::now();
+        render();
+        best = std::min(best, secondsSince(start));
+    }
+    return best;
+}
+
+// renders the image with paths traced one after the other and with the
+// wavefront tracer at several queue sizes, on the generated scene and on one
+// in which half of the small spheres are glass
+int benchWavefront(const Options& opts)
+{
+    std::vector<math::uint2> pixels = tilePixels(opts);
+    tracer::Camera camera = makeCamera(opts.width, opts.height);
+    std::vector<int> queueSizes = { 256, 4096, 65536 };
+    if (opts.queueSize > 0) {
+        queueSizes = { opts.queueSize };
+    }
+    std::printf("%d x %d pixels, %d spp\n\n", opts.width, opts.height, opts.samples);
+    std::printf("%-11s %-12s %9s %9s\n", "scene", "variant", "Mrays/s", "speedup");
+
+    bool allMatch = true;
+    auto run = [&](const char* sceneName, const Scene& scene) {
+        SceneBuffer buffer(scene);
+        tracer::Scene view = sceneView(buffer);
+
+        // the sums of all pixels, which both variants have to agree on
+        std::vector<math::float3> expected;
+        std::uint64_t numRays = 0;
+        double time = bestTime(opts, [&]() { numRays = renderPaths(opts, view, pixels, expected); });
+        double baseline = numRays / time * 1e-6;
+        std::printf("%-11s %-12s %9.2f %9.2f\n", sceneName, "megakernel", baseline, 1.0);
+
+        for (int queueSize : queueSizes) {
+            tracer::WavefrontTracer<tracer::Scene, tracer::Random> wavefront(camera, view, BackgroundColor, queueSize);
+            std::vector<math::float3> sums;
+            time = bestTime(opts, [&]() { renderWavefront(opts, wavefront, pixels, sums); });
+            allMatch = allMatch && sums == expected;
+            char name[32];
+            std::snprintf(name, sizeof(name), "queue %d", queueSize);
+            std::printf("%-11s %-12s %9.2f %9.2f%s\n", sceneName, name, numRays / time * 1e-6,
+                        numRays / time * 1e-6 / baseline, sums == expected ? "" : "  image differs");
+        }
+    };
+
+    Scene scene = createScene(opts.sceneSize, opts.build, opts.sceneSeed);
+    run("generated", scene);
+    int numSmall = 0;
+    for (SphereObject& obj : scene.objects) {
+        if (obj.radius < 1.0f && numSmall++ % 2 == 0) {
+            obj.type = Dielectric;
+            obj.prop = 1.5f;
+        }
+    }
+    run("half glass", scene);
+    return allMatch ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// the binary bvh in preorder, reading every node and sphere through a
+// simulated cache and counting the node reads that miss it
+class CachedScene
+{
+public:
+    CachedScene(const tracer::Scene& scene, CacheSim& cache)
+        : m_scene(scene)
+        , m_layout(scene, &scene.getNode(0))
+        , m_cache(cache)
+    {}
+
+    template<bool bruteForce>
+    bool hit(tracer::Ray ray, float tmin, float tmax, tracer::HitRecord& rec) const
+    {
+        int index = m_layout.closestHit(ray, tmin, tmax, [this](const void* p, size_t bytes) {
+            int misses = m_cache.access(p, bytes);
+            if (bytes == sizeof(Node)) {
+                ++nodeReads;
+                nodeMisses += misses > 0;
+            }
+        });
+        if (index == -1) {
+            return false;
+        }
+        rec = m_scene.getHitRecord(ray, tmax, index);
+        return true;
+    }
+
+    mutable std::uint64_t nodeReads = 0;
+    mutable std::uint64_t nodeMisses = 0;
+private:
+    const tracer::Scene& m_scene;
+    tracer::LayoutScene<Node> m_layout;
+    CacheSim& m_cache;
+};
+
+// the image traced path by path and with the wavefront tracer with and
+// without sorting the secondary rays, with the share of node reads that hit
+// the simulated L1 and the speed of each
+int benchRaySorting(const Options& opts, const SceneBuffer& buffer)
+{
+    std::vector<math::uint2> pixels = tilePixels(opts);
+    tracer::Camera camera = makeCamera(opts.width, opts.height);
+    int queueSize = opts.queueSize > 0 ? opts.queueSize : (int)pixels.size();
+    tracer::Scene scene = sceneView(buffer);
+    std::printf("%d x %d pixels, %d spp, queue %d, simulated %d KB L1 and %d KB L2 with %d byte lines\n\n",
+                opts.width, opts.height, opts.samples, queueSize, opts.l1KB, opts.l2KB, opts.lineBytes);
+    std::printf("%-18s %12s %12s %12s %9s\n", "variant", "nodes/ray", "L1 node hit", "L2 miss/ray", "Mrays/s");
+
+    std::vector<math::float3> expected;
+    std::uint64_t numRays = renderPaths(opts, scene, pixels, expected);
+    bool allMatch = true;
+    auto report = [&](const char* name, auto&& render, auto&& renderCached) {
+        CacheSim l2((size_t)opts.l2KB * 1024, opts.lineBytes, 16);
+        CacheSim l1((size_t)opts.l1KB * 1024, opts.lineBytes, 8, &l2);
+        CachedScene cached(scene, l1);
+        std::vector<math::float3> sums;
+        renderCached(cached, sums);
+        allMatch = allMatch && sums == expected;
+
+        double time = bestTime(opts, [&]() { render(sums); });
+        allMatch = allMatch && sums == expected;
+        double n = (double)numRays;
+        std::printf("%-18s %12.1f %11.1f%% %12.2f %9.2f%s\n", name, cached.nodeReads / n,
+                    100.0 * (1.0 - (double)cached.nodeMisses / std::max<std::uint64_t>(1, cached.nodeReads)),
+                    l2.misses() / n, n / time * 1e-6, sums == expected ? "" : "  image differs");
+    };
+
+    report("megakernel",
+           [&](std::vector<math::float3>& sums) { renderPaths(opts, scene, pixels, sums); },
+           [&](const CachedScene& cached, std::vector<math::float3>& sums) { renderPaths(opts, cached, pixels, sums); });
+    for (bool sortRays : { false, true }) {
+        auto run = [&](const auto& target, std::vector<math::float3>& sums) {
+            using SceneT = std::decay_t<decltype(target)>;
+            tracer::WavefrontTracer<SceneT, tracer::Random> wavefront(camera, target, BackgroundColor, queueSize);
+            wavefront.setRaySorting(sortRays);
+            renderWavefront(opts, wavefront, pixels, sums);
+        };
+        report(sortRays ? "wavefront, sorted" : "wavefront",
+               [&](std::vector<math::float3>& sums) { run(scene, sums); },
+               [&](const CachedScene& cached, std::vector<math::float3>& sums) { run(cached, sums); });
+    }
+    return allMatch ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct FrustumTile
+{
+    math::float2 lo;
+    math::float2 hi;
+    // spp jittered primary rays of every pixel, sample by sample
+    std::vector<tracer::Ray> rays;
+};
+
+std::vector<FrustumTile> makeFrustumTiles(const Options& opts, int tileSize)
+{
+    tracer::Camera camera = makeCamera(opts.width, opts.height);
+    std::vector<FrustumTile> tiles;
+    for (int ty = 0; ty < opts.height; ty += tileSize) {
+        for (int tx = 0; tx < opts.width; tx += tileSize) {
+            int width = std::min(tileSize, opts.width - tx);
+            int height = std::min(tileSize, opts.height - ty);
+            FrustumTile tile{ math::float2(tx, ty), math::float2(tx + width, ty + height), {} };
+            for (int s = 0; s < opts.samples; ++s) {
+                for (int y = ty; y < ty + height; ++y) {
+                    for (int x = tx; x < tx + width; ++x) {
+                        tracer::Random random(tracer::pixelSeed(s, x, y, opts.width));
+                        tile.rays.push_back(camera.getRay(math::float2(x, y) + random.inUnitRect()));
+                    }
+                }
+            }
+            tiles.push_back(std::move(tile));
+        }
+    }
+    return tiles;
+}
+
+// the primary rays of every tile traversing the bvh on their own and tested
+// against the leaves the frustum of the tile overlaps, one at a time and in
+// packets. The leaves are collected once per tile and timed with the rays.
+int benchTileFrustum(const Options& opts, const SceneBuffer& buffer)
+{
+    constexpr int N = tracer::PacketWidth;
+    tracer::Camera camera = makeCamera(opts.width, opts.height);
+    tracer::Scene scene = sceneView(buffer);
+    std::printf("%d x %d pixels, %d spp\n\n", opts.width, opts.height, opts.samples);
+    std::printf("%-5s %-16s %12s %12s %9s %9s\n", "tile", "variant", "leaves/tile", "nodes/tile", "Mrays/s", "speedup");
+
+    bool allMatch = true;
+    for (int tileSize : { 8, 16, 32 }) {
+        std::vector<FrustumTile> tiles = makeFrustumTiles(opts, tileSize);
+        std::vector<std::vector<int>> expected;
+        size_t numRays = 0;
+        for (const FrustumTile& tile : tiles) {
+            expected.push_back(traceAll(scene, tile.rays));
+            numRays += tile.rays.size();
+        }
+
+        std::uint64_t numLeaves = 0;
+        std::uint64_t numTested = 0;
+        tracer::FrustumLeaves leaves(scene);
+        for (const FrustumTile& tile : tiles) {
+            numTested += leaves.build(tracer::makeTileFrustum(camera, tile.lo, tile.hi));
+            numLeaves += leaves.size();
+        }
+
+        // every variant writes the sphere hit by every ray of the tile
+        std::vector<int> hits;
+        auto run = [&](bool useLeaves, bool packets) {
+            bool match = true;
+            double time = bestTime(opts, [&]() {
+                match = true;
+                for (size_t t = 0; t < tiles.size(); ++t) {
+                    const std::vector<tracer::Ray>& rays = tiles[t].rays;
+                    hits.resize(rays.size());
+                    if (useLeaves) {
+                        leaves.build(tracer::makeTileFrustum(camera, tiles[t].lo, tiles[t].hi));
+                    }
+                    for (size_t i = 0; i < rays.size(); i += packets ? N : 1) {
+                        if (!packets) {
+                            float tmax = INFINITY;
+                            hits[i] = useLeaves ? leaves.closestHit(rays[i], tracer::MinHitDistance, tmax)
+                                                : scene.closestHit(rays[i], tracer::MinHitDistance, tmax);
+                            continue;
+                        }
+                        int count = std::min(N, (int)(rays.size() - i));
+                        auto packet = tracer::makeRayPacket<N>(&rays[i], count);
+                        tracer::PacketHit<N> hit;
+                        if (useLeaves) {
+                            tracer::intersectPacket(scene, leaves.leaves(), leaves.nearDists(), leaves.size(), packet,
+                                                    tracer::firstLanes<N>(count), tracer::MinHitDistance, INFINITY, hit);
+                        } else {
+                            tracer::intersectPacket(scene, packet, tracer::firstLanes<N>(count),
+                                                    tracer::MinHitDistance, INFINITY, hit);
+                        }
+                        for (int lane = 0; lane < count; ++lane) {
+                            hits[i + lane] = hit.primIndex[lane];
+                        }
+                    }
+                    match = match && hits == expected[t];
+                }
+            });
+            allMatch = allMatch && match;
+            return std::make_pair(numRays / time * 1e-6, match);
+        };
+
+        double baseline = 0;
+        for (bool packets : { false, true }) {
+            for (bool useLeaves : { false, true }) {
+                auto [speed, match] = run(useLeaves, packets);
+                if (!packets && !useLeaves) {
+                    baseline = speed;
+                }
+                const char* name = packets ? (useLeaves ? "packets, leaves" : "packets") : (useLeaves ? "leaves" : "traversal");
+                if (useLeaves) {
+                    std::printf("%-5d %-16s %12.1f %12.1f %9.2f %9.2f%s\n", tileSize, name,
+                                (double)numLeaves / tiles.size(), (double)numTested / tiles.size(), speed,
+                                speed / baseline, match ? "" : "  hits differ");
+                } else {
+                    std::printf("%-5d %-16s %12s %12s %9.2f %9.2f%s\n", tileSize, name, "", "", speed,
+                                speed / baseline, match ? "" : "  hits differ");
+                }
+            }
+        }
+    }
+    return allMatch ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// the node reads and leaf tests per ray of a traversal whose probe sees
+// leaves of LeafT, and its speed
+template<typename LeafT, typename SceneT>
+void benchLeaves(const Options& opts, const char* name, int leafWidth, size_t numNodes, const SceneT& scene,
+                 const std::vector<RaySet>& raySets, const std::vector<std::vector<int>>& expected, bool& allMatch)
+{
+    for (size_t r = 0; r < raySets.size(); ++r) {
+        const auto& rays = raySets[r].rays;
+        bool match = traceAll(scene, rays) == expected[r];
+        allMatch = allMatch && match;
+
+        std::uint64_t nodeReads = 0;
+        std::uint64_t leafTests = 0;
+        auto probe = [&](const void*, size_t bytes) {
+            nodeReads += bytes == sizeof(Node);
+            leafTests += bytes == sizeof(LeafT);
+        };
+        for (const auto& ray : rays) {
+            float tmax = INFINITY;
+            scene.closestHit(ray, tracer::MinHitDistance, tmax, probe);
+        }
+
+        double n = (double)std::max<size_t>(1, rays.size());
+        double time = bestTime(opts, scene, rays);
+        std::printf("%-8s %5d %-8s %8zu %10.1f %10.2f %9.2f%s\n", raySets[r].name, leafWidth, name, numNodes,
+                    nodeReads / n, leafTests / n, n / time * 1e-6, match ? "" : "  hits differ");
+    }
+}
+
+// the scene built for leaves of 1, 4 and 8 spheres. Every tree is traversed
+// with its spheres tested one at a time and, for the wider leaves, in blocks
+// of the leaf width.
+int benchLeafWidth(const Options& opts)
+{
+    std::printf("%-8s %5s %-8s %8s %10s %10s %9s\n", "rays", "width", "leaves", "nodes", "nodes/ray", "tests/ray",
+                "Mrays/s");
+    bool allMatch = true;
+    for (int leafWidth : { 1, 4, 8 }) {
+        SceneBuildOptions build = opts.build;
+        build.sah.leaf_width = leafWidth;
+        build.sah.max_leaf_size = std::max(build.sah.max_leaf_size, leafWidth);
+        SceneBuffer buffer(createScene(opts.sceneSize, build, opts.sceneSeed));
+        tracer::Scene scene = sceneView(buffer);
+        auto raySets = makeRays(opts, scene);
+        std::vector<std::vector<int>> expected;
+        for (const auto& set : raySets) {
+            expected.push_back(traceAll(scene, set.rays));
+        }
+
+        tracer::LayoutScene<Node> scalar(scene, buffer.nodes.data());
+        benchLeaves<Sphere>(opts, "scalar", leafWidth, buffer.nodes.size(), scalar, raySets, expected, allMatch);
+        std::vector<Node> nodes = buffer.nodes;
+        if (leafWidth == 4) {
+            auto blocks = tracer::packSphereBlocks<4>(scene, nodes);
+            tracer::SoaLeafScene<4> soa(scene, nodes.data(), blocks.data());
+            benchLeaves<tracer::SphereBlock<4>>(opts, "simd", leafWidth, nodes.size(), soa, raySets, expected, allMatch);
+        } else if (leafWidth == 8) {
+            auto blocks = tracer::packSphereBlocks<8>(scene, nodes);
+            tracer::SoaLeafScene<8> soa(scene, nodes.data(), blocks.data());
+            benchLeaves<tracer::SphereBlock<8>>(opts, "simd", leafWidth, nodes.size(), soa, raySets, expected, allMatch);
+        }
+    }
+    return allMatch ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// the default scene with its ground as a plane outside the bvh against the
+// sphere of radius 1000 it used to be, whose box holds the whole scene. Both
+// trace the rays made with the plane.
+int benchGround(const Options& opts)
+{
+    Scene withPlane = createScene(opts.sceneSize, opts.build, opts.sceneSeed);
+    Scene withSphere = createScene(opts.sceneSize, opts.build, opts.sceneSeed);
+    withSphere.planes.clear();
+    withSphere.objects.insert(withSphere.objects.begin(),
+                              SphereObject(glm::vec3(0, -1000, 0), 1000.0f, Diffuse, glm::vec3(0.5f)));
+    if (opts.build.builder == BVHBuilder::SAHTree) {
+        std::vector<object*> objects;
+        for (auto& o : withSphere.objects) {
+            objects.push_back(&o);
+        }
+        withSphere.root = std::make_unique<bvh_node>(objects.data(), objects.size(), opts.build.sah);
+    }
+
+    SceneBuffer planeBuffer(withPlane);
+    SceneBuffer sphereBuffer(withSphere);
+    auto raySets = makeRays(opts, sceneView(planeBuffer));
+    std::printf("%zu primary and %zu diffuse rays\n\n", raySets[0].rays.size(), raySets[1].rays.size());
+    std::printf("%-8s %-7s %8s %10s %10s %9s\n", "rays", "ground", "nodes", "nodes/ray", "tests/ray", "Mrays/s");
+    for (const RaySet& set : raySets) {
+        for (const SceneBuffer* buffer : { &sphereBuffer, &planeBuffer }) {
+            tracer::Scene scene = sceneView(*buffer);
+            tracer::LayoutScene<Node> layoutScene(scene, buffer->nodes.data());
+            std::uint64_t nodeReads = 0;
+            std::uint64_t sphereTests = 0;
+            auto probe = [&](const void*, size_t bytes) {
+                nodeReads += bytes == sizeof(Node);
+                sphereTests += bytes == sizeof(Sphere);
+            };
+            for (const auto& ray : set.rays) {
+                float tmax = INFINITY;
+                layoutScene.closestHit(ray, tracer::MinHitDistance, tmax, probe);
+            }
+
+            double n = (double)std::max<size_t>(1, set.rays.size());
+            std::printf("%-8s %-7s %8zu %10.1f %10.2f %9.2f\n", set.name, buffer == &planeBuffer ? "plane" : "sphere",
+                        buffer->nodes.size(), nodeReads / n, sphereTests / n, n / bestTime(opts, scene, set.rays) * 1e-6);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    if (!parseArgs(argc, argv, opts)) {
+        return EXIT_FAILURE;
+    }
+
+    if (opts.benchmark == "instances") {
+        return benchInstances(opts);
+    }
+    if (opts.benchmark == "wavefront") {
+        return benchWavefront(opts);
+    }
+    if (opts.benchmark == "leaf-width") {
+        return benchLeafWidth(opts);
+    }
+    if (opts.benchmark == "ground") {
+        return benchGround(opts);
+    }
+
+    SceneBuffer buffer(createScene(opts.sceneSize, opts.build, opts.sceneSeed));
+    std::printf("scene: %zu spheres, %zu nodes\n", buffer.objects.size(), buffer.nodes.size());
+
+    if (opts.benchmark == "layouts") {
+        return benchLayouts(opts, buffer);
+    }
+    if (opts.benchmark == "refit") {
+        return benchRefit(opts, buffer);
+    }
+    if (opts.benchmark == "ray-sorting") {
+        return benchRaySorting(opts, buffer);
+    }
+    if (opts.benchmark == "tile-frustum") {
+        return benchTileFrustum(opts, buffer);
+    }
+    std::fprintf(stderr, "unknown benchmark %s\n", opts.benchmark.c_str());
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+}
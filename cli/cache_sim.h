@@ -0,0 +1,93 @@
+//
+//  cache_sim.h
+//  raytracer-cli
+//
+//  Set associative cache with LRU replacement that counts the lines a
+//  traversal misses, independent of the hardware the benchmark runs on.
+//
+
+#ifndef CACHE_SIM_H
+#define CACHE_SIM_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class CacheSim
+{
+public:
+    // the misses of this level are looked up in next
+    CacheSim(size_t sizeBytes, int lineBytes, int ways, CacheSim* next = nullptr)
+        : m_lineShift(0)
+        , m_ways(ways)
+        , m_next(next)
+    {
+        while ((1 << m_lineShift) < lineBytes) {
+            ++m_lineShift;
+        }
+        m_numSets = std::max<size_t>(1, sizeBytes / ((size_t)lineBytes * ways));
+        m_tags.assign(m_numSets * ways, Invalid);
+    }
+
+    // touches every line of [p, p + bytes), returns the number of misses
+    int access(const void* p, size_t bytes)
+    {
+        uintptr_t first = (uintptr_t)p >> m_lineShift;
+        uintptr_t last = ((uintptr_t)p + bytes - 1) >> m_lineShift;
+        int misses = 0;
+        for (uintptr_t line = first; line <= last; ++line) {
+            if (!accessLine(line)) {
+                ++misses;
+                if (m_next) {
+                    m_next->access((const void*)(line << m_lineShift), 1);
+                }
+            }
+        }
+        m_accesses += last - first + 1;
+        m_misses += misses;
+        return misses;
+    }
+
+    uint64_t accesses() const { return m_accesses; }
+    uint64_t misses() const { return m_misses; }
+
+    void flush()
+    {
+        std::fill(m_tags.begin(), m_tags.end(), Invalid);
+    }
+
+    void resetCounters()
+    {
+        m_accesses = 0;
+        m_misses = 0;
+    }
+private:
+    static constexpr uintptr_t Invalid = ~(uintptr_t)0;
+
+    // the ways of a set are kept from most to least recently used
+    bool accessLine(uintptr_t line)
+    {
+        uintptr_t* set = &m_tags[(line % m_numSets) * m_ways];
+        int i = 0;
+        while (i < m_ways - 1 && set[i] != line) {
+            ++i;
+        }
+        bool hit = set[i] == line;
+        for (; i > 0; --i) {
+            set[i] = set[i - 1];
+        }
+        set[0] = line;
+        return hit;
+    }
+
+    int m_lineShift;
+    int m_ways;
+    CacheSim* m_next;
+    size_t m_numSets;
+    std::vector<uintptr_t> m_tags;
+    uint64_t m_accesses = 0;
+    uint64_t m_misses = 0;
+};
+
+#endif // CACHE_SIM_H
@@ -0,0 +1,231 @@
+//
+//  check.cpp
+//  raytracer-check
+//
+//  Correctness checks of the CPU tracer core, run by ctest. Each check
+//  prints what it compared and fails if anything disagreed, so that a
+//  regression fails the tests instead of only showing up in the output of
+//  a benchmark.
+//
+
+#include "common.h"
+#include "mesh.h"
+#include "sampler.h"
+#include "scene.h"
+#include "tracer.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+
+// the rays of every check come from an image of this size
+constexpr int Width = 160;
+constexpr int Height = 90;
+constexpr uint Seed = 1;
+constexpr int NumInstances = 256;
+
+void printUsage(const char* program)
+{
+    std::printf("usage: %s <check>\n"
+                "checks:\n"
+                "  brute-force                      bvh hits against testing every primitive on box meshes and instances\n",
+                program);
+}
+
+// the cube [-1, 1]^3, every face lies on an axis aligned plane
+TriangleMesh makeBox()
+{
+    TriangleMesh mesh;
+    for (int i = 0; i < 8; ++i) {
+        mesh.positions.emplace_back(i & 1 ? 1 : -1, i & 2 ? 1 : -1, i & 4 ? 1 : -1);
+    }
+    const int quads[6][4] = {
+        { 0, 2, 3, 1 }, { 4, 5, 7, 6 }, { 0, 1, 5, 4 }, { 2, 6, 7, 3 }, { 0, 4, 6, 2 }, { 1, 3, 7, 5 },
+    };
+    for (const auto& quad : quads) {
+        mesh.indices.insert(mesh.indices.end(), { quad[0], quad[1], quad[2], quad[0], quad[2], quad[3] });
+    }
+    return mesh;
+}
+
+struct RaySet
+{
+    const char* name;
+    std::vector<tracer::Ray> rays;
+};
+
+// primary rays through the pixel centers, a diffuse bounce from every
+// primary hit and random rays aimed at the boxes from all sides above the
+// ground. Every box is the unit cube moved by its map.
+std::vector<RaySet> makeRays(const tracer::Scene& scene, const std::vector<glm::mat4>& boxes)
+{
+    tracer::Camera camera = makeCamera(Width, Height);
+    RaySet primary{ "primary", {} };
+    for (int y = 0; y < Height; ++y) {
+        for (int x = 0; x < Width; ++x) {
+            primary.rays.push_back(camera.getRay(math::float2(x + 0.5f, y + 0.5f)));
+        }
+    }
+
+    RaySet diffuse{ "diffuse", {} };
+    tracer::Random random(Seed);
+    for (const tracer::Ray& ray : primary.rays) {
+        tracer::HitRecord rec;
+        if (scene.hit<false>(ray, tracer::MinHitDistance, INFINITY, rec)) {
+            diffuse.rays.push_back({ rec.pt, rec.normal + random.inUnitSphere() });
+        }
+    }
+
+    RaySet aimed{ "aimed", {} };
+    for (int i = 0; i < Width * Height; ++i) {
+        math::uint4 bits = tracer::philox(math::uint4((uint)i, 0, 0, 0), math::uint2(Seed, 2));
+        math::uint4 more = tracer::philox(math::uint4((uint)i, 1, 0, 0), math::uint2(Seed, 2));
+        glm::vec4 inBox(tracer::toUnitFloat(bits.x), tracer::toUnitFloat(bits.y), tracer::toUnitFloat(bits.z), 1.0f);
+        math::float3 target(boxes[bits.w % boxes.size()] * inBox);
+        math::float3 origin = math::normalize(tracer::sampleUnitBall(tracer::toUnitFloat(more.x),
+                                                                     tracer::toUnitFloat(more.y),
+                                                                     tracer::toUnitFloat(more.z))) * 10.0f;
+        // from outside the box and above the ground, whose plane the bottom
+        // of the box lies on
+        origin.y = std::fabs(origin.y);
+        aimed.rays.push_back({ target + origin, -origin });
+    }
+    return { primary, diffuse, aimed };
+}
+
+// the closest primitive of the ray found by testing every one of them, tmax
+// receives its distance and instance the instance it was hit in or -1. The
+// triangles after the first numWorldTriangles belong to the one geometry
+// that all instances place.
+int bruteForceHit(const tracer::Scene& scene, const SceneBuffer& buffer, int numWorldTriangles, tracer::Ray ray,
+                  float tmin, float& tmax, int& instance)
+{
+    int primIndex = scene.closestPlane(ray, tmin, tmax);
+    instance = -1;
+    for (int i = 0; i < scene.numSpheres(); ++i) {
+        float t = tracer::intersectSphere(scene.getSphere(i), ray, tmin, tmax);
+        if (t != -1 && t < tmax) {
+            tmax = t;
+            primIndex = i;
+        }
+    }
+    tracer::TriangleRay triRay = tracer::makeTriangleRay(ray);
+    for (int i = 0; i < numWorldTriangles; ++i) {
+        float t = tracer::intersectTriangle(scene.getTriangle(i), triRay, tmin, tmax);
+        if (t != -1 && t < tmax) {
+            tmax = t;
+            primIndex = scene.numSpheres() + i;
+        }
+    }
+    for (int k = 0; k < (int)buffer.instances.size(); ++k) {
+        // the same object space ray as the traversal enters the instance with
+        tracer::TriangleRay objectRay = tracer::makeTriangleRay(tracer::transformRay(buffer.instances[k], ray));
+        for (int i = numWorldTriangles; i < scene.numTriangles(); ++i) {
+            float t = tracer::intersectTriangle(scene.getTriangle(i), objectRay, tmin, tmax);
+            if (t != -1 && t < tmax) {
+                tmax = t;
+                primIndex = scene.numSpheres() + i;
+                instance = k;
+            }
+        }
+    }
+    return primIndex;
+}
+
+// compares the bvh of the scene with testing every primitive
+bool compareWithBruteForce(const char* name, const Scene& world, const std::vector<glm::mat4>& boxes)
+{
+    SceneBuffer buffer(world);
+    tracer::Scene scene = sceneView(buffer);
+    bool allMatch = true;
+    for (const RaySet& set : makeRays(scene, boxes)) {
+        int hits = 0;
+        int mismatches = 0;
+        for (const tracer::Ray& ray : set.rays) {
+            float tmax = INFINITY;
+            int instance;
+            int primIndex = scene.closestHit(ray, tracer::MinHitDistance, tmax, instance);
+            float bruteTmax = INFINITY;
+            int bruteInstance;
+            int brutePrimIndex = bruteForceHit(scene, buffer, (int)world.triangles.size(), ray,
+                                               tracer::MinHitDistance, bruteTmax, bruteInstance);
+            hits += primIndex != -1;
+            // ties between primitives may go either way, the distance may not
+            mismatches += (primIndex == -1) != (brutePrimIndex == -1) || tmax != bruteTmax;
+        }
+        allMatch = allMatch && mismatches == 0;
+        std::printf("%-10s %-8s %8zu %8d %10d\n", name, set.name, set.rays.size(), hits, mismatches);
+    }
+    return allMatch;
+}
+
+// the bvh against testing every primitive on scenes with axis aligned
+// boxes, whose leaves have flat bounds: a box mesh in world space and
+// instances of a box geometry, whose bottom level leaves are flat in
+// object space, once next to spheres and once on their own
+int checkBruteForce()
+{
+    Material material;
+    material.type = Diffuse;
+    material.albedo = glm::vec3(0.7f);
+    material.prop = 0;
+    TriangleMesh box = makeBox();
+
+    // the mesh spans [-1, 1] x [0, 2] x [1, 3]
+    Scene meshScene = createScene(2, {}, Seed);
+    addMesh(meshScene, box, material, glm::vec3(0, 0, 2), 2.0f);
+    std::vector<glm::mat4> meshBoxes = { glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(-1, 0, 1)),
+                                                    glm::vec3(2.0f)) };
+
+    // the geometry spans [-0.5, 0.5] x [0, 1] x [-0.5, 0.5]
+    std::vector<glm::mat4> instanceBoxes;
+    auto placeInstances = [&](Scene& scene) {
+        int geometry = addGeometry(scene, box, material);
+        instanceBoxes.clear();
+        for (int i = 0; i < NumInstances; ++i) {
+            math::uint4 bits = tracer::philox(math::uint4((uint)i, 0, 0, 0), math::uint2(Seed, 3));
+            glm::vec3 position(20 * tracer::toUnitFloat(bits.x) - 10, 0, 20 * tracer::toUnitFloat(bits.y) - 10);
+            glm::mat4 toWorld = glm::translate(glm::mat4(1.0f), position);
+            toWorld = glm::rotate(toWorld, 2 * tracer::Pi * tracer::toUnitFloat(bits.z), glm::vec3(0, 1, 0));
+            toWorld = glm::scale(toWorld, glm::vec3(0.5f + tracer::toUnitFloat(bits.w)));
+            scene.instances.push_back({ geometry, toWorld });
+            instanceBoxes.push_back(glm::translate(toWorld, glm::vec3(-0.5f, 0, -0.5f)));
+        }
+    };
+
+    std::printf("%-10s %-8s %8s %8s %10s\n", "scene", "rays", "count", "hits", "mismatches");
+    bool allMatch = compareWithBruteForce("mesh", meshScene, meshBoxes);
+    Scene instanced = createScene(2, {}, Seed);
+    placeInstances(instanced);
+    allMatch = compareWithBruteForce("instances", instanced, instanceBoxes) && allMatch;
+    // nothing but the instances, the top level is the whole bvh
+    Scene onlyInstances;
+    placeInstances(onlyInstances);
+    allMatch = compareWithBruteForce("only inst", onlyInstances, instanceBoxes) && allMatch;
+    return allMatch ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!std::strcmp(argv[1], "brute-force")) {
+        return checkBruteForce();
+    }
+    if (std::strcmp(argv[1], "--help")) {
+        std::fprintf(stderr, "unknown check %s\n", argv[1]);
+    }
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,87 @@
+#include "common.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+tracer::Camera makeCamera(int width, int height)
+{
+    return tracer::Camera(CameraPos, CameraLookAt, math::float3(0, 1, 0),
+                          FovY, FocalLength, glm::vec2(width, height));
+}
+
+tracer::Scene sceneView(const SceneBuffer& buffer)
+{
+    tracer::Scene scene(buffer.nodes.data(), buffer.objects.data(), buffer.materials.data(),
+                        (int)buffer.objects.size());
+    scene.setTriangles(buffer.triangles.data(), buffer.meshMaterials.data(), (int)buffer.triangles.size());
+    scene.setInstances(buffer.instances.data());
+    scene.setPlanes(buffer.planes.data(), (int)buffer.planes.size());
+    return scene;
+}
+
+double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+bool parseInt(const char* str, int minValue, int& value)
+{
+    char* end;
+    long v = std::strtol(str, &end, 10);
+    if (end == str || *end != '\0' || v < minValue || v > INT32_MAX) {
+        return false;
+    }
+    value = (int)v;
+    return true;
+}
+
+bool parseFloat(const char* str, float minValue, float& value)
+{
+    char* end;
+    float v = std::strtof(str, &end);
+    if (end == str || *end != '\0' || !(v >= minValue) || std::isinf(v)) {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+namespace
+{
+
+const struct
+{
+    tracer::BVHLayout layout;
+    const char* name;
+} LayoutNames[] = {
+    { tracer::BVHLayout::Preorder, "preorder" },
+    { tracer::BVHLayout::Aligned, "aligned" },
+    { tracer::BVHLayout::DepthFirst, "depth-first" },
+    { tracer::BVHLayout::VanEmdeBoas, "veb" },
+    { tracer::BVHLayout::Compressed, "compressed" },
+};
+
+} // anonymous namespace
+
+bool parseLayout(const char* str, tracer::BVHLayout& layout)
+{
+    for (const auto& entry : LayoutNames) {
+        if (!std::strcmp(str, entry.name)) {
+            layout = entry.layout;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* layoutName(tracer::BVHLayout layout)
+{
+    for (const auto& entry : LayoutNames) {
+        if (entry.layout == layout) {
+            return entry.name;
+        }
+    }
+    return "unknown";
+}
@@ -0,0 +1,42 @@
+//
+//  common.h
+//  raytracer-cli
+//
+//  Setup shared by the headless renderer and the benchmarks.
+//
+
+#ifndef CLI_COMMON_H
+#define CLI_COMMON_H
+
+#include "bvh_layout.h"
+#include "scene.h"
+#include "tracer.h"
+
+#include <glm/glm.hpp>
+#include <chrono>
+
+// camera setup matching -[Renderer _initSceneWithView:]
+const glm::vec3 CameraPos(13, 2, 3);
+const glm::vec3 CameraLookAt(0);
+const float FocalLength = 1.0f;
+const float FovY = glm::radians(60.0f);
+const glm::vec3 BackgroundColor(0.5f, 0.7f, 1.0f);
+
+tracer::Camera makeCamera(int width, int height);
+
+// the tracer's view of the spheres, triangles and planes of the buffer
+tracer::Scene sceneView(const SceneBuffer& buffer);
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start);
+
+// parse the whole string, false if it is no number or below minValue
+bool parseInt(const char* str, int minValue, int& value);
+bool parseFloat(const char* str, float minValue, float& value);
+
+// preorder, aligned, depth-first, veb or compressed
+bool parseLayout(const char* str, tracer::BVHLayout& layout);
+const char* layoutName(tracer::BVHLayout layout);
+
+#endif // CLI_COMMON_H
@@ -0,0 +1,22 @@
+# renders a small image with raytracer-cli once with the default traversal
+# and once with the options of a variant, which has to give the same bytes
+#
+#   cmake -DCLI=<raytracer-cli> -DNAME=<variant> -DARGS=<options> -P compare_render.cmake
+
+set(options "${ARGS}")
+separate_arguments(ARGS UNIX_COMMAND "${ARGS}")
+set(image -w 64 -h 36 -s 2)
+
+execute_process(COMMAND ${CLI} ${image} -o ${NAME}-reference.ppm RESULT_VARIABLE result OUTPUT_QUIET)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "the reference render failed")
+endif()
+execute_process(COMMAND ${CLI} ${image} ${ARGS} -o ${NAME}.ppm RESULT_VARIABLE result OUTPUT_QUIET)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "the render with ${options} failed")
+endif()
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${NAME}-reference.ppm ${NAME}.ppm RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${options} renders another image than the default traversal")
+endif()
@@ -0,0 +1,45 @@
+#include "image_io.h"
+
+#include <cmath>
+#include <cstdio>
+#include <memory>
+
+namespace
+{
+
+unsigned char toSRGB8(float c)
+{
+    c = glm::clamp(c, 0.0f, 1.0f);
+    c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+    return (unsigned char)(c * 255.0f + 0.5f);
+}
+
+struct FileCloser
+{
+    void operator()(FILE* f) const { std::fclose(f); }
+};
+
+} // anonymous namespace
+
+bool writePPM(const std::string& path, int width, int height, const std::vector<glm::vec3>& pixels)
+{
+    std::unique_ptr<FILE, FileCloser> file(std::fopen(path.c_str(), "wb"));
+    if (!file) {
+        return false;
+    }
+
+    std::fprintf(file.get(), "P6\n%d %d\n255\n", width, height);
+    std::vector<unsigned char> row(width * 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const glm::vec3& c = pixels[x + y * width];
+            for (int i = 0; i < 3; ++i) {
+                row[x * 3 + i] = toSRGB8(c[i]);
+            }
+        }
+        if (std::fwrite(row.data(), 1, row.size(), file.get()) != row.size()) {
+            return false;
+        }
+    }
+    return true;
+}
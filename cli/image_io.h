@@ -0,0 +1,11 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+// writes linear colors as a binary 8-bit sRGB ppm, rows from top to bottom
+bool writePPM(const std::string& path, int width, int height, const std::vector<glm::vec3>& pixels);
+
+#endif // IMAGE_IO_H
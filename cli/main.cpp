@@ -0,0 +1,1160 @@
+//
+//  main.cpp
+//  raytracer-cli
+//
+//  Headless CPU renderer built on the portable tracer core.
+//
+
+#include "accumulation.h"
+#include "bvh_layout.h"
+#include "blue_noise.h"
+#include "bvh_report.h"
+#include "common.h"
+#include "image_io.h"
+#include "ray_packet.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "soa_leaves.h"
+#include "tile_frustum.h"
+#include "tile_scheduler.h"
+#include "tracer.h"
+#include "utils.h"
+#include "wavefront.h"
+#include "wide_bvh.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace
+{
+
+enum class BVHType
+{
+    Binary,
+    Wide4,
+    Wide8,
+};
+
+enum class SamplerType
+{
+    Random,
+    Philox,
+    Sobol,
+    BlueNoise,
+};
+
+// edge length of the tiled blue noise mask
+constexpr int BlueNoiseSize = 64;
+
+struct Options
+{
+    int width = 1280;
+    int height = 720;
+    int numSamples = 16;
+    int numThreads = 0;
+    int tileSize = 16;
+    uint seed = 0;
+    int firstSample = 0;
+    SamplerType sampler = SamplerType::Random;
+    uint sceneSeed = 1;
+    int sceneSize = 11;
+    // an OBJ mesh placed in the scene next to the spheres
+    std::string obj;
+    glm::vec3 objPosition = glm::vec3(0, 0, 2);
+    float objHeight = 2.0f;
+    MaterialType objMaterial = Diffuse;
+    // 0 places the mesh once, otherwise this many instances of it are
+    // scattered over the scene
+    int objInstances = 0;
+    // binary file the built scene is mapped from, written when it is missing
+    // or made from other inputs
+    std::string sceneCache;
+    SceneBuildOptions build;
+    bool bvhReport = false;
+    bool bruteForce = false;
+    bool packets = false;
+    // primary rays only test the leaves the frustum of their tile overlaps
+    bool tileFrustum = false;
+    // paths in flight per worker of the wavefront tracer, 0 traces every
+    // path on its own
+    int wavefront = 0;
+    bool sortRays = false;
+    BVHType bvh = BVHType::Binary;
+    tracer::BVHLayout layout = tracer::BVHLayout::Preorder;
+    // 0 renders numSamples everywhere, otherwise numSamples is the most a
+    // pixel gets and sampling stops once its relative error drops below
+    float adaptiveThreshold = 0;
+    int minSamples = 8;
+    std::string heatmap;
+    int minDepth = tracer::DefaultMinDepth;
+    int maxDepth = tracer::DefaultMaxDepth;
+    bool russianRoulette = false;
+    bool pathHistogram = false;
+    int tonemap = TonemapClamp;
+    float exposure = 1.0f;
+    std::string output = "out.ppm";
+};
+
+void printUsage(const char* program)
+{
+    std::printf("usage: %s [options]\n"
+                "  -o, --output <file>              output ppm file (default out.ppm)\n"
+                "  -w, --width <n>                  image width (default 1280)\n"
+                "  -h, --height <n>                 image height (default 720)\n"
+                "  -s, --spp <n>                    samples per pixel (default 16)\n"
+                "  -t, --threads <n>                worker threads, 0 for all cores (default 0)\n"
+                "      --tile-size <n>              edge length of the scheduled pixel tiles (default 16)\n"
+                "      --seed <n>                   sampling seed (default 0)\n"
+                "      --sampler <type>             random, philox, sobol or blue-noise (default random)\n"
+                "      --first-sample <n>           index of the first sample, splits a render into runs\n"
+                "                                   with the counter based samplers (default 0)\n"
+                "      --adaptive <x>               sample each pixel until its relative error is below x,\n"
+                "                                   --spp becomes the maximum (default off)\n"
+                "      --min-spp <n>                samples every pixel gets with --adaptive (default 8)\n"
+                "      --heatmap <file>             write the samples per pixel as a ppm\n"
+                "      --max-depth <n>              bounces a path takes at most (default %d)\n"
+                "      --min-depth <n>              bounces before russian roulette may end a path (default %d)\n"
+                "      --russian-roulette           end low throughput paths early, unbiased\n"
+                "      --path-histogram             print how many paths had each length\n"
+                "      --tonemap <type>             clamp, reinhard or aces (default clamp)\n"
+                "      --exposure <x>               scale applied before tonemapping (default 1)\n"
+                "      --scene-seed <n>             seed used to generate the scene (default 1)\n"
+                "      --scene-size <n>             half extent of the grid of small spheres (default 11)\n"
+                "      --scene-cache <file>         map the built scene from file, build and write it if it\n"
+                "                                   is missing or was made from other options\n"
+                "      --obj <file>                 add the triangles of a Wavefront OBJ mesh to the scene\n"
+                "      --obj-pos <x,y,z>            where the bottom of the mesh is placed (default 0,0,2)\n"
+                "      --obj-height <x>             height the mesh is scaled to (default 2)\n"
+                "      --obj-material <type>        diffuse, metal or glass (default diffuse)\n"
+                "      --obj-instances <n>          scatter n instances of the mesh instead (default 0)\n"
+                "      --brute-force                test every sphere instead of traversing the bvh\n"
+                "      --packets                    trace primary rays in %d-wide simd packets\n"
+                "      --tile-frustum               cull the bvh against the frustum of every tile once and\n"
+                "                                   test its primary rays against the leaves left (default off)\n"
+                "      --wavefront <n>              trace square tiles of up to n pixels a bounce at a time,\n"
+                "                                   shading each material in a batch of its own (default off)\n"
+                "      --sort-rays                  sort the secondary rays of --wavefront by origin and direction\n"
+                "      --bvh <type>                 binary, wide4 or wide8 (default binary)\n"
+                "      --layout <type>              binary bvh node layout, preorder, aligned, depth-first,\n"
+                "                                   veb or compressed (default preorder)\n"
+                "      --builder <type>             bvh builder, sah, sah-tree or lbvh (default sah)\n"
+                "      --morton-bits <n>            lbvh morton code bits, 30 or 63 (default 30)\n"
+                "      --treelet-passes <n>         lbvh treelet restructuring passes (default 0)\n"
+                "      --max-leaf-size <n>          largest leaf the sah may keep (default 4)\n"
+                "      --leaf-width <n>             spheres tested at once in simd leaves, 1, 4 or 8, the sah\n"
+                "                                   keeps leaves of up to n spheres (default 1)\n"
+                "      --sah-traversal-cost <x>     sah cost of visiting a node (default 1)\n"
+                "      --sah-intersection-cost <x>  sah cost of testing a sphere (default 1)\n"
+                "      --bvh-report                 print the quality of the built bvh and exit\n"
+                "      --help                       show this message\n",
+                program, tracer::DefaultMaxDepth, tracer::DefaultMinDepth, tracer::PacketWidth);
+}
+
+bool parseArgs(int argc, char** argv, Options& opts)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        auto isArg = [arg](const char* shortName, const char* longName) {
+            return (shortName && !std::strcmp(arg, shortName)) || !std::strcmp(arg, longName);
+        };
+        auto nextValue = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                std::fprintf(stderr, "missing value for %s\n", arg);
+                return nullptr;
+            }
+            return argv[++i];
+        };
+        auto nextInt = [&](int minValue, int& value) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            if (!parseInt(str, minValue, value)) {
+                std::fprintf(stderr, "invalid value for %s: %s\n", arg, str);
+                return false;
+            }
+            return true;
+        };
+        auto nextFloat = [&](float minValue, float& value) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            if (!parseFloat(str, minValue, value)) {
+                std::fprintf(stderr, "invalid value for %s: %s\n", arg, str);
+                return false;
+            }
+            return true;
+        };
+
+        int value;
+        if (isArg("-o", "--output")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            opts.output = str;
+        } else if (isArg("-w", "--width")) {
+            if (!nextInt(1, opts.width)) {
+                return false;
+            }
+        } else if (isArg("-h", "--height")) {
+            if (!nextInt(1, opts.height)) {
+                return false;
+            }
+        } else if (isArg("-s", "--spp")) {
+            if (!nextInt(1, opts.numSamples)) {
+                return false;
+            }
+        } else if (isArg("-t", "--threads")) {
+            if (!nextInt(0, opts.numThreads)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--tile-size")) {
+            if (!nextInt(1, opts.tileSize)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--seed")) {
+            if (!nextInt(0, value)) {
+                return false;
+            }
+            opts.seed = (uint)value;
+        } else if (isArg(nullptr, "--scene-seed")) {
+            if (!nextInt(0, value)) {
+                return false;
+            }
+            opts.sceneSeed = (uint)value;
+        } else if (isArg(nullptr, "--scene-size")) {
+            if (!nextInt(0, opts.sceneSize)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--scene-cache")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            opts.sceneCache = str;
+        } else if (isArg(nullptr, "--obj")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            opts.obj = str;
+        } else if (isArg(nullptr, "--obj-pos")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            glm::vec3& p = opts.objPosition;
+            char end;
+            if (std::sscanf(str, "%f,%f,%f%c", &p.x, &p.y, &p.z, &end) != 3) {
+                std::fprintf(stderr, "invalid value for %s: %s\n", arg, str);
+                return false;
+            }
+        } else if (isArg(nullptr, "--obj-height")) {
+            if (!nextFloat(0.0f, opts.objHeight)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--obj-instances")) {
+            if (!nextInt(0, opts.objInstances)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--obj-material")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            if (!std::strcmp(str, "diffuse")) {
+                opts.objMaterial = Diffuse;
+            } else if (!std::strcmp(str, "metal")) {
+                opts.objMaterial = Metal;
+            } else if (!std::strcmp(str, "glass")) {
+                opts.objMaterial = Dielectric;
+            } else {
+                std::fprintf(stderr, "unknown mesh material %s\n", str);
+                return false;
+            }
+        } else if (isArg(nullptr, "--brute-force")) {
+            opts.bruteForce = true;
+        } else if (isArg(nullptr, "--packets")) {
+            opts.packets = true;
+        } else if (isArg(nullptr, "--tile-frustum")) {
+            opts.tileFrustum = true;
+        } else if (isArg(nullptr, "--wavefront")) {
+            if (!nextInt(1, opts.wavefront)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--sort-rays")) {
+            opts.sortRays = true;
+        } else if (isArg(nullptr, "--bvh")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            if (!std::strcmp(str, "binary")) {
+                opts.bvh = BVHType::Binary;
+            } else if (!std::strcmp(str, "wide4")) {
+                opts.bvh = BVHType::Wide4;
+            } else if (!std::strcmp(str, "wide8")) {
+                opts.bvh = BVHType::Wide8;
+            } else {
+                std::fprintf(stderr, "unknown bvh type %s\n", str);
+                return false;
+            }
+        } else if (isArg(nullptr, "--layout")) {
+            const char* str = nextValue();
+            if (!str || !parseLayout(str, opts.layout)) {
+                if (str) {
+                    std::fprintf(stderr, "unknown bvh layout %s\n", str);
+                }
+                return false;
+            }
+        } else if (isArg(nullptr, "--builder")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            if (!std::strcmp(str, "sah")) {
+                opts.build.builder = BVHBuilder::SAH;
+            } else if (!std::strcmp(str, "sah-tree")) {
+                opts.build.builder = BVHBuilder::SAHTree;
+            } else if (!std::strcmp(str, "lbvh")) {
+                opts.build.builder = BVHBuilder::LBVH;
+            } else {
+                std::fprintf(stderr, "unknown bvh builder %s\n", str);
+                return false;
+            }
+        } else if (isArg(nullptr, "--morton-bits")) {
+            if (!nextInt(0, opts.build.lbvh.morton_bits)) {
+                return false;
+            }
+            if (opts.build.lbvh.morton_bits != 30 && opts.build.lbvh.morton_bits != 63) {
+                std::fprintf(stderr, "--morton-bits must be 30 or 63\n");
+                return false;
+            }
+        } else if (isArg(nullptr, "--treelet-passes")) {
+            if (!nextInt(0, opts.build.lbvh.treelet_passes)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--max-leaf-size")) {
+            if (!nextInt(1, opts.build.sah.max_leaf_size)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--leaf-width")) {
+            int& width = opts.build.sah.leaf_width;
+            if (!nextInt(1, width)) {
+                return false;
+            }
+            if (width != 1 && width != 4 && width != 8) {
+                std::fprintf(stderr, "--leaf-width must be 1, 4 or 8\n");
+                return false;
+            }
+        } else if (isArg(nullptr, "--sah-traversal-cost")) {
+            if (!nextFloat(0.0f, opts.build.sah.traversal_cost)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--sah-intersection-cost")) {
+            if (!nextFloat(0.0f, opts.build.sah.intersection_cost)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--sampler")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            if (!std::strcmp(str, "random")) {
+                opts.sampler = SamplerType::Random;
+            } else if (!std::strcmp(str, "philox")) {
+                opts.sampler = SamplerType::Philox;
+            } else if (!std::strcmp(str, "sobol")) {
+                opts.sampler = SamplerType::Sobol;
+            } else if (!std::strcmp(str, "blue-noise")) {
+                opts.sampler = SamplerType::BlueNoise;
+            } else {
+                std::fprintf(stderr, "unknown sampler %s\n", str);
+                return false;
+            }
+        } else if (isArg(nullptr, "--first-sample")) {
+            if (!nextInt(0, opts.firstSample)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--adaptive")) {
+            if (!nextFloat(0.0f, opts.adaptiveThreshold)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--min-spp")) {
+            if (!nextInt(1, opts.minSamples)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--heatmap")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            opts.heatmap = str;
+        } else if (isArg(nullptr, "--max-depth")) {
+            if (!nextInt(1, opts.maxDepth)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--min-depth")) {
+            if (!nextInt(0, opts.minDepth)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--russian-roulette")) {
+            opts.russianRoulette = true;
+        } else if (isArg(nullptr, "--path-histogram")) {
+            opts.pathHistogram = true;
+        } else if (isArg(nullptr, "--tonemap")) {
+            const char* str = nextValue();
+            if (!str) {
+                return false;
+            }
+            if (!std::strcmp(str, "clamp")) {
+                opts.tonemap = TonemapClamp;
+            } else if (!std::strcmp(str, "reinhard")) {
+                opts.tonemap = TonemapReinhard;
+            } else if (!std::strcmp(str, "aces")) {
+                opts.tonemap = TonemapACES;
+            } else {
+                std::fprintf(stderr, "unknown tonemap operator %s\n", str);
+                return false;
+            }
+        } else if (isArg(nullptr, "--exposure")) {
+            if (!nextFloat(0.0f, opts.exposure)) {
+                return false;
+            }
+        } else if (isArg(nullptr, "--bvh-report")) {
+            opts.bvhReport = true;
+        } else {
+            if (std::strcmp(arg, "--help")) {
+                std::fprintf(stderr, "unknown option %s\n", arg);
+            }
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    if (opts.packets && opts.bruteForce) {
+        std::fprintf(stderr, "--packets traverses the bvh and cannot be combined with --brute-force\n");
+        return false;
+    }
+    if (opts.packets && (opts.bvh != BVHType::Binary || opts.layout != tracer::BVHLayout::Preorder)) {
+        std::fprintf(stderr, "--packets only supports the binary bvh in preorder layout\n");
+        return false;
+    }
+    if (opts.tileFrustum && (opts.bruteForce || opts.bvh != BVHType::Binary || opts.layout != tracer::BVHLayout::Preorder)) {
+        std::fprintf(stderr, "--tile-frustum only supports the binary bvh in preorder layout without --brute-force\n");
+        return false;
+    }
+    if (opts.build.sah.leaf_width > 1 &&
+        (opts.packets || opts.tileFrustum || !opts.obj.empty() || opts.bvh != BVHType::Binary ||
+         opts.layout != tracer::BVHLayout::Preorder)) {
+        std::fprintf(stderr, "--leaf-width only supports the binary bvh in preorder layout without --packets, "
+                             "--tile-frustum or --obj\n");
+        return false;
+    }
+    opts.build.sah.max_leaf_size = std::max(opts.build.sah.max_leaf_size, opts.build.sah.leaf_width);
+    if (opts.layout != tracer::BVHLayout::Preorder && opts.bvh != BVHType::Binary) {
+        std::fprintf(stderr, "--layout only applies to the binary bvh\n");
+        return false;
+    }
+    if (opts.packets && opts.sampler != SamplerType::Random) {
+        std::fprintf(stderr, "--packets only supports the random sampler\n");
+        return false;
+    }
+    if (opts.firstSample > 0 && opts.sampler == SamplerType::Random) {
+        std::fprintf(stderr, "--first-sample needs a counter based sampler\n");
+        return false;
+    }
+    if (opts.firstSample > 0 && opts.adaptiveThreshold > 0) {
+        std::fprintf(stderr, "--first-sample does not support --adaptive\n");
+        return false;
+    }
+    if (opts.packets && opts.adaptiveThreshold > 0) {
+        std::fprintf(stderr, "--packets does not support --adaptive\n");
+        return false;
+    }
+    if (opts.tileFrustum && opts.adaptiveThreshold > 0) {
+        std::fprintf(stderr, "--tile-frustum does not support --adaptive\n");
+        return false;
+    }
+    if (opts.wavefront > 0 && (opts.packets || opts.tileFrustum || opts.adaptiveThreshold > 0)) {
+        std::fprintf(stderr, "--wavefront cannot be combined with --packets, --tile-frustum or --adaptive\n");
+        return false;
+    }
+    if (opts.sortRays && opts.wavefront == 0) {
+        std::fprintf(stderr, "--sort-rays requires --wavefront\n");
+        return false;
+    }
+    if (!opts.obj.empty() && (opts.packets || opts.tileFrustum || opts.bvh != BVHType::Binary ||
+                              opts.layout != tracer::BVHLayout::Preorder)) {
+        std::fprintf(stderr, "--obj only supports the binary bvh in preorder layout without --packets or --tile-frustum\n");
+        return false;
+    }
+    if (opts.objInstances > 0 && (opts.obj.empty() || opts.bruteForce)) {
+        std::fprintf(stderr, "--obj-instances needs --obj and cannot be combined with --brute-force\n");
+        return false;
+    }
+    if (opts.layout == tracer::BVHLayout::Compressed && opts.build.sah.max_leaf_size > 127) {
+        std::fprintf(stderr, "the compressed layout holds at most 127 spheres per leaf\n");
+        return false;
+    }
+    return true;
+}
+
+// number of paths of every length, the workers count into a local copy
+// per tile and merge it once the tile is done
+class PathHistogram
+{
+public:
+    explicit PathHistogram(int maxLength)
+        : m_counts(maxLength + 1)
+    {}
+
+    std::vector<std::uint64_t> makeLocal() const
+    {
+        return std::vector<std::uint64_t>(m_counts.size(), 0);
+    }
+
+    void merge(const std::vector<std::uint64_t>& local)
+    {
+        for (size_t i = 0; i < local.size(); ++i) {
+            if (local[i]) {
+                m_counts[i] += local[i];
+            }
+        }
+    }
+
+    void print(FILE* file) const
+    {
+        std::uint64_t total = 0;
+        std::uint64_t rays = 0;
+        for (size_t i = 0; i < m_counts.size(); ++i) {
+            total += m_counts[i];
+            rays += m_counts[i] * i;
+        }
+        std::fprintf(file, "path lengths: %.2f rays per path on average\n", (double)rays / std::max<std::uint64_t>(1, total));
+        for (size_t i = 0; i < m_counts.size(); ++i) {
+            if (m_counts[i]) {
+                double share = (double)m_counts[i] / total;
+                std::fprintf(file, "%6zu %12llu %6.2f%% %s\n", i, (unsigned long long)m_counts[i].load(),
+                             share * 100, std::string((size_t)(share * 50 + 0.5), '#').c_str());
+            }
+        }
+    }
+
+private:
+    std::vector<std::atomic<std::uint64_t>> m_counts;
+};
+
+template<typename SceneT>
+struct RenderContext
+{
+    const Options& opts;
+    const SceneT& scene;
+    const tracer::Camera& camera;
+    AccumulationBuffer& accum;
+    PathHistogram& paths;
+    // BlueNoiseSize squared values, only for the blue noise sampler
+    const std::vector<float>& blueNoise;
+};
+
+template<typename SamplerT, typename SceneT>
+tracer::BasicRayTracer<SceneT, SamplerT> makeTracer(const RenderContext<SceneT>& ctx, SamplerT& sampler)
+{
+    tracer::BasicRayTracer<SceneT, SamplerT> tracer(sampler, ctx.camera, ctx.scene, BackgroundColor);
+    tracer.setPathDepth(ctx.opts.minDepth, ctx.opts.maxDepth, ctx.opts.russianRoulette);
+    return tracer;
+}
+
+// the sampler of the pixel before its first sample
+template<typename SamplerT, typename SceneT>
+SamplerT makeSampler(const RenderContext<SceneT>& ctx, int x, int y)
+{
+    const Options& opts = ctx.opts;
+    if constexpr (std::is_same_v<SamplerT, tracer::PhiloxSampler>) {
+        return tracer::PhiloxSampler(opts.seed);
+    } else if constexpr (std::is_same_v<SamplerT, tracer::SobolSampler>) {
+        return tracer::SobolSampler(opts.seed);
+    } else if constexpr (std::is_same_v<SamplerT, tracer::BlueNoiseSampler>) {
+        return tracer::BlueNoiseSampler(ctx.blueNoise.data(), BlueNoiseSize, opts.seed);
+    } else {
+        return tracer::Random(tracer::pixelSeed(opts.seed, x, y, opts.width));
+    }
+}
+
+// the leaves of the bvh the primary rays of the tile may hit, which all of
+// its samples share. They are rebuilt into the leaves of the worker, which
+// keep their memory from tile to tile.
+const tracer::FrustumLeaves* makeTileLeaves(const RenderContext<tracer::Scene>& ctx, const TileScheduler::Tile& tile,
+                                            std::unique_ptr<tracer::FrustumLeaves>& workerLeaves)
+{
+    if (!workerLeaves) {
+        workerLeaves = std::make_unique<tracer::FrustumLeaves>(ctx.scene);
+    }
+    workerLeaves->build(tracer::makeTileFrustum(ctx.camera, math::float2(tile.x, tile.y),
+                                                math::float2(tile.x + tile.width, tile.y + tile.height)));
+    return workerLeaves.get();
+}
+
+// adds the samples [firstSample, firstSample + numSamples) to the pixel with
+// the sampler the tracer was created with and counts their lengths, returns
+// the number of rays cast. The primary rays only test the given leaves of
+// the tile frustum if there are any.
+template<typename SamplerT, typename SceneT>
+std::uint64_t samplePixel(const RenderContext<SceneT>& ctx, const tracer::BasicRayTracer<SceneT, SamplerT>& tracer,
+                          SamplerT& sampler, int x, int y, int firstSample, int numSamples,
+                          std::vector<std::uint64_t>& pathLengths, const tracer::FrustumLeaves* leaves = nullptr)
+{
+    std::uint64_t numRays = 0;
+    AccumulationPixel samples = {};
+    for (int i = 0; i < numSamples; ++i) {
+        sampler.startSample(math::uint2(x, y), firstSample + i);
+        math::float2 samplePos = math::float2(x, y) + sampler.inUnitRect();
+        int pathRays;
+        math::float3 color;
+        if (ctx.opts.bruteForce) {
+            color = tracer.template trace<true>(samplePos, pathRays);
+        } else if (leaves) {
+            // there are leaves only for tracer::Scene
+            if constexpr (std::is_same_v<SceneT, tracer::Scene>) {
+                tracer::Ray ray = ctx.camera.getRay(samplePos);
+                float t = INFINITY;
+                int primIndex = leaves->closestHit(ray, tracer::MinHitDistance, t);
+                tracer::HitRecord rec;
+                if (primIndex != -1) {
+                    rec = ctx.scene.getHitRecord(ray, t, primIndex);
+                }
+                color = tracer.template traceFrom<false>(ray, primIndex != -1, rec, pathRays);
+            }
+        } else {
+            color = tracer.template trace<false>(samplePos, pathRays);
+        }
+        samples = addSample(samples, color);
+        numRays += pathRays;
+        ++pathLengths[pathRays];
+    }
+    ctx.accum.add(x, y, samples);
+    return numRays;
+}
+
+template<typename SamplerT, typename SceneT>
+std::uint64_t renderTile(const RenderContext<SceneT>& ctx, const TileScheduler::Tile& tile,
+                         std::unique_ptr<tracer::FrustumLeaves>& workerLeaves)
+{
+    const Options& opts = ctx.opts;
+    SamplerT sampler = makeSampler<SamplerT>(ctx, tile.x, tile.y);
+    auto tracer = makeTracer(ctx, sampler);
+    auto pathLengths = ctx.paths.makeLocal();
+    const tracer::FrustumLeaves* leaves = nullptr;
+    if constexpr (std::is_same_v<SceneT, tracer::Scene>) {
+        if (opts.tileFrustum) {
+            leaves = makeTileLeaves(ctx, tile, workerLeaves);
+        }
+    }
+    std::uint64_t numRays = 0;
+    for (int y = tile.y; y < tile.y + tile.height; ++y) {
+        for (int x = tile.x; x < tile.x + tile.width; ++x) {
+            sampler = makeSampler<SamplerT>(ctx, x, y);
+            numRays += samplePixel(ctx, tracer, sampler, x, y, opts.firstSample, opts.numSamples, pathLengths,
+                                   leaves);
+        }
+    }
+    ctx.paths.merge(pathLengths);
+    return numRays;
+}
+
+// renders minSamples everywhere, then keeps doubling the samples of the
+// pixels whose relative error is still above the threshold, or unknown below
+// two samples, until they reach numSamples. Every pixel continues its own
+// sampler from pass to pass.
+template<typename SamplerT, typename SceneT>
+std::uint64_t renderAdaptive(const RenderContext<SceneT>& ctx)
+{
+    const Options& opts = ctx.opts;
+    std::vector<SamplerT> samplers;
+    samplers.reserve((size_t)opts.width * opts.height);
+    for (int y = 0; y < opts.height; ++y) {
+        for (int x = 0; x < opts.width; ++x) {
+            samplers.push_back(makeSampler<SamplerT>(ctx, x, y));
+        }
+    }
+
+    std::atomic<std::uint64_t> totalRays{0};
+    TileScheduler scheduler(opts.numThreads);
+    int numPasses = 0;
+    for (;;) {
+        std::atomic<int> activePixels{0};
+        scheduler.run(opts.width, opts.height, opts.tileSize, [&](const TileScheduler::Tile& tile, int) {
+            SamplerT sampler = samplers[tile.x + tile.y * opts.width];
+            auto tracer = makeTracer(ctx, sampler);
+            auto pathLengths = ctx.paths.makeLocal();
+            std::uint64_t numRays = 0;
+            int numActive = 0;
+            for (int y = tile.y; y < tile.y + tile.height; ++y) {
+                for (int x = tile.x; x < tile.x + tile.width; ++x) {
+                    int count = ctx.accum.at(x, y).count;
+                    int numSamples = std::min(opts.minSamples, opts.numSamples);
+                    if (count > 0) {
+                        numSamples = std::min(count, opts.numSamples - count);
+                        if (numSamples <= 0 || ctx.accum.relativeError(x, y) <= opts.adaptiveThreshold) {
+                            continue;
+                        }
+                    }
+                    SamplerT& pixelSampler = samplers[x + y * opts.width];
+                    sampler = pixelSampler;
+                    numRays += samplePixel(ctx, tracer, sampler, x, y, count, numSamples, pathLengths);
+                    pixelSampler = sampler;
+                    ++numActive;
+                }
+            }
+            ctx.paths.merge(pathLengths);
+            totalRays += numRays;
+            activePixels += numActive;
+        });
+        if (activePixels == 0) {
+            break;
+        }
+        ++numPasses;
+    }
+
+    std::uint64_t totalSamples = 0;
+    for (int y = 0; y < opts.height; ++y) {
+        for (int x = 0; x < opts.width; ++x) {
+            totalSamples += ctx.accum.at(x, y).count;
+        }
+    }
+    std::printf("adaptive: %d passes, %.1f spp on average\n",
+                numPasses, (double)totalSamples / ((double)opts.width * opts.height));
+    return totalRays;
+}
+
+// traces the primary rays of every row of the tile in packets and continues
+// each path on its own, every pixel consumes its random sequence in the same
+// order as renderTile
+std::uint64_t renderTilePackets(const RenderContext<tracer::Scene>& ctx, const TileScheduler::Tile& tile,
+                                std::unique_ptr<tracer::FrustumLeaves>& workerLeaves)
+{
+    constexpr int N = tracer::PacketWidth;
+    const Options& opts = ctx.opts;
+    int numPixels = tile.width * tile.height;
+    std::vector<tracer::Random> randoms;
+    randoms.reserve(numPixels);
+    for (int y = tile.y; y < tile.y + tile.height; ++y) {
+        for (int x = tile.x; x < tile.x + tile.width; ++x) {
+            randoms.emplace_back(tracer::pixelSeed(opts.seed, x, y, opts.width));
+        }
+    }
+    std::vector<AccumulationPixel> samples(numPixels, AccumulationPixel{});
+
+    tracer::Random random(0);
+    auto tracer = makeTracer(ctx, random);
+    auto pathLengths = ctx.paths.makeLocal();
+    const tracer::FrustumLeaves* leaves = nullptr;
+    if (opts.tileFrustum) {
+        leaves = makeTileLeaves(ctx, tile, workerLeaves);
+    }
+    std::uint64_t numRays = 0;
+    for (int i = 0; i < opts.numSamples; ++i) {
+        for (int row = 0; row < tile.height; ++row) {
+            for (int col = 0; col < tile.width; col += N) {
+                int count = std::min(N, tile.width - col);
+                int first = col + row * tile.width;
+                tracer::Ray rays[N];
+                for (int lane = 0; lane < count; ++lane) {
+                    math::float2 pixel(tile.x + col + lane, tile.y + row);
+                    rays[lane] = ctx.camera.getRay(pixel + randoms[first + lane].inUnitRect());
+                }
+
+                tracer::PacketHit<N> hit;
+                auto packet = tracer::makeRayPacket<N>(rays, count);
+                tracer::vmask<N> active = tracer::firstLanes<N>(count);
+                int hitLanes;
+                if (leaves) {
+                    hitLanes = tracer::intersectPacket(ctx.scene, leaves->leaves(), leaves->nearDists(), leaves->size(),
+                                                       packet, active, tracer::MinHitDistance, INFINITY, hit).bits();
+                } else {
+                    hitLanes = tracer::intersectPacket(ctx.scene, packet, active, tracer::MinHitDistance, INFINITY,
+                                                       hit).bits();
+                }
+                for (int lane = 0; lane < count; ++lane) {
+                    bool isHit = hitLanes & (1 << lane);
+                    tracer::HitRecord rec;
+                    if (isHit) {
+                        rec = ctx.scene.getHitRecord(rays[lane], hit.t[lane], hit.primIndex[lane]);
+                    }
+                    random = randoms[first + lane];
+                    int pathRays;
+                    math::float3 color = tracer.traceFrom<false>(rays[lane], isHit, rec, pathRays);
+                    samples[first + lane] = addSample(samples[first + lane], color);
+                    randoms[first + lane] = random;
+                    numRays += pathRays;
+                    ++pathLengths[pathRays];
+                }
+            }
+        }
+    }
+
+    for (int row = 0; row < tile.height; ++row) {
+        for (int col = 0; col < tile.width; ++col) {
+            int index = col + row * tile.width;
+            ctx.accum.add(tile.x + col, tile.y + row, samples[index]);
+        }
+    }
+    ctx.paths.merge(pathLengths);
+    return numRays;
+}
+
+// traces the pixels of every tile as one batch of the wavefront tracer of
+// the worker, the tiles are the largest squares that fit into its queues.
+// Every pixel gets the same samples as from renderTile.
+template<typename SamplerT, typename SceneT>
+std::uint64_t renderWavefront(const RenderContext<SceneT>& ctx)
+{
+    using Wavefront = tracer::WavefrontTracer<SceneT, SamplerT>;
+    const Options& opts = ctx.opts;
+    int tileSize = std::max(1, (int)std::sqrt((double)opts.wavefront));
+    std::vector<std::unique_ptr<Wavefront>> tracers(opts.numThreads);
+    std::atomic<std::uint64_t> totalRays{0};
+    TileScheduler scheduler(opts.numThreads);
+    scheduler.run(opts.width, opts.height, tileSize, [&](const TileScheduler::Tile& tile, int workerIndex) {
+        std::unique_ptr<Wavefront>& wavefront = tracers[workerIndex];
+        if (!wavefront) {
+            wavefront = std::make_unique<Wavefront>(ctx.camera, ctx.scene, BackgroundColor, tileSize * tileSize);
+            wavefront->setPathDepth(opts.minDepth, opts.maxDepth, opts.russianRoulette);
+            wavefront->setRaySorting(opts.sortRays);
+        }
+
+        std::vector<math::uint2> pixels;
+        std::vector<SamplerT> samplers;
+        for (int y = tile.y; y < tile.y + tile.height; ++y) {
+            for (int x = tile.x; x < tile.x + tile.width; ++x) {
+                pixels.emplace_back(x, y);
+                samplers.push_back(makeSampler<SamplerT>(ctx, x, y));
+            }
+        }
+        int count = (int)pixels.size();
+        std::vector<math::float3> colors(count);
+        std::vector<AccumulationPixel> samples(count, AccumulationPixel{});
+        std::vector<int> pathRays(count);
+        auto pathLengths = ctx.paths.makeLocal();
+        std::uint64_t numRays = 0;
+        for (int i = 0; i < opts.numSamples; ++i) {
+            int sampleIndex = opts.firstSample + i;
+            if (opts.bruteForce) {
+                wavefront->template trace<true>(pixels.data(), samplers.data(), sampleIndex, count,
+                                                colors.data(), pathRays.data());
+            } else {
+                wavefront->template trace<false>(pixels.data(), samplers.data(), sampleIndex, count,
+                                                 colors.data(), pathRays.data());
+            }
+            for (int j = 0; j < count; ++j) {
+                samples[j] = addSample(samples[j], colors[j]);
+                numRays += pathRays[j];
+                ++pathLengths[pathRays[j]];
+            }
+        }
+        for (int j = 0; j < count; ++j) {
+            ctx.accum.add(pixels[j].x, pixels[j].y, samples[j]);
+        }
+        ctx.paths.merge(pathLengths);
+        totalRays += numRays;
+    });
+    return totalRays;
+}
+
+template<typename SamplerT, typename SceneT>
+std::uint64_t render(const RenderContext<SceneT>& ctx)
+{
+    const Options& opts = ctx.opts;
+    if (opts.adaptiveThreshold > 0) {
+        return renderAdaptive<SamplerT>(ctx);
+    }
+    if (opts.wavefront > 0) {
+        return renderWavefront<SamplerT>(ctx);
+    }
+    std::vector<std::unique_ptr<tracer::FrustumLeaves>> tileLeaves(opts.numThreads);
+    std::atomic<std::uint64_t> totalRays{0};
+    TileScheduler scheduler(opts.numThreads);
+    scheduler.run(opts.width, opts.height, opts.tileSize, [&](const TileScheduler::Tile& tile, int workerIndex) {
+        if constexpr (std::is_same_v<SceneT, tracer::Scene> && std::is_same_v<SamplerT, tracer::Random>) {
+            if (opts.packets) {
+                totalRays += renderTilePackets(ctx, tile, tileLeaves[workerIndex]);
+                return;
+            }
+        }
+        totalRays += renderTile<SamplerT>(ctx, tile, tileLeaves[workerIndex]);
+    });
+    return totalRays;
+}
+
+template<typename SceneT>
+std::uint64_t render(const RenderContext<SceneT>& ctx)
+{
+    switch (ctx.opts.sampler) {
+    case SamplerType::Philox:
+        return render<tracer::PhiloxSampler>(ctx);
+    case SamplerType::Sobol:
+        return render<tracer::SobolSampler>(ctx);
+    case SamplerType::BlueNoise:
+        return render<tracer::BlueNoiseSampler>(ctx);
+    default:
+        return render<tracer::Random>(ctx);
+    }
+}
+
+Material meshMaterial(const Options& opts)
+{
+    Material material;
+    material.type = opts.objMaterial;
+    material.albedo = opts.objMaterial == Metal ? glm::vec3(0.8f, 0.8f, 0.9f) : glm::vec3(0.7f);
+    material.prop = opts.objMaterial == Dielectric ? 1.5f : 0.05f;
+    return material;
+}
+
+// scatters instances of the geometry over the grid of small spheres with a
+// random turn and size, they only depend on the scene seed
+void addInstances(Scene& scene, int geometry, const Options& opts)
+{
+    for (int i = 0; i < opts.objInstances; ++i) {
+        math::uint4 bits = tracer::philox(math::uint4((uint)i, 0, 0, 0), math::uint2(opts.sceneSeed, 0x5BD1E995u));
+        float extent = (float)opts.sceneSize;
+        glm::vec3 position(extent * (2 * tracer::toUnitFloat(bits.x) - 1), 0,
+                           extent * (2 * tracer::toUnitFloat(bits.y) - 1));
+        float angle = 2 * tracer::Pi * tracer::toUnitFloat(bits.z);
+        float height = opts.objHeight * (0.25f + 0.75f * tracer::toUnitFloat(bits.w));
+
+        glm::mat4 toWorld = glm::translate(glm::mat4(1.0f), position);
+        toWorld = glm::rotate(toWorld, angle, glm::vec3(0, 1, 0));
+        toWorld = glm::scale(toWorld, glm::vec3(height));
+        scene.instances.push_back({ geometry, toWorld });
+    }
+}
+
+// generates the scene of the options and builds its bvh, null if the mesh
+// cannot be loaded
+std::unique_ptr<SceneBuffer> buildScene(const Options& opts)
+{
+    auto buildStart = Clock::now();
+    Scene scene = createScene(opts.sceneSize, opts.build, opts.sceneSeed);
+    double buildTime = secondsSince(buildStart);
+    if (!opts.obj.empty()) {
+        auto loadStart = Clock::now();
+        TriangleMesh mesh;
+        if (!loadOBJ(opts.obj, mesh)) {
+            return nullptr;
+        }
+        std::printf("mesh: %zu vertices, %zu triangles, loaded in %.3f s\n",
+                    mesh.positions.size(), mesh.numTriangles(), secondsSince(loadStart));
+        if (opts.objInstances > 0) {
+            addInstances(scene, addGeometry(scene, mesh, meshMaterial(opts)), opts);
+        } else {
+            addMesh(scene, mesh, meshMaterial(opts), opts.objPosition, opts.objHeight);
+        }
+    }
+
+    buildStart = Clock::now();
+    auto buffer = std::make_unique<SceneBuffer>(scene);
+    buildTime += secondsSince(buildStart);
+    std::printf("scene: %zu spheres, %zu triangles, %zu instances, %zu nodes, built in %.3f s\n",
+                buffer->objects.size(), buffer->triangles.size(), buffer->instances.size(),
+                buffer->nodes.size(), buildTime);
+    if (buffer->peakBuildBytes > 0) {
+        std::printf("build memory: %.1f MB peak\n", buffer->peakBuildBytes / (1024.0 * 1024.0));
+    }
+    return buffer;
+}
+
+// hash of everything buildScene makes the scene from, false if the mesh
+// cannot be read
+bool hashSceneSource(const Options& opts, std::uint64_t& hash)
+{
+    SceneHash source;
+    source.add(opts.sceneSize);
+    source.add(opts.sceneSeed);
+    source.add(opts.build.builder);
+    source.add(opts.build.sah.traversal_cost);
+    source.add(opts.build.sah.intersection_cost);
+    source.add(opts.build.sah.max_leaf_size);
+    source.add(opts.build.sah.leaf_width);
+    source.add(opts.build.lbvh.morton_bits);
+    source.add(opts.build.lbvh.treelet_passes);
+    if (!opts.obj.empty()) {
+        if (!source.addFile(opts.obj)) {
+            return false;
+        }
+        source.add(opts.objPosition.x);
+        source.add(opts.objPosition.y);
+        source.add(opts.objPosition.z);
+        source.add(opts.objHeight);
+        source.add(opts.objMaterial);
+        source.add(opts.objInstances);
+    }
+    hash = source.value();
+    return true;
+}
+
+// the alternative structures are built from a copy of the nodes, the
+// binary bvh uses them in place
+std::vector<Node> nodeVector(const SceneArrays& arrays)
+{
+    return std::vector<Node>(arrays.nodes, arrays.nodes + arrays.numNodes);
+}
+
+std::uint64_t render(const Options& opts, const SceneArrays& arrays, AccumulationBuffer& accum,
+                     PathHistogram& paths)
+{
+    std::vector<float> blueNoise;
+    if (opts.sampler == SamplerType::BlueNoise) {
+        blueNoise = makeBlueNoise(BlueNoiseSize, opts.seed);
+    }
+    tracer::Scene scene(arrays.nodes,
+                        arrays.spheres,
+                        arrays.materials,
+                        static_cast<int>(arrays.numSpheres));
+    scene.setTriangles(arrays.triangles,
+                       arrays.meshMaterials,
+                       static_cast<int>(arrays.numTriangles));
+    scene.setInstances(arrays.instances);
+    scene.setPlanes(arrays.planes, static_cast<int>(arrays.numPlanes));
+    tracer::Camera camera = makeCamera(opts.width, opts.height);
+
+    auto renderWide = [&](auto wideNodes) {
+        constexpr int N = sizeof(wideNodes[0].child) / sizeof(int);
+        std::printf("bvh: %zu %d-wide nodes\n", wideNodes.size(), N);
+        tracer::WideScene<N> wideScene(scene, wideNodes.data());
+        return render(RenderContext<tracer::WideScene<N>>{ opts, wideScene, camera, accum, paths, blueNoise });
+    };
+
+    auto renderLayout = [&](auto layoutNodes) {
+        using NodeT = typename decltype(layoutNodes)::value_type;
+        tracer::LayoutScene<NodeT> layoutScene(scene, layoutNodes.data());
+        return render(RenderContext<tracer::LayoutScene<NodeT>>{ opts, layoutScene, camera, accum, paths, blueNoise });
+    };
+
+    auto renderSoaLeaves = [&](auto width) {
+        constexpr int N = decltype(width)::value;
+        std::vector<Node> nodes = nodeVector(arrays);
+        std::vector<tracer::SphereBlock<N>> blocks = tracer::packSphereBlocks<N>(scene, nodes);
+        std::printf("bvh: %zu %d-wide sphere blocks\n", blocks.size(), N);
+        tracer::SoaLeafScene<N> soaScene(scene, nodes.data(), blocks.data());
+        return render(RenderContext<tracer::SoaLeafScene<N>>{ opts, soaScene, camera, accum, paths, blueNoise });
+    };
+
+    switch (opts.build.sah.leaf_width) {
+    case 4:
+        return renderSoaLeaves(std::integral_constant<int, 4>());
+    case 8:
+        return renderSoaLeaves(std::integral_constant<int, 8>());
+    default:
+        break;
+    }
+
+    switch (opts.bvh) {
+    case BVHType::Wide4:
+        return renderWide(tracer::collapseBVH<4>(nodeVector(arrays)));
+    case BVHType::Wide8:
+        return renderWide(tracer::collapseBVH<8>(nodeVector(arrays)));
+    default:
+        break;
+    }
+
+    switch (opts.layout) {
+    case tracer::BVHLayout::DepthFirst:
+        return renderLayout(tracer::makeDepthFirstNodes(nodeVector(arrays)));
+    case tracer::BVHLayout::Aligned:
+    case tracer::BVHLayout::VanEmdeBoas:
+        return renderLayout(tracer::makeLinkedNodes(nodeVector(arrays), opts.layout));
+    case tracer::BVHLayout::Compressed:
+        return renderLayout(tracer::makeCompressedNodes(nodeVector(arrays)));
+    default:
+        return render(RenderContext<tracer::Scene>{ opts, scene, camera, accum, paths, blueNoise });
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    if (!parseArgs(argc, argv, opts)) {
+        return EXIT_FAILURE;
+    }
+    if (opts.numThreads == 0) {
+        opts.numThreads = utils::hardwareThreads();
+    }
+
+    std::uint64_t sourceHash = 0;
+    if (!opts.sceneCache.empty() && !hashSceneSource(opts, sourceHash)) {
+        std::fprintf(stderr, "failed to read %s\n", opts.obj.c_str());
+        return EXIT_FAILURE;
+    }
+
+    SceneCache cache;
+    std::unique_ptr<SceneBuffer> buffer;
+    SceneArrays arrays;
+    auto mapStart = Clock::now();
+    if (!opts.sceneCache.empty() && cache.open(opts.sceneCache, sourceHash)) {
+        arrays = cache.arrays();
+        std::printf("scene: %zu spheres, %zu triangles, %zu instances, %zu nodes, mapped from %s in %.3f s\n",
+                    arrays.numSpheres, arrays.numTriangles, arrays.numInstances, arrays.numNodes,
+                    opts.sceneCache.c_str(), secondsSince(mapStart));
+    } else {
+        buffer = buildScene(opts);
+        if (!buffer) {
+            return EXIT_FAILURE;
+        }
+        arrays = sceneArrays(*buffer);
+        if (!opts.sceneCache.empty() && !writeSceneCache(opts.sceneCache, sourceHash, *buffer)) {
+            std::fprintf(stderr, "failed to write %s\n", opts.sceneCache.c_str());
+        }
+    }
+    if (opts.bvhReport) {
+        print_bvh_report(stdout, make_bvh_report(nodeVector(arrays), opts.build.sah));
+        return EXIT_SUCCESS;
+    }
+
+    AccumulationBuffer accum(opts.width, opts.height);
+    PathHistogram paths(opts.maxDepth);
+    auto renderStart = Clock::now();
+    std::uint64_t numRays = render(opts, arrays, accum, paths);
+    double renderTime = secondsSince(renderStart);
+
+    std::printf("render: %dx%d, %d spp, %d threads, %.3f s wall time\n",
+                opts.width, opts.height, opts.numSamples, opts.numThreads, renderTime);
+    std::printf("rays: %llu, %.2f Mrays/s\n",
+                (unsigned long long)numRays, numRays / renderTime * 1e-6);
+    ConvergenceStats stats = accum.convergence();
+    if (stats.numPixels > 0) {
+        std::printf("noise: %.2f%% mean, %.2f%% max relative error of %d pixels\n",
+                    stats.meanRelativeError * 100, stats.maxRelativeError * 100, stats.numPixels);
+    }
+    if (stats.numUnmeasured > 0) {
+        std::printf("noise: unknown for %d pixels with fewer than 2 samples\n", stats.numUnmeasured);
+    }
+    if (opts.pathHistogram) {
+        paths.print(stdout);
+    }
+
+    std::vector<glm::vec3> pixels = accum.resolve(opts.tonemap, opts.exposure);
+    if (!writePPM(opts.output, opts.width, opts.height, pixels)) {
+        std::fprintf(stderr, "failed to write %s\n", opts.output.c_str());
+        return EXIT_FAILURE;
+    }
+    if (!opts.heatmap.empty() &&
+        !writePPM(opts.heatmap, opts.width, opts.height, accum.heatmap(opts.numSamples))) {
+        std::fprintf(stderr, "failed to write %s\n", opts.heatmap.c_str());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
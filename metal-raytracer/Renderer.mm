@@ -10,10 +10,14 @@
 #import "ShaderTypes.h"
 #import "RGBA16Image.h"
 
+#include "accumulation.h"
 #include "scene.h"
+#include "tile_scheduler.h"
 #include <glm/glm.hpp>
+#include <algorithm>
 #include <atomic>
 #include <cstddef>
+#include <memory>
 
 #define DEBUG_SHADER 0
 #if DEBUG_SHADER
@@ -21,6 +25,9 @@ constexpr int ScreenSizeX = 8;
 constexpr int ScreenSizeY = 8;
 #endif
 
+// edge length of the pixel tiles handed to the software render workers
+constexpr int SoftwareTileSize = 16;
+
 inline static glm::uvec2 CGSizeToVec2(CGSize size)
 {
     return glm::uvec2(size.width, size.height);
@@ -53,12 +60,16 @@ enum SoftwareRenderState
     id<MTLBuffer> _nodesBuffer;
     id<MTLBuffer> _spheresBuffer;
     id<MTLBuffer> _materialsBuffer;
+    id<MTLBuffer> _planesBuffer;
+    id<MTLBuffer> _accumulationBuffer;
     SceneUniform _sceneUniform;
 
     id<MTLRenderPipelineState> _quadPipelineStates[2];
     RGBA16Image* _sceneImage;
 
     SceneBuffer* _sceneBuffer;
+    AccumulationBuffer _softwareAccumulation;
+    std::unique_ptr<TileScheduler> _tileScheduler;
 }
 
 - (void)dealloc
@@ -72,6 +83,7 @@ enum SoftwareRenderState
     if (self) {
         _iterNum = 1;
         _hardwareRendering = YES;
+        _tileScheduler = std::make_unique<TileScheduler>();
         [self _loadMetalWithView:view];
     }
 
@@ -98,6 +110,9 @@ enum SoftwareRenderState
     auto size = CGSizeToVec2(view.drawableSize);
 #endif
     _sceneImage = [[RGBA16Image alloc] initWith:_device width:size.x height:size.y];
+    _accumulationBuffer = [_device newBufferWithLength:sizeof(AccumulationPixel) * size.x * size.y
+                                               options:MTLResourceStorageModePrivate];
+    _softwareAccumulation.resize(size.x, size.y);
 
     _commandQueue = [_device newCommandQueue];
 }
@@ -167,6 +182,11 @@ enum SoftwareRenderState
     _materialsBuffer = [_device newBufferWithBytes:sceneBuf.materials.data()
                                             length:sizeof(Material) * sceneBuf.materials.size()
                                            options:MTLResourceStorageModeManaged];
+    // buffers cannot be empty, the kernel reads none of it without planes
+    _planesBuffer = [_device newBufferWithLength:sizeof(Plane) * std::max<size_t>(1, sceneBuf.planes.size())
+                                         options:MTLResourceStorageModeManaged];
+    std::copy(sceneBuf.planes.begin(), sceneBuf.planes.end(), static_cast<Plane*>(_planesBuffer.contents));
+    [_planesBuffer didModifyRange:NSMakeRange(0, _planesBuffer.length)];
     _sceneUniform.cameraPos = glm::vec3(13, 2, 3);
     _sceneUniform.cameraLookAt = glm::vec3(0);
     _sceneUniform.focalLength = 1.0f;
@@ -179,8 +199,14 @@ enum SoftwareRenderState
     _sceneUniform.backgroundColor = glm::vec3(0.5f, 0.7f, 1.0f);
     _sceneUniform.numSamples = 100;
     _sceneUniform.numSpheres = static_cast<int>(sceneBuf.objects.size());
+    _sceneUniform.numPlanes = static_cast<int>(sceneBuf.planes.size());
     _sceneUniform.iterStart = 0;
     _sceneUniform.iterNum = _iterNum;
+    _sceneUniform.tonemap = TonemapClamp;
+    _sceneUniform.exposure = 1.0f;
+    _sceneUniform.minDepth = tracer::DefaultMinDepth;
+    _sceneUniform.maxDepth = tracer::DefaultMaxDepth;
+    _sceneUniform.russianRoulette = 0;
 }
 
 - (void)drawInMTKView:(nonnull MTKView *)view
@@ -235,7 +261,8 @@ enum SoftwareRenderState
         self.progress = (float)_curIter / self.numSamples;
     } else if (!self.hardwareRendering && self.debugBVHHit &&
                _softwareRenderState == SoftwareRenderState::InProgress) {
-        self.progress = (float)_softwareDebugProgressCounter / _sceneUniform.screenSize.y;
+        self.progress = (float)_softwareDebugProgressCounter /
+            (_sceneUniform.screenSize.x * _sceneUniform.screenSize.y);
     }
 }
 
@@ -250,6 +277,8 @@ enum SoftwareRenderState
     [rayTraceEncoder setBuffer:_spheresBuffer offset:0 atIndex:BufferIndexSphere];
     [rayTraceEncoder setBuffer:_materialsBuffer offset:0 atIndex:BufferIndexMaterial];
     [rayTraceEncoder setBytes:&_sceneUniform length:sizeof(SceneUniform) atIndex:BufferIndexSceneUniform];
+    [rayTraceEncoder setBuffer:_accumulationBuffer offset:0 atIndex:BufferIndexAccumulation];
+    [rayTraceEncoder setBuffer:_planesBuffer offset:0 atIndex:BufferIndexPlane];
     
     // calculate thread size
 #if DEBUG_SHADER
@@ -272,59 +301,68 @@ enum SoftwareRenderState
                         _sceneBuffer->objects.data(),
                         _sceneBuffer->materials.data(),
                         static_cast<int>(_sceneBuffer->objects.size()));
+    scene.setPlanes(_sceneBuffer->planes.data(), static_cast<int>(_sceneBuffer->planes.size()));
     tracer::Camera camera(_sceneUniform.cameraPos, _sceneUniform.cameraLookAt, math::float3(0, 1, 0),
                           _sceneUniform.fovY, _sceneUniform.focalLength,
                           _sceneUniform.screenSize);
 
     int iterEnd = math::min(_sceneUniform.numSamples, _sceneUniform.iterStart + _sceneUniform.iterNum);
-    dispatch_queue_t taskQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-    dispatch_group_t group = dispatch_group_create();
-    
-    if (self.debugBVHHit) {
-        tracer::Random random(self->_sceneUniform.seed);
-        tracer::RayTracer tracer(random, camera, scene, self->_sceneUniform.backgroundColor);
-        for (int i = 0; i < _sceneUniform.screenSize.y; ++i) {
-            dispatch_group_async(group, taskQueue, ^{
-                if (self->_softwareRenderState == SoftwareRenderState::Cancelling) {
-                    return;
-                }
-                for (int j = 0; j < self->_sceneUniform.screenSize.x; ++j) {
-                    math::float3 color = tracer::debugTrace(scene, camera, math::float2(j, i));
-                    [self->_sceneImage setColor:math::float4(color, 0) at:math::uint2(j, i)];
-                }
-                ++self->_softwareDebugProgressCounter;
-            });
-        }
-    } else {
-        for (int i = 0; i < _sceneUniform.screenSize.y; ++i) {
-            for (int j = 0; j < _sceneUniform.screenSize.x; ++j) {
-                math::uint2 threadPos(j, i);
-                dispatch_group_async(group, taskQueue, ^{
-                    if (self->_softwareRenderState == SoftwareRenderState::Cancelling) {
-                        return;
+    SceneUniform uniform = _sceneUniform;
+    BOOL bruteForce = self.bruteForce;
+    BOOL debugBVHHit = self.debugBVHHit;
+    RGBA16Image* sceneImage = _sceneImage;
+    AccumulationBuffer* accumulation = &_softwareAccumulation;
+    TileScheduler* scheduler = _tileScheduler.get();
+
+    // cleared here rather than in run(), which starts on another thread and
+    // would lose a cancel issued before it gets there
+    scheduler->resetCancel();
+    [self _setSoftwareRenderState:SoftwareRenderState::InProgress];
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+        bool finished = scheduler->run(uniform.screenSize.x, uniform.screenSize.y, SoftwareTileSize,
+                                       [&](const TileScheduler::Tile& tile, int) {
+            tracer::Random random(uniform.seed);
+            tracer::RayTracer tracer(random, camera, scene, uniform.backgroundColor);
+            tracer.setPathDepth(uniform.minDepth, uniform.maxDepth, uniform.russianRoulette != 0);
+            for (int y = tile.y; y < tile.y + tile.height; ++y) {
+                for (int x = tile.x; x < tile.x + tile.width; ++x) {
+                    math::uint2 threadPos(x, y);
+                    if (debugBVHHit) {
+                        math::float3 color = tracer::debugTrace(scene, camera, math::float2(threadPos));
+                        [sceneImage setColor:math::float4(color, 0) at:threadPos];
+                        continue;
                     }
-                    tracer::Random random(self->_sceneUniform.seed);
-                    tracer::RayTracer tracer(random, camera, scene, self->_sceneUniform.backgroundColor);
-                    math::float3 color(0);
-                    for (int i = self->_sceneUniform.iterStart; i < iterEnd; ++i) {
+
+                    random = tracer::Random(tracer::pixelSeed(uniform.seed, x, y, int(uniform.screenSize.x)));
+                    AccumulationPixel samples = {};
+                    for (int i = uniform.iterStart; i < iterEnd; ++i) {
                         math::float2 samplePos = math::float2(threadPos) + random.inUnitRect();
-                        if (self.bruteForce) {
-                            color += tracer.trace<true>(samplePos);
+                        math::float3 color;
+                        if (bruteForce) {
+                            color = tracer.trace<true>(samplePos);
                         } else {
-                            color += tracer.trace<false>(samplePos);
+                            color = tracer.trace<false>(samplePos);
                         }
+                        samples = addSample(samples, color);
                     }
-                    math::float4 newColor = ([self->_sceneImage colorAt:threadPos] * (float)self->_sceneUniform.iterStart
-                                             + math::float4(color, 0)) / (float)iterEnd;
-                    [self->_sceneImage setColor:newColor at:threadPos];
-                });
+                    // the first iteration overwrites whatever a previous render left
+                    AccumulationPixel pixel = {};
+                    if (uniform.iterStart > 0) {
+                        pixel = accumulation->at(x, y);
+                    }
+                    pixel = accumulate(pixel, samples);
+                    accumulation->data()[x + y * accumulation->width()] = pixel;
+                    math::float3 display = tonemap(pixelMean(pixel), uniform.tonemap, uniform.exposure);
+                    [sceneImage setColor:math::float4(display, 0) at:threadPos];
+                }
             }
-        }
-    }
-    [self _setSoftwareRenderState:SoftwareRenderState::InProgress];
-    dispatch_group_notify(group, taskQueue, ^{
+            if (debugBVHHit) {
+                self->_softwareDebugProgressCounter += tile.width * tile.height;
+            }
+        });
+
         dispatch_async(dispatch_get_main_queue(), ^{
-            if (self->_softwareRenderState == SoftwareRenderState::Cancelling) {
+            if (!finished || self->_softwareRenderState == SoftwareRenderState::Cancelling) {
                 self->_needResetRender = true;
             } else {
                 [self->_sceneImage update];
@@ -395,6 +433,7 @@ enum SoftwareRenderState
 - (void)_cancelSoftwareRender {
     if (!self.hardwareRendering && _softwareRenderState == SoftwareRenderState::InProgress) {
         [self _setSoftwareRenderState:SoftwareRenderState::Cancelling];
+        _tileScheduler->cancel();
     }
 }
 
@@ -19,7 +19,9 @@ enum BufferIndex
     BufferIndexNode = 0,
     BufferIndexSphere = 1,
     BufferIndexMaterial = 2,
-    BufferIndexSceneUniform = 3
+    BufferIndexSceneUniform = 3,
+    BufferIndexAccumulation = 4,
+    BufferIndexPlane = 5,
 };
 
 enum ConstantIndex
@@ -45,9 +47,15 @@ struct SceneUniform
     math::packed_float3 backgroundColor;
     int numSamples;
     int numSpheres;
+    int numPlanes;
     int iterNum;
     int iterStart;
     uint seed;
+    int tonemap;
+    float exposure;
+    int minDepth;
+    int maxDepth;
+    int russianRoulette;
 };
 
 #include "tracer.h"
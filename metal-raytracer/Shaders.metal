@@ -56,31 +56,45 @@ kernel void raytrace(constant Node* nodes [[buffer(BufferIndexNode)]],
                      constant Sphere* spheres [[buffer(BufferIndexSphere)]],
                      constant Material* materials [[buffer(BufferIndexMaterial)]],
                      constant SceneUniform& sceneUniform [[buffer(BufferIndexSceneUniform)]],
+                     device AccumulationPixel* accumulation [[buffer(BufferIndexAccumulation)]],
+                     constant Plane* planes [[buffer(BufferIndexPlane)]],
                      SceneTexture<access::read_write> tex,
                      uint2 threadPos [[thread_position_in_grid]])
 {
-    tracer::Random random(sceneUniform.seed);
+    tracer::Random random(tracer::pixelSeed(sceneUniform.seed, threadPos.x, threadPos.y,
+                                            int(sceneUniform.screenSize.x)));
     tracer::Scene scene(nodes, spheres, materials, sceneUniform.numSpheres);
+    scene.setPlanes(planes, sceneUniform.numPlanes);
     tracer::Camera camera(sceneUniform.cameraPos, sceneUniform.cameraLookAt, float3(0, 1, 0),
                           sceneUniform.fovY, sceneUniform.focalLength,
                           sceneUniform.screenSize);
     tracer::RayTracer tracer(random, camera, scene, sceneUniform.backgroundColor);
+    tracer.setPathDepth(sceneUniform.minDepth, sceneUniform.maxDepth, sceneUniform.russianRoulette != 0);
     if (g_debugBVHHit) {
         tex.write(float4(debugTrace(scene, camera, float2(threadPos)), 0), threadPos);
     } else {
-        float3 color = float3(0);
+        AccumulationPixel samples = {};
         int iterEnd = min(sceneUniform.numSamples, sceneUniform.iterStart + sceneUniform.iterNum);
         for (int i = sceneUniform.iterStart; i < iterEnd; ++i) {
             float2 samplePos = float2(threadPos) + random.inUnitRect();
+            float3 color;
             if (g_bruteForce) {
-                color += tracer.trace<true>(samplePos);
+                color = tracer.trace<true>(samplePos);
             } else {
-                color += tracer.trace<false>(samplePos);
+                color = tracer.trace<false>(samplePos);
             }
+            samples = addSample(samples, color);
         }
 
-        float4 newColor = (tex.read(threadPos) * sceneUniform.iterStart + float4(color, 0)) / iterEnd;
-        tex.write(newColor, threadPos);
+        // the first iteration overwrites whatever a previous render left
+        uint index = threadPos.x + threadPos.y * uint(sceneUniform.screenSize.x);
+        AccumulationPixel pixel = {};
+        if (sceneUniform.iterStart > 0) {
+            pixel = accumulation[index];
+        }
+        pixel = accumulate(pixel, samples);
+        accumulation[index] = pixel;
+        tex.write(float4(tonemap(pixelMean(pixel), sceneUniform.tonemap, sceneUniform.exposure), 0), threadPos);
     }
 }
 
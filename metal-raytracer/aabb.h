@@ -24,6 +24,7 @@ struct basic_aabb
     T center() const { return (min + max) * 0.5f; }
     T extent() const { return (max - min) * 0.5f; }
 
+    // product of the extents, the volume of a 3d box
     float area() const
     {
         auto size = max - min;
@@ -34,6 +35,37 @@ struct basic_aabb
         return total;
     }
 
+    // area of the boundary, the perimeter of a 2d box
+    float surface_area() const
+    {
+        auto size = max - min;
+        float total = 0.0f;
+        for (int i = 0; i < T::length(); ++i) {
+            float face = 1.0f;
+            for (int j = 0; j < T::length(); ++j) {
+                face *= i == j ? 1.0f : size[j];
+            }
+            total += face;
+        }
+        return 2.0f * total;
+    }
+
+    // the overlapping part, empty if there is none
+    basic_aabb intersect(const basic_aabb& rhs) const
+    {
+        basic_aabb res;
+        for (int i = 0; i < T::length(); ++i) {
+            res.min[i] = std::max(min[i], rhs.min[i]);
+            res.max[i] = std::min(max[i], rhs.max[i]);
+            if (res.min[i] > res.max[i]) {
+                return empty();
+            }
+        }
+        return res;
+    }
+
+    bool is_empty() const { return min[0] > max[0]; }
+
     bool overlap(const basic_aabb& rhs) const
     {
         for (int i = 0; i < T::length(); ++i) {
@@ -0,0 +1,105 @@
+#include "accumulation.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+
+// below this mean luminance the relative error is dominated by noise in
+// the mean itself
+constexpr float MinLuminance = 1e-4f;
+
+float luminance(math::float3 c)
+{
+    return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
+
+} // anonymous namespace
+
+AccumulationBuffer::AccumulationBuffer(int width, int height)
+{
+    resize(width, height);
+}
+
+void AccumulationBuffer::resize(int width, int height)
+{
+    m_width = width;
+    m_height = height;
+    m_pixels.assign((size_t)width * height, AccumulationPixel{});
+}
+
+void AccumulationBuffer::reset()
+{
+    std::fill(m_pixels.begin(), m_pixels.end(), AccumulationPixel{});
+}
+
+float AccumulationBuffer::relativeError(int x, int y) const
+{
+    const AccumulationPixel& pixel = at(x, y);
+    if (pixel.count < 2) {
+        return INFINITY;
+    }
+    float mean = luminance(pixelMean(pixel));
+    if (mean < MinLuminance) {
+        return 0;
+    }
+    // the luminance of a sample is a fixed linear mix of its channels, its
+    // variance is approximated by mixing the channel variances the same way
+    float var = luminance(pixelVariance(pixel));
+    return std::sqrt(var / pixel.count) / mean;
+}
+
+ConvergenceStats AccumulationBuffer::convergence() const
+{
+    ConvergenceStats stats;
+    double sum = 0;
+    for (int y = 0; y < m_height; ++y) {
+        for (int x = 0; x < m_width; ++x) {
+            if (at(x, y).count < 2) {
+                ++stats.numUnmeasured;
+                continue;
+            }
+            if (luminance(pixelMean(at(x, y))) < MinLuminance) {
+                continue;
+            }
+            float error = relativeError(x, y);
+            sum += error;
+            stats.maxRelativeError = std::max(stats.maxRelativeError, error);
+            ++stats.numPixels;
+        }
+    }
+    if (stats.numPixels > 0) {
+        stats.meanRelativeError = (float)(sum / stats.numPixels);
+    }
+    return stats;
+}
+
+std::vector<glm::vec3> AccumulationBuffer::resolve(int op, float exposure) const
+{
+    std::vector<glm::vec3> out(m_pixels.size());
+    for (size_t i = 0; i < m_pixels.size(); ++i) {
+        out[i] = tonemap(pixelMean(m_pixels[i]), op, exposure);
+    }
+    return out;
+}
+
+std::vector<glm::vec3> AccumulationBuffer::heatmap(int maxCount) const
+{
+    // the stops of the color ramp, evenly spaced
+    const glm::vec3 ramp[] = {
+        { 0, 0, 0 },
+        { 0, 0, 1 },
+        { 1, 0, 0 },
+        { 1, 1, 1 },
+    };
+    constexpr int NumSegments = sizeof(ramp) / sizeof(ramp[0]) - 1;
+
+    std::vector<glm::vec3> out(m_pixels.size());
+    for (size_t i = 0; i < m_pixels.size(); ++i) {
+        float t = std::min(1.0f, (float)m_pixels[i].count / std::max(1, maxCount)) * NumSegments;
+        int segment = std::min((int)t, NumSegments - 1);
+        out[i] = glm::mix(ramp[segment], ramp[segment + 1], t - segment);
+    }
+    return out;
+}
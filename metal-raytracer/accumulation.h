@@ -0,0 +1,70 @@
+//
+//  accumulation.h
+//  metal-raytracer
+//
+//  Progressive float32 accumulation of the samples of every pixel, kept
+//  apart from the tonemapped image used for display and output so that
+//  adding samples never goes through a quantized color.
+//
+
+#ifndef ACCUMULATION_H
+#define ACCUMULATION_H
+
+#include "color.h"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+struct ConvergenceStats
+{
+    // standard error of the mean luminance relative to the mean, averaged
+    // over the pixels and the worst one
+    float meanRelativeError = 0;
+    float maxRelativeError = 0;
+    // pixels whose luminance is too dark to judge are left out
+    int numPixels = 0;
+    // pixels with fewer than two samples, whose error is not known yet
+    int numUnmeasured = 0;
+};
+
+class AccumulationBuffer
+{
+public:
+    AccumulationBuffer(int width = 0, int height = 0);
+
+    void resize(int width, int height);
+    // forgets every sample
+    void reset();
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    // adds the samples gathered for the pixel, pixels of different tiles may
+    // be added to from different threads
+    void add(int x, int y, const AccumulationPixel& samples)
+    {
+        AccumulationPixel& pixel = m_pixels[x + y * m_width];
+        pixel = accumulate(pixel, samples);
+    }
+
+    const AccumulationPixel& at(int x, int y) const { return m_pixels[x + y * m_width]; }
+    AccumulationPixel* data() { return m_pixels.data(); }
+    const AccumulationPixel* data() const { return m_pixels.data(); }
+
+    // standard error of the mean luminance divided by the mean luminance,
+    // infinite below two samples where it cannot be estimated yet
+    float relativeError(int x, int y) const;
+    ConvergenceStats convergence() const;
+
+    // runs the tonemap stage over every pixel mean
+    std::vector<glm::vec3> resolve(int op = TonemapClamp, float exposure = 1.0f) const;
+    // samples per pixel from black over blue and red to white at maxCount
+    std::vector<glm::vec3> heatmap(int maxCount) const;
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    std::vector<AccumulationPixel> m_pixels;
+};
+
+#endif /* ACCUMULATION_H */
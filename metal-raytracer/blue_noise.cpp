@@ -0,0 +1,159 @@
+#include "blue_noise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace
+{
+
+// the gaussian filter that measures how crowded the surrounding of a pixel
+// is, with the sigma Ulichney suggests
+constexpr float Sigma = 1.5f;
+
+class VoidAndCluster
+{
+public:
+    VoidAndCluster(int size)
+        : m_size(size)
+        , m_kernel(size * size)
+    {
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                // distances wrap around the torus
+                int dx = std::min(x, size - x);
+                int dy = std::min(y, size - y);
+                m_kernel[x + y * size] = std::exp(-(dx * dx + dy * dy) / (2 * Sigma * Sigma));
+            }
+        }
+    }
+
+    void reset(const std::vector<char>& pattern, char value)
+    {
+        m_pattern = pattern;
+        m_value = value;
+        m_energy.assign(m_size * m_size, 0.0f);
+        for (int i = 0; i < m_size * m_size; ++i) {
+            if (m_pattern[i] == value) {
+                splat(i, 1.0f);
+            }
+        }
+    }
+
+    // the densest pixel of the current value
+    int tightestCluster() const { return find(m_value, true); }
+    // the emptiest pixel of the other value
+    int largestVoid() const { return find(!m_value, false); }
+
+    void set(int i, char value)
+    {
+        if (i < 0 || m_pattern[i] == value) {
+            return;
+        }
+        m_pattern[i] = value;
+        splat(i, value == m_value ? 1.0f : -1.0f);
+    }
+
+    const std::vector<char>& pattern() const { return m_pattern; }
+
+private:
+    void splat(int i, float sign)
+    {
+        int px = i % m_size;
+        int py = i / m_size;
+        for (int y = 0; y < m_size; ++y) {
+            int ky = (y - py + m_size) % m_size;
+            for (int x = 0; x < m_size; ++x) {
+                int kx = (x - px + m_size) % m_size;
+                m_energy[x + y * m_size] += sign * m_kernel[kx + ky * m_size];
+            }
+        }
+    }
+
+    int find(char value, bool densest) const
+    {
+        int best = -1;
+        for (int i = 0; i < m_size * m_size; ++i) {
+            if (m_pattern[i] != value) {
+                continue;
+            }
+            if (best == -1 || (densest ? m_energy[i] > m_energy[best] : m_energy[i] < m_energy[best])) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    int m_size;
+    char m_value = 1;
+    std::vector<float> m_kernel;
+    std::vector<float> m_energy;
+    std::vector<char> m_pattern;
+};
+
+} // anonymous namespace
+
+std::vector<float> makeBlueNoise(int size, uint seed)
+{
+    int n = size * size;
+    VoidAndCluster vc(size);
+
+    // random initial pattern with a tenth of the pixels set
+    std::vector<char> pattern(n, 0);
+    int numOnes = std::max(1, n / 10);
+    uint state = seed;
+    for (int placed = 0; placed < numOnes;) {
+        state = state * 1664525u + 1013904223u;
+        int i = (int)((std::uint64_t)state * n >> 32);
+        if (!pattern[i]) {
+            pattern[i] = 1;
+            ++placed;
+        }
+    }
+
+    // move ones from the tightest cluster to the largest void until that
+    // would put the one back where it came from
+    vc.reset(pattern, 1);
+    for (;;) {
+        int cluster = vc.tightestCluster();
+        vc.set(cluster, 0);
+        int hole = vc.largestVoid();
+        vc.set(hole, 1);
+        if (hole == cluster) {
+            break;
+        }
+    }
+    std::vector<char> initial = vc.pattern();
+
+    std::vector<int> rank(n, 0);
+    // phase 1: rank the initial ones by removing the tightest clusters
+    vc.reset(initial, 1);
+    for (int r = numOnes - 1; r >= 0; --r) {
+        int cluster = vc.tightestCluster();
+        vc.set(cluster, 0);
+        rank[cluster] = r;
+    }
+
+    // phase 2: fill the largest voids up to half of the pixels
+    vc.reset(initial, 1);
+    for (int r = numOnes; r < n / 2; ++r) {
+        int hole = vc.largestVoid();
+        vc.set(hole, 1);
+        rank[hole] = r;
+    }
+
+    // phase 3: the zeros are the minority now, turn their tightest clusters
+    // into ones
+    vc.reset(vc.pattern(), 0);
+    for (int r = std::max(numOnes, n / 2); r < n; ++r) {
+        int cluster = vc.tightestCluster();
+        vc.set(cluster, 1);
+        rank[cluster] = r;
+    }
+
+    std::vector<float> mask(n);
+    for (int i = 0; i < n; ++i) {
+        mask[i] = (rank[i] + 0.5f) / n;
+    }
+    return mask;
+}
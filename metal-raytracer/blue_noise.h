@@ -0,0 +1,19 @@
+//
+//  blue_noise.h
+//  metal-raytracer
+//
+//  Tileable blue noise masks for BlueNoiseSampler.
+//
+
+#ifndef BLUE_NOISE_H
+#define BLUE_NOISE_H
+
+#include "metal_bridge.h"
+
+#include <vector>
+
+// size * size values in [0, 1) whose neighbours differ as much as possible,
+// made with Ulichney's void and cluster method on a torus. Takes O(size^4).
+std::vector<float> makeBlueNoise(int size, uint seed);
+
+#endif /* BLUE_NOISE_H */
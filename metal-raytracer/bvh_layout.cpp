@@ -0,0 +1,195 @@
+#include "bvh_layout.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace tracer
+{
+
+namespace
+{
+
+int writeDepthFirst(const std::vector<Node>& nodes, int index, std::vector<DepthFirstNode>& out)
+{
+    int outIndex = (int)out.size();
+    out.emplace_back();
+
+    const Node& node = nodes[index];
+    DepthFirstNode cur;
+    cur.min = node.min;
+    cur.max = node.max;
+    if (node.left == -1) {
+        cur.offset = node.firstObjIndex;
+        cur.numObj = node.numObj;
+    } else {
+        writeDepthFirst(nodes, node.left, out);
+        cur.offset = writeDepthFirst(nodes, node.right, out);
+        cur.numObj = -1;
+    }
+    out[outIndex] = cur;
+    return outIndex;
+}
+
+void preorder(const std::vector<Node>& nodes, int index, std::vector<int>& order)
+{
+    order.push_back(index);
+    if (nodes[index].left != -1) {
+        preorder(nodes, nodes[index].left, order);
+        preorder(nodes, nodes[index].right, order);
+    }
+}
+
+int height(const std::vector<Node>& nodes, int index)
+{
+    const Node& node = nodes[index];
+    if (node.left == -1) {
+        return 1;
+    }
+    return 1 + std::max(height(nodes, node.left), height(nodes, node.right));
+}
+
+// the nodes exactly depth levels below index, left to right
+void collectLevel(const std::vector<Node>& nodes, int index, int depth, std::vector<int>& level)
+{
+    if (depth == 0) {
+        level.push_back(index);
+    } else if (nodes[index].left != -1) {
+        collectLevel(nodes, nodes[index].left, depth - 1, level);
+        collectLevel(nodes, nodes[index].right, depth - 1, level);
+    }
+}
+
+// lays out the top h levels of the subtree: first the upper half of those
+// levels, then every subtree hanging below it, each of them recursively in
+// the same way. Any treelet of the result is contiguous, whatever the size
+// of a cache line is.
+void vanEmdeBoas(const std::vector<Node>& nodes, int index, int h, std::vector<int>& order)
+{
+    if (h == 1) {
+        order.push_back(index);
+        return;
+    }
+    int top = h / 2;
+    vanEmdeBoas(nodes, index, top, order);
+
+    std::vector<int> bottom;
+    collectLevel(nodes, index, top, bottom);
+    for (int root : bottom) {
+        vanEmdeBoas(nodes, root, h - top, order);
+    }
+}
+
+float decodeStep(float origin, int step, float scale)
+{
+    return origin + float(step) * scale;
+}
+
+// picks the smallest scale with which 255 steps cover [origin, top] and
+// rounds both children outwards onto it
+void quantizeAxis(const Node& left, const Node& right, int axis, CompressedNode& out)
+{
+    float origin = std::min(left.min[axis], right.min[axis]);
+    float top = std::max(left.max[axis], right.max[axis]);
+    int exponent = -126;
+    if (top > origin) {
+        std::frexp((top - origin) / 255.0f, &exponent);
+        exponent = std::max(exponent, -126);
+    }
+    while (decodeStep(origin, 255, std::ldexp(1.0f, exponent)) < top) {
+        ++exponent;
+    }
+    float scale = std::ldexp(1.0f, exponent);
+    out.origin[axis] = origin;
+    out.exponent[axis] = (std::uint8_t)(exponent + 127);
+
+    const Node* children[2] = { &left, &right };
+    for (int c = 0; c < 2; ++c) {
+        float lo = children[c]->min[axis];
+        float hi = children[c]->max[axis];
+        int qlo = std::clamp((int)std::floor((lo - origin) / scale), 0, 255);
+        while (qlo > 0 && decodeStep(origin, qlo, scale) > lo) {
+            --qlo;
+        }
+        int qhi = std::clamp((int)std::ceil((hi - origin) / scale), 0, 255);
+        while (qhi < 255 && decodeStep(origin, qhi, scale) < hi) {
+            ++qhi;
+        }
+        out.lo[c][axis] = (std::uint8_t)qlo;
+        out.hi[c][axis] = (std::uint8_t)qhi;
+    }
+}
+
+int writeCompressed(const std::vector<Node>& nodes, int index, std::vector<CompressedNode>& out)
+{
+    int outIndex = (int)out.size();
+    out.emplace_back();
+
+    const Node& node = nodes[index];
+    CompressedNode cur = {};
+    if (node.left == -1) {
+        MB_ASSERT(node.numObj <= 127);
+        cur.offset = node.firstObjIndex;
+        cur.numObj = (std::int8_t)node.numObj;
+    } else {
+        for (int axis = 0; axis < 3; ++axis) {
+            quantizeAxis(nodes[node.left], nodes[node.right], axis, cur);
+        }
+        writeCompressed(nodes, node.left, out);
+        cur.offset = writeCompressed(nodes, node.right, out);
+        cur.numObj = -1;
+    }
+    out[outIndex] = cur;
+    return outIndex;
+}
+
+} // anonymous namespace
+
+std::vector<DepthFirstNode> makeDepthFirstNodes(const std::vector<Node>& nodes)
+{
+    std::vector<DepthFirstNode> out;
+    out.reserve(nodes.size());
+    writeDepthFirst(nodes, 0, out);
+    return out;
+}
+
+std::vector<CompressedNode> makeCompressedNodes(const std::vector<Node>& nodes)
+{
+    std::vector<CompressedNode> out;
+    out.reserve(nodes.size());
+    writeCompressed(nodes, 0, out);
+    return out;
+}
+
+std::vector<LinkedNode> makeLinkedNodes(const std::vector<Node>& nodes, BVHLayout layout)
+{
+    std::vector<int> order;
+    order.reserve(nodes.size());
+    if (layout == BVHLayout::VanEmdeBoas) {
+        vanEmdeBoas(nodes, 0, height(nodes, 0), order);
+    } else {
+        preorder(nodes, 0, order);
+    }
+
+    std::vector<int> newIndex(nodes.size(), -1);
+    for (int i = 0; i < (int)order.size(); ++i) {
+        newIndex[order[i]] = i;
+    }
+
+    std::vector<LinkedNode> out(order.size());
+    for (int i = 0; i < (int)order.size(); ++i) {
+        const Node& node = nodes[order[i]];
+        LinkedNode& cur = out[i];
+        cur.min = node.min;
+        cur.max = node.max;
+        if (node.left == -1) {
+            cur.left = node.firstObjIndex;
+            cur.right = ~node.numObj;
+        } else {
+            cur.left = newIndex[node.left];
+            cur.right = newIndex[node.right];
+        }
+    }
+    return out;
+}
+
+}
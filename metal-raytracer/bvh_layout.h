@@ -0,0 +1,299 @@
+//
+//  bvh_layout.h
+//  metal-raytracer
+//
+//  Alternative memory layouts of the flattened binary bvh for the CPU
+//  tracer. The tree stays the same, only the size of its nodes and their
+//  order in memory change, which decides how many cache lines a ray
+//  touches on its way down.
+//
+
+#ifndef BVH_LAYOUT_H
+#define BVH_LAYOUT_H
+
+#include "bvh_traversal.h"
+#include "tracer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace tracer
+{
+
+enum class BVHLayout
+{
+    Preorder,    // Node as flattened, 40 bytes with both child indices
+    Aligned,     // LinkedNode in the same preorder
+    DepthFirst,  // DepthFirstNode, the left child follows its parent
+    VanEmdeBoas, // LinkedNode in cache oblivious treelet order
+    Compressed,  // CompressedNode, child boxes quantized to 8 bits
+};
+
+// 32 byte node aligned so that no node straddles a cache line, the left
+// child of an inner node is the next node and only the right one is stored
+struct alignas(32) DepthFirstNode
+{
+    math::packed_float3 min;
+    math::packed_float3 max;
+    // inner node: index of the right child, leaf: first sphere
+    int offset;
+    // -1 for inner nodes
+    int numObj;
+};
+
+// 32 byte node that links both children so that nodes can go in any order
+struct alignas(32) LinkedNode
+{
+    math::packed_float3 min;
+    math::packed_float3 max;
+    // inner node: the children, leaf: the first sphere and ~numObj
+    int left;
+    int right;
+};
+
+// 32 byte node in depth first order that stores the boxes of both of its
+// children instead of its own one. Each child box is kept as 8 bit steps of
+// a power of two scale per axis away from the min corner of the node, with
+// the min rounded down and the max rounded up so that the decoded box always
+// contains the exact one.
+struct alignas(32) CompressedNode
+{
+    math::packed_float3 origin;
+    // inner node: index of the right child, leaf: first sphere
+    int offset;
+    // biased exponents of the per axis scales, as in a float
+    std::uint8_t exponent[3];
+    // -1 for inner nodes, leaves hold at most 127 spheres
+    std::int8_t numObj;
+    // steps of the left and the right child box
+    std::uint8_t lo[2][3];
+    std::uint8_t hi[2][3];
+};
+
+static_assert(sizeof(DepthFirstNode) == 32, "DepthFirstNode must fill half a cache line");
+static_assert(sizeof(LinkedNode) == 32, "LinkedNode must fill half a cache line");
+static_assert(sizeof(CompressedNode) == 32, "CompressedNode must fill half a cache line");
+
+// both reorder the flattened tree of nodes, the spheres stay where they are
+std::vector<DepthFirstNode> makeDepthFirstNodes(const std::vector<Node>& nodes);
+std::vector<LinkedNode> makeLinkedNodes(const std::vector<Node>& nodes, BVHLayout order);
+std::vector<CompressedNode> makeCompressedNodes(const std::vector<Node>& nodes);
+
+// 2^(exponent - 127)
+inline float compressedScale(std::uint8_t exponent)
+{
+    std::uint32_t bits = std::uint32_t(exponent) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+// the conservative box of a child of an inner node
+inline AABB decodeChild(const CompressedNode& node, const math::float3& scale, int child)
+{
+    AABB box;
+    for (int axis = 0; axis < 3; ++axis) {
+        box.min[axis] = node.origin[axis] + float(node.lo[child][axis]) * scale[axis];
+        box.max[axis] = node.origin[axis] + float(node.hi[child][axis]) * scale[axis];
+    }
+    return box;
+}
+
+// uniform access to the node types
+inline bool isLeaf(const Node& node) { return node.left == -1; }
+inline int leftChild(const Node& node, int) { return node.left; }
+inline int rightChild(const Node& node) { return node.right; }
+inline int firstObject(const Node& node) { return node.firstObjIndex; }
+inline int numObjects(const Node& node) { return node.numObj; }
+
+inline bool isLeaf(const DepthFirstNode& node) { return node.numObj >= 0; }
+inline int leftChild(const DepthFirstNode&, int index) { return index + 1; }
+inline int rightChild(const DepthFirstNode& node) { return node.offset; }
+inline int firstObject(const DepthFirstNode& node) { return node.offset; }
+inline int numObjects(const DepthFirstNode& node) { return node.numObj; }
+
+inline bool isLeaf(const LinkedNode& node) { return node.right < 0; }
+inline int leftChild(const LinkedNode& node, int) { return node.left; }
+inline int rightChild(const LinkedNode& node) { return node.right; }
+inline int firstObject(const LinkedNode& node) { return node.left; }
+inline int numObjects(const LinkedNode& node) { return ~node.right; }
+
+// the nodes of NodeT for closestHitOrdered, a child box is stored in the
+// child itself
+template<typename NodeT>
+struct BinaryTree
+{
+    using Ref = int;
+    static constexpr int MaxChildren = 2;
+
+    // the nodes hold the box of the root themselves
+    BinaryTree(const Scene&, const NodeT* nodes)
+        : nodes(nodes)
+    {}
+
+    const NodeT* nodes;
+
+    TRAVERSAL_INLINE SlabRay prepare(Ray ray) const { return { ray.origin, 1.0f / ray.dir }; }
+
+    template<typename Probe>
+    TRAVERSAL_INLINE bool root(const SlabRay& ray, float tmin, float tmax, int& ref, Probe& probe) const
+    {
+        probe(&nodes[0], sizeof(NodeT));
+        ref = 0;
+        return intersect(ray.origin, ray.invDir, { nodes[0].min, nodes[0].max }, tmin, tmax) != -1;
+    }
+
+    template<typename Probe>
+    TRAVERSAL_INLINE bool leaf(int index, int& first, int& count, Probe&) const
+    {
+        const NodeT& node = nodes[index];
+        if (!isLeaf(node)) {
+            return false;
+        }
+        first = firstObject(node);
+        count = numObjects(node);
+        return true;
+    }
+
+    template<typename Probe>
+    TRAVERSAL_INLINE int children(int index, const SlabRay& ray, float tmin, float tmax, int* refs,
+                                  float* dists, Probe& probe) const
+    {
+        const NodeT& node = nodes[index];
+        int leftIndex = leftChild(node, index);
+        int rightIndex = rightChild(node);
+        const NodeT& left = nodes[leftIndex];
+        const NodeT& right = nodes[rightIndex];
+        probe(&left, sizeof(NodeT));
+        probe(&right, sizeof(NodeT));
+        float leftDist = intersect(ray.origin, ray.invDir, { left.min, left.max }, tmin, tmax);
+        float rightDist = intersect(ray.origin, ray.invDir, { right.min, right.max }, tmin, tmax);
+        int numChildren = 0;
+        if (leftDist != -1) {
+            refs[numChildren] = leftIndex;
+            dists[numChildren++] = leftDist;
+        }
+        if (rightDist != -1) {
+            refs[numChildren] = rightIndex;
+            dists[numChildren++] = rightDist;
+        }
+        return numChildren;
+    }
+};
+
+// the compressed nodes for closestHitOrdered. The child boxes come out of
+// the parent, so a child is only read once the ray actually enters it.
+struct CompressedTree
+{
+    using Ref = int;
+    static constexpr int MaxChildren = 2;
+
+    // the root box is the only one that is not stored in a parent, it comes
+    // from the nodes of the scene the tree was compressed from
+    CompressedTree(const Scene& scene, const CompressedNode* nodes)
+        : nodes(nodes)
+        , rootBounds{ scene.getNode(0).min, scene.getNode(0).max }
+    {}
+
+    const CompressedNode* nodes;
+    AABB rootBounds;
+
+    TRAVERSAL_INLINE SlabRay prepare(Ray ray) const { return { ray.origin, 1.0f / ray.dir }; }
+
+    template<typename Probe>
+    TRAVERSAL_INLINE bool root(const SlabRay& ray, float tmin, float tmax, int& ref, Probe&) const
+    {
+        ref = 0;
+        return intersect(ray.origin, ray.invDir, rootBounds, tmin, tmax) != -1;
+    }
+
+    template<typename Probe>
+    TRAVERSAL_INLINE bool leaf(int index, int& first, int& count, Probe& probe) const
+    {
+        const CompressedNode& node = nodes[index];
+        probe(&node, sizeof(CompressedNode));
+        if (node.numObj < 0) {
+            return false;
+        }
+        first = node.offset;
+        count = node.numObj;
+        return true;
+    }
+
+    template<typename Probe>
+    TRAVERSAL_INLINE int children(int index, const SlabRay& ray, float tmin, float tmax, int* refs,
+                                  float* dists, Probe&) const
+    {
+        const CompressedNode& node = nodes[index];
+        math::float3 scale(compressedScale(node.exponent[0]),
+                           compressedScale(node.exponent[1]),
+                           compressedScale(node.exponent[2]));
+        float leftDist = intersect(ray.origin, ray.invDir, decodeChild(node, scale, 0), tmin, tmax);
+        float rightDist = intersect(ray.origin, ray.invDir, decodeChild(node, scale, 1), tmin, tmax);
+        int numChildren = 0;
+        if (leftDist != -1) {
+            refs[numChildren] = index + 1;
+            dists[numChildren++] = leftDist;
+        }
+        if (rightDist != -1) {
+            refs[numChildren] = node.offset;
+            dists[numChildren++] = rightDist;
+        }
+        return numChildren;
+    }
+};
+
+// the tree closestHitOrdered reads the nodes of a layout with
+template<typename NodeT>
+struct LayoutTree
+{
+    using Type = BinaryTree<NodeT>;
+};
+
+template<>
+struct LayoutTree<CompressedNode>
+{
+    using Type = CompressedTree;
+};
+
+// traverses the nodes of NodeT like Scene::closestHit
+template<typename NodeT, typename Tree = typename LayoutTree<NodeT>::Type>
+class LayoutScene
+{
+public:
+    // scene provides the spheres and materials the leaves refer to
+    LayoutScene(const Scene& scene, const NodeT* nodes)
+        : m_scene(scene)
+        , m_tree(scene, nodes)
+    {}
+
+    template<bool bruteForce>
+    bool hit(Ray ray, float tmin, float tmax, HitRecord& rec) const
+    {
+        if (bruteForce) {
+            return m_scene.hit<true>(ray, tmin, tmax, rec);
+        }
+        int primIndex = closestHit(ray, tmin, tmax);
+        if (primIndex != -1) {
+            rec = m_scene.getHitRecord(ray, tmax, primIndex);
+            return true;
+        }
+        return false;
+    }
+
+    // probe(address, size) is called for every node and sphere read
+    template<typename Probe = NoProbe>
+    int closestHit(Ray ray, float tmin, float& tmax, Probe&& probe = {}) const
+    {
+        return closestHitOrdered(m_scene, m_tree, SphereLeaves{ m_scene }, ray, tmin, tmax, probe);
+    }
+private:
+    Scene m_scene;
+    Tree m_tree;
+};
+
+}
+
+#endif /* BVH_LAYOUT_H */
@@ -8,11 +8,31 @@
 #include <utility>
 
 class object;
+struct sah_ref;
+
+// surface area heuristic, the expected cost of a ray that hits a node is
+// traversal_cost plus the cost of its children weighted by the fraction of
+// the node's surface area they cover, a leaf costs intersection_cost for
+// every leaf_width objects or part of it
+struct sah_params
+{
+    float traversal_cost = 1.0f;
+    float intersection_cost = 1.0f;
+    // nodes with more objects are always split
+    int max_leaf_size = 4;
+    // objects a leaf tests at once, e.g. the lanes of simd sphere blocks
+    int leaf_width = 1;
+
+    // the number of tests of a leaf of n objects
+    int leaf_tests(int n) const { return (n + leaf_width - 1) / leaf_width; }
+    float leaf_cost(int n) const { return intersection_cost * leaf_tests(n); }
+};
 
 class bvh_node
 {
 public:
-    bvh_node(object** objs, int n);
+    // binned SAH build, subtrees are built in parallel
+    bvh_node(object** objs, int n, const sah_params& params = {});
 
     const aabb3& get_aabb() const { return m_volume; }
     bool is_leaf() const { return !m_left; }
@@ -26,9 +46,13 @@ public:
         assert(0 <= i && i < m_objects.size());
         return m_objects[i];
     }
+
+    // heap bytes held by the subtree
+    size_t memory_usage() const;
 private:
-    static constexpr int max_objects = 2;
-    static constexpr int bin_num = 1024;
+    // spawn_depth is the number of levels below which subtrees are still
+    // handed to other threads
+    bvh_node(object* const* objs, sah_ref* refs, int n, const sah_params& params, int spawn_depth);
 
     std::unique_ptr<bvh_node> m_left;
     std::unique_ptr<bvh_node> m_right;
@@ -0,0 +1,90 @@
+#include "bvh_report.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+
+aabb3 node_aabb(const Node& node)
+{
+    return { node.min, node.max };
+}
+
+void count(vector<int>& histogram, int i)
+{
+    if ((int)histogram.size() <= i) {
+        histogram.resize(i + 1);
+    }
+    ++histogram[i];
+}
+
+} // anonymous namespace
+
+bvh_report make_bvh_report(const vector<Node>& nodes, const sah_params& params)
+{
+    bvh_report report;
+    if (nodes.empty()) {
+        return report;
+    }
+
+    float root_area = node_aabb(nodes[0]).surface_area();
+    double cost = 0.0;
+    double total_overlap = 0.0;
+
+    vector<pair<int, int>> stack = { { 0, 0 } };
+    while (!stack.empty()) {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+
+        const Node& node = nodes[index];
+        float area = node_aabb(node).surface_area();
+        float weight = root_area > 0.0f ? area / root_area : 1.0f;
+        ++report.num_nodes;
+
+        if (node.left == -1) {
+            ++report.num_leaves;
+            report.num_objects += node.numObj;
+            count(report.leaf_depths, depth);
+            count(report.leaf_sizes, node.numObj);
+            cost += weight * params.leaf_cost(node.numObj);
+            continue;
+        }
+
+        cost += weight * params.traversal_cost;
+        auto overlap = node_aabb(nodes[node.left]).intersect(node_aabb(nodes[node.right]));
+        float ratio = overlap.is_empty() || !(area > 0.0f) ? 0.0f : overlap.surface_area() / area;
+        total_overlap += ratio;
+        report.max_overlap = max(report.max_overlap, ratio);
+
+        stack.push_back({ node.right, depth + 1 });
+        stack.push_back({ node.left, depth + 1 });
+    }
+
+    report.sah_cost = (float)cost;
+    int num_inner = report.num_nodes - report.num_leaves;
+    report.mean_overlap = num_inner > 0 ? (float)(total_overlap / num_inner) : 0.0f;
+    return report;
+}
+
+void print_bvh_report(FILE* out, const bvh_report& report)
+{
+    fprintf(out, "bvh: %d nodes, %d leaves, %d objects\n",
+            report.num_nodes, report.num_leaves, report.num_objects);
+    fprintf(out, "  sah cost:      %.3f\n", report.sah_cost);
+    fprintf(out, "  child overlap: %.2f%% mean, %.2f%% max\n",
+            report.mean_overlap * 100.0f, report.max_overlap * 100.0f);
+
+    auto print_histogram = [&](const char* title, const char* label, const vector<int>& histogram) {
+        fprintf(out, "  %s:\n", title);
+        for (int i = 0; i < (int)histogram.size(); ++i) {
+            if (histogram[i] > 0) {
+                fprintf(out, "    %s %3d: %8d (%5.1f%%)\n", label, i, histogram[i],
+                        100.0f * histogram[i] / max(1, report.num_leaves));
+            }
+        }
+    };
+    print_histogram("leaf depth", "depth", report.leaf_depths);
+    print_histogram("leaf occupancy", "objects", report.leaf_sizes);
+}
@@ -0,0 +1,36 @@
+#ifndef BVH_REPORT_H
+#define BVH_REPORT_H
+
+#include "bvh_node.h"
+#include "scene_types.h"
+
+#include <cstdio>
+#include <vector>
+
+// quality measures of a flattened bvh, computed from the node array alone
+// so that trees of every builder can be compared
+struct bvh_report
+{
+    // expected cost of a ray hitting the root, see sah_params
+    float sah_cost = 0.0f;
+
+    int num_nodes = 0;
+    int num_leaves = 0;
+    int num_objects = 0;
+
+    // number of leaves at every depth, the root is at depth 0
+    std::vector<int> leaf_depths;
+    // number of leaves holding i objects
+    std::vector<int> leaf_sizes;
+
+    // surface area of the overlap of the two children relative to the
+    // surface area of their parent, averaged over the inner nodes
+    float mean_overlap = 0.0f;
+    float max_overlap = 0.0f;
+};
+
+bvh_report make_bvh_report(const std::vector<Node>& nodes, const sah_params& params = {});
+
+void print_bvh_report(FILE* out, const bvh_report& report);
+
+#endif // BVH_REPORT_H
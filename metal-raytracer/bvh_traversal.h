@@ -0,0 +1,139 @@
+//
+//  bvh_traversal.h
+//  metal-raytracer
+//
+//  The closest hit traversal of the CPU-only trees. Like Scene::closestHit
+//  it tests the planes first, visits the nearest child first and skips the
+//  subtrees that start behind the closest hit. How the nodes are stored and
+//  their children tested is up to the tree, how the primitives of a leaf
+//  are tested is up to the leaf policy.
+//
+
+#ifndef BVH_TRAVERSAL_H
+#define BVH_TRAVERSAL_H
+
+#include "tracer.h"
+
+#include <cstddef>
+
+namespace tracer
+{
+
+// for the calls into the tree and the leaf policy, which the traversal
+// loop is built around and which compilers do not always inline by
+// themselves
+#define TRAVERSAL_INLINE inline __attribute__((always_inline))
+
+// ignores the memory a traversal touches
+struct NoProbe
+{
+    void operator()(const void*, size_t) const {}
+};
+
+// the part of the ray the slab tests of the binary trees need
+struct SlabRay
+{
+    math::float3 origin;
+    math::float3 invDir;
+};
+
+// Tree provides
+//   Ref                 a node to visit
+//   MaxChildren         the most children of an inner node
+//   prepare(ray)        whatever its child tests need of the ray
+//   root(treeRay, tmin, tmax, ref, probe)
+//                       false if the ray misses the tree, else ref is the root
+//   leaf(ref, first, count, probe)
+//                       reads the node, true for a leaf with count
+//                       primitives from first
+//   children(ref, treeRay, tmin, tmax, children, dists, probe)
+//                       the children of an inner node the ray enters within
+//                       [tmin, tmax] and the distances at which it enters
+//                       them, returns how many
+// and leafTest(first, count, ray, tmin, tmax, primIndex, probe) lowers tmax
+// to every closer hit in the leaf and sets primIndex to its primitive.
+// probe(address, size) is called for every node and primitive read.
+template<typename Tree, typename LeafTest, typename Probe>
+int closestHitOrdered(const Scene& scene, const Tree& tree, const LeafTest& leafTest, Ray ray, float tmin,
+                      float& tmax, Probe&& probe)
+{
+    using Ref = typename Tree::Ref;
+    constexpr int MaxChildren = Tree::MaxChildren;
+    // every level pushes all children but one
+    constexpr int MaxStackSize = MaxTraversalDepth * (MaxChildren - 1);
+    Ref stack[MaxStackSize];
+    float stackDist[MaxStackSize];
+    int i = 0;
+
+    auto treeRay = tree.prepare(ray);
+    int primIndex = scene.closestPlane(ray, tmin, tmax);
+    Ref ref;
+    if (!tree.root(treeRay, tmin, tmax, ref, probe)) {
+        return primIndex;
+    }
+
+    for (;;) {
+        int first;
+        int count;
+        if (tree.leaf(ref, first, count, probe)) {
+            leafTest(first, count, ray, tmin, tmax, primIndex, probe);
+        } else {
+            Ref children[MaxChildren];
+            float dists[MaxChildren];
+            int numChildren = tree.children(ref, treeRay, tmin, tmax, children, dists, probe);
+            if (numChildren > 0) {
+                // go on with the nearest child, the first one of a tie
+                int nearest = 0;
+                for (int j = 1; j < numChildren; ++j) {
+                    if (dists[j] < dists[nearest]) {
+                        nearest = j;
+                    }
+                }
+                MB_ASSERT(i + numChildren - 1 <= MaxStackSize);
+                for (int j = 0; j < numChildren; ++j) {
+                    if (j != nearest) {
+                        stack[i] = children[j];
+                        stackDist[i] = dists[j];
+                        ++i;
+                    }
+                }
+                ref = children[nearest];
+                continue;
+            }
+        }
+
+        // pop the next subtree which still starts before the closest hit
+        do {
+            if (i == 0) {
+                return primIndex;
+            }
+            --i;
+        } while (stackDist[i] >= tmax);
+        ref = stack[i];
+    }
+}
+
+// tests the spheres of a leaf one at a time
+struct SphereLeaves
+{
+    const Scene& scene;
+
+    template<typename Probe>
+    TRAVERSAL_INLINE void operator()(int first, int count, Ray ray, float tmin, float& tmax, int& primIndex,
+                                     Probe& probe) const
+    {
+        for (int j = 0; j < count; ++j) {
+            int index = first + j;
+            probe(&scene.getSphere(index), sizeof(Sphere));
+            float t = intersectSphere(scene.getSphere(index), ray, tmin, tmax);
+            if (t != -1 && t < tmax) {
+                tmax = t;
+                primIndex = index;
+            }
+        }
+    }
+};
+
+}
+
+#endif /* BVH_TRAVERSAL_H */
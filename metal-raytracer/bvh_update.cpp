@@ -0,0 +1,561 @@
+#include "bvh_update.h"
+#include "flat_bvh.h"
+#include "scene.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <functional>
+#include <queue>
+#include <tuple>
+
+using namespace std;
+
+namespace
+{
+
+// levels with fewer nodes are refitted on the calling thread
+constexpr int min_parallel_nodes = 1024;
+
+// inserts deepen the tree however cheap it stays. A higher one is built
+// again before the inserts of a few more frames overflow the traversal
+// stacks, a fresh build is far shallower.
+constexpr int max_height = MaxTraversalDepth - 16;
+
+aabb3 node_aabb(const Node& node)
+{
+    return { node.min, node.max };
+}
+
+aabb3 sphere_aabb(const Sphere& sphere)
+{
+    return { sphere.center, sphere.radius };
+}
+
+} // anonymous namespace
+
+bvh_updater::bvh_updater(SceneBuffer& buffer, const sah_params& params, float rebuild_threshold)
+    : m_buffer(buffer)
+    , m_params(params)
+    , m_threshold(rebuild_threshold)
+{
+    assert(buffer.triangles.empty() && buffer.instances.empty() && !buffer.objects.empty());
+    int n = (int)buffer.objects.size();
+    m_slots.resize(n);
+    m_ids.resize(n);
+    for (int i = 0; i < n; ++i) {
+        m_slots[i] = i;
+        m_ids[i] = i;
+    }
+    init_tree();
+    m_built_sah = sah_cost();
+    m_built_cost = m_costs[0];
+}
+
+void bvh_updater::move_sphere(int id, const glm::vec3& center)
+{
+    int slot = m_slots[id];
+    assert(slot != -1);
+    m_buffer.objects[slot].center = center;
+    mark(m_leaves[slot]);
+}
+
+int bvh_updater::insert_sphere(const Sphere& sphere, const Material& material)
+{
+    // the arguments may live in the arrays that grow
+    Sphere new_sphere = sphere;
+    Material new_material = material;
+    int slot = alloc_slot();
+    m_buffer.objects[slot] = new_sphere;
+    m_buffer.materials[slot] = new_material;
+    int id = (int)m_slots.size();
+    m_slots.push_back(slot);
+    m_ids[slot] = id;
+
+    // the sibling moves down to make room for a new parent of both
+    aabb3 box = sphere_aabb(new_sphere);
+    int sibling = find_sibling(box);
+    int moved = alloc_node();
+    int leaf = alloc_node();
+    move_node(sibling, moved);
+    m_parents[moved] = sibling;
+    if (m_marked[sibling]) {
+        mark(moved);
+    }
+
+    Node& node = m_buffer.nodes[leaf];
+    node.min = box.min;
+    node.max = box.max;
+    node.left = -1;
+    node.right = PrimitiveSphere;
+    node.firstObjIndex = slot;
+    node.numObj = 1;
+    m_parents[leaf] = sibling;
+    m_heights[leaf] = 0;
+    m_leaves[slot] = leaf;
+
+    Node& parent = m_buffer.nodes[sibling];
+    parent.left = moved;
+    parent.right = leaf;
+    parent.firstObjIndex = 0;
+    parent.numObj = 0;
+    m_built_costs[sibling] = -1.0f;
+    update_heights(sibling);
+    mark(leaf);
+    return id;
+}
+
+void bvh_updater::remove_sphere(int id)
+{
+    int slot = m_slots[id];
+    assert(slot != -1 && num_spheres() > 1);
+    m_slots[id] = -1;
+
+    int leaf = m_leaves[slot];
+    Node& node = m_buffer.nodes[leaf];
+    if (node.numObj > 1) {
+        // the last sphere of the leaf fills the gap
+        int last = node.firstObjIndex + node.numObj - 1;
+        if (slot != last) {
+            m_buffer.objects[slot] = m_buffer.objects[last];
+            m_buffer.materials[slot] = m_buffer.materials[last];
+            m_ids[slot] = m_ids[last];
+            m_slots[m_ids[slot]] = slot;
+        }
+        --node.numObj;
+        free_slot(last);
+        mark(leaf);
+        return;
+    }
+
+    // the sibling of the empty leaf takes the place of their parent
+    free_slot(slot);
+    int parent = m_parents[leaf];
+    const Node& parent_node = m_buffer.nodes[parent];
+    int sibling = parent_node.left == leaf ? parent_node.right : parent_node.left;
+    move_node(sibling, parent);
+    free_node(sibling);
+    free_node(leaf);
+    if (m_parents[parent] != -1) {
+        update_heights(m_parents[parent]);
+    }
+    mark(parent);
+}
+
+bvh_updater::update_stats bvh_updater::update()
+{
+    update_stats stats;
+    if (!m_queue.empty()) {
+        stats.kind = update_kind::refit;
+        stats.refitted_nodes = refit_marked();
+    }
+
+    // freed slots and nodes pile up with many removals and partial rebuilds
+    bool fragmented = 2 * m_free_slots.size() > (size_t)num_spheres()
+                   || 2 * m_free_nodes.size() > m_buffer.nodes.size();
+    bool too_high = m_heights[0] > max_height;
+    if (fragmented || too_high || m_costs[0] > m_threshold * m_built_cost) {
+        int root = fragmented || too_high ? 0 : worst_subtree();
+        if (root != 0) {
+            stats.kind = update_kind::partial_rebuild;
+            stats.rebuilt_spheres = rebuild_subtree(root);
+            stats.refitted_nodes += refit_marked();
+        }
+        if (root == 0 || m_costs[0] > m_threshold * m_built_cost) {
+            stats.kind = update_kind::full_rebuild;
+            stats.rebuilt_spheres = num_spheres();
+            rebuild_all();
+        }
+    }
+
+    stats.sah_cost = sah_cost();
+    stats.built_sah_cost = m_built_sah;
+    return stats;
+}
+
+void bvh_updater::refit_all()
+{
+    for (int i = 0; i < (int)m_buffer.nodes.size(); ++i) {
+        if (m_heights[i] != -1 && !m_marked[i]) {
+            m_marked[i] = 1;
+            m_queue.push_back(i);
+        }
+    }
+    refit_marked();
+}
+
+float bvh_updater::sah_cost() const
+{
+    float root_area = node_aabb(m_buffer.nodes[0]).surface_area();
+    return root_area > 0.0f ? m_costs[0] / root_area : m_costs[0];
+}
+
+void bvh_updater::init_tree()
+{
+    size_t num_nodes = m_buffer.nodes.size();
+    m_parents.assign(num_nodes, -1);
+    m_heights.assign(num_nodes, -1);
+    m_costs.assign(num_nodes, 0.0f);
+    m_built_costs.assign(num_nodes, 0.0f);
+    m_marked.assign(num_nodes, 0);
+    m_queue.clear();
+    m_free_nodes.clear();
+    m_leaves.assign(m_buffer.objects.size(), -1);
+    init_subtree(0, -1);
+}
+
+void bvh_updater::init_subtree(int index, int parent)
+{
+    const Node& node = m_buffer.nodes[index];
+    float area = node_aabb(node).surface_area();
+    m_parents[index] = parent;
+    m_marked[index] = 0;
+    if (node.left == -1) {
+        for (int i = 0; i < node.numObj; ++i) {
+            m_leaves[node.firstObjIndex + i] = index;
+        }
+        m_heights[index] = 0;
+        m_costs[index] = area * m_params.leaf_cost(node.numObj);
+    } else {
+        init_subtree(node.left, index);
+        init_subtree(node.right, index);
+        m_heights[index] = 1 + max(m_heights[node.left], m_heights[node.right]);
+        m_costs[index] = area * m_params.traversal_cost + m_costs[node.left] + m_costs[node.right];
+    }
+    m_built_costs[index] = m_costs[index];
+}
+
+int bvh_updater::alloc_node()
+{
+    int index;
+    if (!m_free_nodes.empty()) {
+        index = m_free_nodes.back();
+        m_free_nodes.pop_back();
+    } else {
+        index = (int)m_buffer.nodes.size();
+        m_buffer.nodes.emplace_back();
+        m_parents.push_back(-1);
+        m_heights.push_back(-1);
+        m_costs.push_back(0.0f);
+        m_built_costs.push_back(-1.0f);
+        m_marked.push_back(0);
+    }
+    m_built_costs[index] = -1.0f;
+    return index;
+}
+
+void bvh_updater::free_node(int index)
+{
+    m_parents[index] = -1;
+    m_heights[index] = -1;
+    m_marked[index] = 0;
+    m_free_nodes.push_back(index);
+}
+
+int bvh_updater::alloc_slot()
+{
+    if (!m_free_slots.empty()) {
+        int slot = m_free_slots.back();
+        m_free_slots.pop_back();
+        return slot;
+    }
+    m_buffer.objects.emplace_back();
+    m_buffer.materials.emplace_back();
+    m_leaves.push_back(-1);
+    m_ids.push_back(-1);
+    return (int)m_buffer.objects.size() - 1;
+}
+
+void bvh_updater::free_slot(int slot)
+{
+    // no leaf refers to the slot any more, only the brute force tracer
+    // still tests its sphere
+    m_buffer.objects[slot].radius = 0.0f;
+    m_leaves[slot] = -1;
+    m_ids[slot] = -1;
+    m_free_slots.push_back(slot);
+}
+
+void bvh_updater::move_node(int from, int to)
+{
+    const Node& node = m_buffer.nodes[to] = m_buffer.nodes[from];
+    m_heights[to] = m_heights[from];
+    m_costs[to] = m_costs[from];
+    m_built_costs[to] = m_built_costs[from];
+    if (node.left == -1) {
+        for (int i = 0; i < node.numObj; ++i) {
+            m_leaves[node.firstObjIndex + i] = to;
+        }
+    } else {
+        m_parents[node.left] = to;
+        m_parents[node.right] = to;
+    }
+}
+
+void bvh_updater::mark(int index)
+{
+    // the ancestors of a marked node are marked already
+    while (index != -1 && !m_marked[index]) {
+        m_marked[index] = 1;
+        m_queue.push_back(index);
+        index = m_parents[index];
+    }
+}
+
+void bvh_updater::update_heights(int index)
+{
+    while (index != -1) {
+        const Node& node = m_buffer.nodes[index];
+        int height = 1 + max(m_heights[node.left], m_heights[node.right]);
+        if (height == m_heights[index]) {
+            break;
+        }
+        m_heights[index] = height;
+        index = m_parents[index];
+    }
+}
+
+int bvh_updater::refit_marked()
+{
+    // the children of a node are lower than the node itself, so every
+    // height only needs the ones below it
+    vector<vector<int>> levels;
+    for (int index : m_queue) {
+        // nodes freed since they were queued and ones queued twice
+        if (!m_marked[index]) {
+            continue;
+        }
+        m_marked[index] = 0;
+        int height = m_heights[index];
+        if ((int)levels.size() <= height) {
+            levels.resize(height + 1);
+        }
+        levels[height].push_back(index);
+    }
+    m_queue.clear();
+
+    int num_threads = utils::hardwareThreads();
+    int num_refitted = 0;
+    for (const vector<int>& level : levels) {
+        int n = (int)level.size();
+        num_refitted += n;
+        if (n < min_parallel_nodes || num_threads == 1) {
+            for (int index : level) {
+                refit_node(index);
+            }
+            continue;
+        }
+        utils::runThreads(num_threads, [&](int t) {
+            for (int i = t * n / num_threads; i < (t + 1) * n / num_threads; ++i) {
+                refit_node(level[i]);
+            }
+        });
+    }
+    return num_refitted;
+}
+
+void bvh_updater::refit_node(int index)
+{
+    Node& node = m_buffer.nodes[index];
+    aabb3 box = aabb3::empty();
+    float cost;
+    if (node.left == -1) {
+        for (int i = 0; i < node.numObj; ++i) {
+            box.expand(sphere_aabb(m_buffer.objects[node.firstObjIndex + i]));
+        }
+        cost = box.surface_area() * m_params.leaf_cost(node.numObj);
+    } else {
+        box = node_aabb(m_buffer.nodes[node.left]);
+        box.expand(node_aabb(m_buffer.nodes[node.right]));
+        cost = box.surface_area() * m_params.traversal_cost + m_costs[node.left] + m_costs[node.right];
+    }
+    node.min = box.min;
+    node.max = box.max;
+    m_costs[index] = cost;
+    if (m_built_costs[index] < 0.0f) {
+        m_built_costs[index] = cost;
+    }
+}
+
+// branch and bound search for the node that adds the least cost as the
+// sibling of a new leaf with the given box: the new parent of both plus
+// the growth of all ancestors, which only adds up going down
+int bvh_updater::find_sibling(const aabb3& box) const
+{
+    float box_area = box.surface_area();
+    int best = 0;
+    float best_cost = FLT_MAX;
+
+    // lower bound of the cost below the node, the node and the growth of its ancestors
+    using candidate = tuple<float, int, float>;
+    priority_queue<candidate, vector<candidate>, greater<candidate>> candidates;
+    candidates.push({ 0.0f, 0, 0.0f });
+    while (!candidates.empty()) {
+        auto [bound, index, inherited] = candidates.top();
+        candidates.pop();
+        if (bound >= best_cost) {
+            break;
+        }
+
+        const Node& node = m_buffer.nodes[index];
+        aabb3 node_box = node_aabb(node);
+        aabb3 joined = node_box;
+        joined.expand(box);
+        float joined_area = joined.surface_area();
+        float cost = m_params.traversal_cost * joined_area + inherited;
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = index;
+        }
+
+        if (node.left != -1) {
+            float child_inherited = inherited + m_params.traversal_cost * (joined_area - node_box.surface_area());
+            float child_bound = m_params.traversal_cost * box_area + child_inherited;
+            if (child_bound < best_cost) {
+                candidates.push({ child_bound, node.left, child_inherited });
+                candidates.push({ child_bound, node.right, child_inherited });
+            }
+        }
+    }
+    return best;
+}
+
+int bvh_updater::worst_subtree() const
+{
+    // goes down as long as one child holds at least half of the growth
+    int index = 0;
+    for (;;) {
+        const Node& node = m_buffer.nodes[index];
+        float growth = m_costs[index] - m_built_costs[index];
+        int worst = -1;
+        float worst_growth = -FLT_MAX;
+        for (int child : { node.left, node.right }) {
+            float child_growth = m_costs[child] - m_built_costs[child];
+            if (m_buffer.nodes[child].left != -1 && child_growth > worst_growth) {
+                worst = child;
+                worst_growth = child_growth;
+            }
+        }
+        if (worst == -1 || worst_growth < 0.5f * growth) {
+            return index;
+        }
+        index = worst;
+    }
+}
+
+int bvh_updater::rebuild_subtree(int root)
+{
+    vector<int> slots;
+    vector<int> stack = { root };
+    while (!stack.empty()) {
+        int index = stack.back();
+        stack.pop_back();
+        const Node& node = m_buffer.nodes[index];
+        if (node.left == -1) {
+            for (int i = 0; i < node.numObj; ++i) {
+                slots.push_back(node.firstObjIndex + i);
+            }
+        } else {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+        if (index != root) {
+            free_node(index);
+        }
+    }
+    sort(slots.begin(), slots.end());
+
+    int n = (int)slots.size();
+    vector<aabb3> boxes(n);
+    vector<Sphere> spheres(n);
+    vector<Material> materials(n);
+    vector<int> ids(n);
+    for (int i = 0; i < n; ++i) {
+        spheres[i] = m_buffer.objects[slots[i]];
+        materials[i] = m_buffer.materials[slots[i]];
+        ids[i] = m_ids[slots[i]];
+        boxes[i] = sphere_aabb(spheres[i]);
+    }
+    vector<Node> nodes;
+    vector<int> order;
+    build_flat_bvh(boxes.data(), n, m_params, PrimitiveSphere, nodes, order);
+
+    // leaves need their spheres next to each other, which the slots of the
+    // subtree no longer are after insertions and removals
+    int first = slots[0];
+    if (slots.back() - first + 1 != n) {
+        for (int slot : slots) {
+            free_slot(slot);
+        }
+        first = (int)m_buffer.objects.size();
+        m_buffer.objects.resize(first + n);
+        m_buffer.materials.resize(first + n);
+        m_leaves.resize(first + n, -1);
+        m_ids.resize(first + n, -1);
+    }
+    for (int i = 0; i < n; ++i) {
+        int slot = first + i;
+        m_buffer.objects[slot] = spheres[order[i]];
+        m_buffer.materials[slot] = materials[order[i]];
+        m_ids[slot] = ids[order[i]];
+        m_slots[m_ids[slot]] = slot;
+    }
+
+    // the new root takes the place of the old one
+    vector<int> indices(nodes.size());
+    indices[0] = root;
+    for (size_t i = 1; i < nodes.size(); ++i) {
+        indices[i] = alloc_node();
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        Node node = nodes[i];
+        if (node.left == -1) {
+            node.firstObjIndex += first;
+        } else {
+            node.left = indices[node.left];
+            node.right = indices[node.right];
+        }
+        m_buffer.nodes[indices[i]] = node;
+    }
+    int parent = m_parents[root];
+    init_subtree(root, parent);
+    if (parent != -1) {
+        update_heights(parent);
+        mark(parent);
+    }
+    return n;
+}
+
+void bvh_updater::rebuild_all()
+{
+    vector<aabb3> boxes;
+    vector<Sphere> spheres;
+    vector<Material> materials;
+    vector<int> ids;
+    for (size_t slot = 0; slot < m_ids.size(); ++slot) {
+        if (m_ids[slot] != -1) {
+            spheres.push_back(m_buffer.objects[slot]);
+            materials.push_back(m_buffer.materials[slot]);
+            ids.push_back(m_ids[slot]);
+            boxes.push_back(sphere_aabb(spheres.back()));
+        }
+    }
+    int n = (int)spheres.size();
+    vector<int> order;
+    build_flat_bvh(boxes.data(), n, m_params, PrimitiveSphere, m_buffer.nodes, order);
+
+    m_buffer.objects.resize(n);
+    m_buffer.materials.resize(n);
+    m_ids.resize(n);
+    for (int i = 0; i < n; ++i) {
+        m_buffer.objects[i] = spheres[order[i]];
+        m_buffer.materials[i] = materials[order[i]];
+        m_ids[i] = ids[order[i]];
+        m_slots[m_ids[i]] = i;
+    }
+    m_free_slots.clear();
+    init_tree();
+    m_built_sah = sah_cost();
+    m_built_cost = m_costs[0];
+}
@@ -0,0 +1,128 @@
+#ifndef BVH_UPDATE_H
+#define BVH_UPDATE_H
+
+#include "bvh_node.h"
+#include "scene_types.h"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+struct SceneBuffer;
+
+// keeps the flat bvh of a SceneBuffer of spheres valid while they move, come
+// and go, so that an animated scene does not need a new build every frame.
+// Moved spheres only refit the boxes above them, inserted ones are hung next
+// to the node whose box grows the least and removed ones leave their leaf.
+// Once the tree got too much worse than a fresh build, the subtree that got
+// worse the most is built again, and the whole tree once it gets too high
+// for the traversal stacks.
+//
+// the updater moves spheres between slots of the buffer, so they are named
+// by ids that never change. The spheres the buffer starts with have the ids
+// of their slots. The arrays of the buffer may grow on insert_sphere and on
+// update, views of them have to be made again afterwards.
+class bvh_updater
+{
+public:
+    enum class update_kind
+    {
+        none,            // nothing changed since the last update
+        refit,           // the boxes above the changed spheres were refitted
+        partial_rebuild, // a refit and a new build of one subtree
+        full_rebuild,    // a new build of the whole tree
+    };
+
+    struct update_stats
+    {
+        update_kind kind = update_kind::none;
+        int refitted_nodes = 0;
+        int rebuilt_spheres = 0;
+        // SAH cost of the tree after the update and after the last full build
+        float sah_cost = 0.0f;
+        float built_sah_cost = 0.0f;
+    };
+
+    // the buffer must hold spheres only. The tree is rebuilt once its SAH
+    // cost, not divided by the area of the root, is rebuild_threshold times
+    // the one of the last full build.
+    bvh_updater(SceneBuffer& buffer, const sah_params& params = {}, float rebuild_threshold = 1.2f);
+
+    void move_sphere(int id, const glm::vec3& center);
+    // returns the id of the new sphere
+    int insert_sphere(const Sphere& sphere, const Material& material);
+    void remove_sphere(int id);
+
+    // refits the nodes above the spheres changed since the last update, all
+    // nodes of the same height at once, and rebuilds what got too slow
+    update_stats update();
+
+    // refits every node, e.g. after the spheres of the buffer were changed
+    // without the updater
+    void refit_all();
+
+    // -1 for removed spheres
+    int slot(int id) const { return m_slots[id]; }
+    int num_spheres() const { return (int)(m_ids.size() - m_free_slots.size()); }
+    float sah_cost() const;
+
+private:
+    // reads the tree of the buffer as it is
+    void init_tree();
+    // heights, costs and parents of a subtree that was just built
+    void init_subtree(int index, int parent);
+
+    // node slots are reused, new sphere slots go at the end or into freed ones
+    int alloc_node();
+    void free_node(int index);
+    int alloc_slot();
+    void free_slot(int slot);
+    // moves the node at from to to, which takes its children and spheres
+    void move_node(int from, int to);
+
+    // queues the node and its ancestors for the next refit
+    void mark(int index);
+    // recomputes the heights from index up to the root
+    void update_heights(int index);
+    // refits the queued nodes and returns their number
+    int refit_marked();
+    void refit_node(int index);
+
+    int find_sibling(const aabb3& box) const;
+    // the inner node whose subtree holds most of the growth of the cost
+    int worst_subtree() const;
+    int rebuild_subtree(int root);
+    void rebuild_all();
+
+    SceneBuffer& m_buffer;
+    sah_params m_params;
+    float m_threshold;
+    // SAH cost of the tree right after the last full build and the same
+    // without dividing by the area of the root, which the monitor compares
+    // so that a root box grown by a few spheres moving away does not hide
+    // how much the boxes below it grew
+    float m_built_sah = 0.0f;
+    float m_built_cost = 0.0f;
+
+    // per node, -1 for free ones
+    std::vector<int> m_parents;
+    // leaves are at 0, inner nodes one above their higher child
+    std::vector<int> m_heights;
+    // surface areas of the nodes of the subtree weighted by their cost, the
+    // SAH cost of the subtree before it is divided by the area of the root.
+    // The built cost is the one of the last build of the node, negative
+    // until new nodes are first refitted.
+    std::vector<float> m_costs;
+    std::vector<float> m_built_costs;
+    std::vector<char> m_marked;
+    std::vector<int> m_queue;
+    std::vector<int> m_free_nodes;
+
+    // per slot the leaf and the id, -1 for free slots
+    std::vector<int> m_leaves;
+    std::vector<int> m_ids;
+    std::vector<int> m_free_slots;
+    // per id
+    std::vector<int> m_slots;
+};
+
+#endif // BVH_UPDATE_H
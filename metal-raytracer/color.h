@@ -70,4 +70,79 @@ struct BGRA16
     }
 };
 
+// running float32 statistics of the samples of one pixel, nothing is
+// clamped or quantized before the tonemap stage. Besides the sum the pixel
+// keeps m2, the sum of the squared distances of its samples to their mean,
+// which addSample and accumulate update with Welford's and Chan's methods.
+// A plain sum of squares would cancel catastrophically in float32 when the
+// variance is taken at high sample counts on bright pixels.
+struct AccumulationPixel
+{
+    math::packed_float3 sum;
+    math::packed_float3 m2;
+    int count;
+};
+
+inline math::float3 pixelMean(AccumulationPixel pixel)
+{
+    if (pixel.count == 0) {
+        return math::float3(0);
+    }
+    return math::float3(pixel.sum) / (float)pixel.count;
+}
+
+inline AccumulationPixel addSample(AccumulationPixel pixel, math::float3 color)
+{
+    math::float3 delta = color - pixelMean(pixel);
+    pixel.sum = math::float3(pixel.sum) + color;
+    pixel.count += 1;
+    pixel.m2 = math::float3(pixel.m2) + delta * (color - pixelMean(pixel));
+    return pixel;
+}
+
+// adds the samples of batch, which were gathered apart from the pixel
+inline AccumulationPixel accumulate(AccumulationPixel pixel, AccumulationPixel batch)
+{
+    int count = pixel.count + batch.count;
+    if (count == 0) {
+        return pixel;
+    }
+    math::float3 delta = pixelMean(batch) - pixelMean(pixel);
+    float weight = (float)pixel.count * (float)batch.count / (float)count;
+    pixel.m2 = math::float3(pixel.m2) + math::float3(batch.m2) + delta * delta * weight;
+    pixel.sum = math::float3(pixel.sum) + math::float3(batch.sum);
+    pixel.count = count;
+    return pixel;
+}
+
+// unbiased variance of a single sample
+inline math::float3 pixelVariance(AccumulationPixel pixel)
+{
+    if (pixel.count < 2) {
+        return math::float3(0);
+    }
+    math::float3 var = math::float3(pixel.m2) / (float)(pixel.count - 1);
+    return math::max(var, math::float3(0));
+}
+
+enum TonemapOperator
+{
+    TonemapClamp = 0,
+    TonemapReinhard = 1,
+    TonemapACES = 2,
+};
+
+// maps a linear hdr color to linear [0, 1] for display and output
+inline math::float3 tonemap(math::float3 color, int op, float exposure)
+{
+    color = color * exposure;
+    if (op == TonemapReinhard) {
+        color = color / (color + 1.0f);
+    } else if (op == TonemapACES) {
+        // Narkowicz's fit of the ACES filmic curve
+        color = (color * (color * 2.51f + 0.03f)) / (color * (color * 2.43f + 0.59f) + 0.14f);
+    }
+    return math::saturate(color);
+}
+
 #endif /* COLOR_H */
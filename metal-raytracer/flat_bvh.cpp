@@ -0,0 +1,168 @@
+#include "flat_bvh.h"
+#include "sah_binning.h"
+#include "scene.h"
+#include "utils.h"
+
+#include <atomic>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+
+// write_leaf(object, slot) stores the object at slot of the primitive
+// arrays of leaf_type, the nodes are the same for every kind of primitive
+template<typename leaf_writer>
+class flat_builder
+{
+public:
+    flat_builder(const sah_params& params, sah_ref* refs, Node* nodes, PrimitiveType leaf_type, leaf_writer write_leaf)
+        : m_params(params)
+        , m_refs(refs)
+        , m_nodes(nodes)
+        , m_leaf_type(leaf_type)
+        , m_write_leaf(write_leaf)
+    {
+    }
+
+    void build(int node_index, sah_ref* refs, int n, int spawn_depth)
+    {
+        aabb3 volume;
+        int left_num = sah_split(refs, n, m_params, volume);
+
+        Node& node = m_nodes[node_index];
+        node.min = volume.min;
+        node.max = volume.max;
+        // the primitives of a subtree are where its refs are
+        node.firstObjIndex = (int)(refs - m_refs);
+
+        if (left_num == 0) {
+            node.left = -1;
+            node.right = m_leaf_type;
+            node.numObj = n;
+            for (int i = 0; i < n; ++i) {
+                m_write_leaf(refs[i].index, node.firstObjIndex + i);
+            }
+            return;
+        }
+
+        // siblings are allocated together
+        int left = m_next_node.fetch_add(2, memory_order_relaxed);
+        node.left = left;
+        node.right = left + 1;
+        node.numObj = 0;
+
+        sah_ref* right_refs = refs + left_num;
+        int right_num = n - left_num;
+        if (spawn_depth > 0 && n >= sah_min_parallel_refs) {
+            utils::parallelInvoke([=]() { build(left, refs, left_num, spawn_depth - 1); },
+                                  [=]() { build(left + 1, right_refs, right_num, spawn_depth - 1); });
+        } else {
+            build(left, refs, left_num, spawn_depth - 1);
+            build(left + 1, right_refs, right_num, spawn_depth - 1);
+        }
+    }
+
+    int num_nodes() const { return m_next_node; }
+private:
+    sah_params m_params;
+    const sah_ref* m_refs;
+
+    Node* m_nodes;
+    PrimitiveType m_leaf_type;
+    leaf_writer m_write_leaf;
+    atomic<int> m_next_node{1};
+};
+
+template<typename object_type>
+vector<sah_ref> make_refs(const object_type* objects, int n)
+{
+    vector<sah_ref> refs(n);
+    int num_threads = n >= sah_min_parallel_refs ? utils::hardwareThreads() : 1;
+    utils::runThreads(num_threads, [&](int thread_index) {
+        int begin = (int)((long long)n * thread_index / num_threads);
+        int end = (int)((long long)n * (thread_index + 1) / num_threads);
+        for (int i = begin; i < end; ++i) {
+            refs[i].bounds = objects[i].get_aabb();
+            refs[i].center = refs[i].bounds.center();
+            refs[i].index = i;
+        }
+    });
+    return refs;
+}
+
+// builds the nodes over the refs, returns the number of nodes
+template<typename leaf_writer>
+int build_nodes(vector<sah_ref>& refs, const sah_params& params, vector<Node>& nodes,
+                PrimitiveType leaf_type, leaf_writer write_leaf)
+{
+    // a binary tree over n objects has at most 2n - 1 nodes
+    nodes.resize(std::max(1, 2 * (int)refs.size() - 1));
+    flat_builder<leaf_writer> builder(params, refs.data(), nodes.data(), leaf_type, write_leaf);
+    builder.build(0, refs.data(), (int)refs.size(), sah_spawn_depth());
+    nodes.resize(builder.num_nodes());
+    return builder.num_nodes();
+}
+
+} // anonymous namespace
+
+void build_flat_bvh(const SphereObject* objects, int n, const sah_params& params, SceneBuffer& buffer)
+{
+    vector<sah_ref> refs = make_refs(objects, n);
+    buffer.objects.resize(n);
+    buffer.materials.resize(n);
+
+    Sphere* spheres = buffer.objects.data();
+    Material* materials = buffer.materials.data();
+    build_nodes(refs, params, buffer.nodes, PrimitiveSphere, [=](int index, int slot) {
+        const SphereObject& obj = objects[index];
+        Sphere& sphere = spheres[slot];
+        sphere.center = obj.center;
+        sphere.radius = obj.radius;
+
+        Material& mat = materials[slot];
+        mat.albedo = obj.albedo;
+        mat.type = obj.type;
+        mat.prop = obj.prop;
+    });
+
+    buffer.peakBuildBytes = refs.capacity() * sizeof(sah_ref)
+                          + buffer.nodes.capacity() * sizeof(Node)
+                          + buffer.objects.capacity() * sizeof(Sphere)
+                          + buffer.materials.capacity() * sizeof(Material);
+}
+
+void build_flat_bvh(const TriangleObject* objects, int n, const sah_params& params,
+                    std::vector<Node>& nodes, std::vector<Triangle>& triangles)
+{
+    vector<sah_ref> refs = make_refs(objects, n);
+    triangles.resize(n);
+
+    Triangle* out = triangles.data();
+    build_nodes(refs, params, nodes, PrimitiveTriangle, [=](int index, int slot) {
+        const TriangleObject& obj = objects[index];
+        Triangle& tri = out[slot];
+        tri.v0 = obj.v0;
+        tri.v1 = obj.v1;
+        tri.v2 = obj.v2;
+        tri.material = obj.material;
+    });
+}
+
+void build_flat_bvh(const aabb3* boxes, int n, const sah_params& params, PrimitiveType leaf_type,
+                    std::vector<Node>& nodes, std::vector<int>& order)
+{
+    vector<sah_ref> refs(n);
+    for (int i = 0; i < n; ++i) {
+        refs[i].bounds = boxes[i];
+        refs[i].center = boxes[i].center();
+        refs[i].index = i;
+    }
+    order.resize(n);
+
+    int* out = order.data();
+    build_nodes(refs, params, nodes, leaf_type, [=](int index, int slot) {
+        out[slot] = index;
+    });
+}
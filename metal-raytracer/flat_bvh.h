@@ -0,0 +1,33 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include "bvh_node.h"
+
+#include "scene_types.h"
+
+#include <vector>
+
+class SphereObject;
+class TriangleObject;
+struct SceneBuffer;
+
+// binned SAH build that writes the node, sphere and material records of
+// the buffer in one pass. The records go straight into arrays reserved for
+// the largest possible tree, no node is allocated on its own and there is
+// no pointer tree to flatten afterwards.
+//
+// subtrees are built in parallel and take their nodes from a shared
+// counter, so the order of the nodes may differ between runs while the
+// tree itself does not
+void build_flat_bvh(const SphereObject* objects, int n, const sah_params& params, SceneBuffer& buffer);
+
+// the same build over triangles, their leaves are tagged PrimitiveTriangle
+void build_flat_bvh(const TriangleObject* objects, int n, const sah_params& params,
+                    std::vector<Node>& nodes, std::vector<Triangle>& triangles);
+
+// the same build over boxes, e.g. those of instances. The leaves are tagged
+// leaf_type and slot i of the leaves holds box order[i].
+void build_flat_bvh(const aabb3* boxes, int n, const sah_params& params, PrimitiveType leaf_type,
+                    std::vector<Node>& nodes, std::vector<int>& order);
+
+#endif // FLAT_BVH_H
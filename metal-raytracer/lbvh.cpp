@@ -0,0 +1,503 @@
+#include "lbvh.h"
+#include "object.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+
+using namespace std;
+
+namespace
+{
+
+// runs f(begin, end) over chunks of [0, count) on all cores
+template<typename F>
+void parallel_for(int count, int grain, F&& f)
+{
+    int num_chunks = (count + grain - 1) / grain;
+    int num_threads = min(utils::hardwareThreads(), num_chunks);
+    if (num_threads <= 1) {
+        if (count > 0) {
+            f(0, count);
+        }
+        return;
+    }
+
+    atomic<int> next_chunk{0};
+    utils::runThreads(num_threads, [&](int) {
+        for (int chunk; (chunk = next_chunk++) < num_chunks;) {
+            int begin = chunk * grain;
+            f(begin, min(begin + grain, count));
+        }
+    });
+}
+
+// spreads the lower 10 bits so that two zero bits follow each of them
+uint32_t expand_bits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// same for the lower 21 bits
+uint64_t expand_bits(uint64_t v)
+{
+    v &= 0x1FFFFFull;
+    v = (v | v << 32) & 0x1F00000000FFFFull;
+    v = (v | v << 16) & 0x1F0000FF0000FFull;
+    v = (v | v << 8) & 0x100F00F00F00F00Full;
+    v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+int count_leading_zeros(uint32_t v) { return __builtin_clz(v); }
+int count_leading_zeros(uint64_t v) { return __builtin_clzll(v); }
+
+// p is in [0, 1] on every axis
+template<typename Code>
+Code morton_code(const glm::vec3& p)
+{
+    constexpr int axis_bits = sizeof(Code) == 4 ? 10 : 21;
+    constexpr float scale = (float)((1u << axis_bits) - 1);
+    Code code = 0;
+    for (int i = 0; i < 3; ++i) {
+        auto v = (Code)std::min(std::max(p[i] * scale, 0.0f), scale);
+        code |= expand_bits(v) << (2 - i);
+    }
+    return code;
+}
+
+// stable lsd radix sort of the codes along with their indices, the chunks
+// of every pass are counted and scattered in parallel
+template<typename Code>
+void radix_sort(vector<Code>& codes, vector<int>& indices, int key_bits)
+{
+    constexpr int radix_bits = 8;
+    constexpr int radix = 1 << radix_bits;
+    constexpr int chunk_size = 1 << 16;
+
+    int n = (int)codes.size();
+    int num_chunks = max(1, (n + chunk_size - 1) / chunk_size);
+    vector<Code> tmp_codes(n);
+    vector<int> tmp_indices(n);
+    vector<int> offsets(num_chunks * radix);
+
+    for (int shift = 0; shift < key_bits; shift += radix_bits) {
+        auto digit = [shift](Code code) { return (int)(code >> shift) & (radix - 1); };
+
+        parallel_for(num_chunks, 1, [&](int begin, int end) {
+            for (int chunk = begin; chunk < end; ++chunk) {
+                int* histogram = &offsets[chunk * radix];
+                fill(histogram, histogram + radix, 0);
+                int last = min(n, (chunk + 1) * chunk_size);
+                for (int i = chunk * chunk_size; i < last; ++i) {
+                    ++histogram[digit(codes[i])];
+                }
+            }
+        });
+
+        // a chunk writes each digit after all smaller digits and after the
+        // same digit of the chunks before it
+        int sum = 0;
+        for (int d = 0; d < radix; ++d) {
+            for (int chunk = 0; chunk < num_chunks; ++chunk) {
+                int count = offsets[chunk * radix + d];
+                offsets[chunk * radix + d] = sum;
+                sum += count;
+            }
+        }
+
+        parallel_for(num_chunks, 1, [&](int begin, int end) {
+            for (int chunk = begin; chunk < end; ++chunk) {
+                int* offset = &offsets[chunk * radix];
+                int last = min(n, (chunk + 1) * chunk_size);
+                for (int i = chunk * chunk_size; i < last; ++i) {
+                    int dst = offset[digit(codes[i])]++;
+                    tmp_codes[dst] = codes[i];
+                    tmp_indices[dst] = indices[i];
+                }
+            }
+        });
+
+        codes.swap(tmp_codes);
+        indices.swap(tmp_indices);
+    }
+}
+
+// tree over the sorted objects after Karras, "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees". The n - 1 inner nodes come
+// first and the n leaves after them, leaf i holds sorted object i.
+template<typename Code>
+class lbvh_builder
+{
+public:
+    lbvh_builder(const vector<Code>& codes, vector<aabb3> leaf_bounds, const sah_params& sah)
+        : m_codes(codes)
+        , m_n((int)codes.size())
+        , m_sah(sah)
+        , m_left(m_n - 1)
+        , m_right(m_n - 1)
+        , m_parent(2 * m_n - 1)
+        , m_bounds(2 * m_n - 1)
+        , m_count(2 * m_n - 1)
+        , m_cost(2 * m_n - 1)
+        , m_visits(m_n - 1)
+    {
+        m_parent[0] = -1;
+        parallel_for(m_n, 4096, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                int leaf = m_n - 1 + i;
+                m_bounds[leaf] = leaf_bounds[i];
+                m_count[leaf] = 1;
+                m_cost[leaf] = m_sah.leaf_cost(1) * m_bounds[leaf].surface_area();
+            }
+        });
+    }
+
+    void build_hierarchy()
+    {
+        parallel_for(m_n - 1, 4096, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                build_inner(i);
+            }
+        });
+    }
+
+    // bounds and costs bottom up, optionally restructuring every treelet on
+    // the way. The second thread to reach an inner node handles it as both
+    // its children are done by then.
+    void update_bottom_up(bool restructure)
+    {
+        for (auto& v : m_visits) {
+            v.store(0, memory_order_relaxed);
+        }
+        parallel_for(m_n, 4096, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                int node = m_parent[m_n - 1 + i];
+                while (node != -1 && m_visits[node].fetch_add(1, memory_order_acq_rel) == 1) {
+                    if (restructure && m_count[node] >= treelet_size) {
+                        restructure_treelet(node);
+                    } else {
+                        update(node);
+                    }
+                    node = m_parent[node];
+                }
+            }
+        });
+    }
+
+    void emit(vector<Node>& nodes, const vector<int>& sorted_indices, vector<int>& object_order) const
+    {
+        nodes.reserve(2 * m_n - 1);
+        object_order.reserve(m_n);
+        emit(0, nodes, sorted_indices, object_order);
+    }
+private:
+    static constexpr int treelet_size = 7;
+
+    bool is_leaf(int node) const { return node >= m_n - 1; }
+
+    // length of the common prefix of the codes i and j, -1 if j is out of
+    // range. Equal codes are told apart by their position.
+    int delta(int i, int j) const
+    {
+        if (j < 0 || j >= m_n) {
+            return -1;
+        }
+        if (m_codes[i] == m_codes[j]) {
+            return (int)sizeof(Code) * 8 + count_leading_zeros((uint32_t)(i ^ j));
+        }
+        return count_leading_zeros(m_codes[i] ^ m_codes[j]);
+    }
+
+    void build_inner(int i)
+    {
+        // the range of the node extends from i in the direction that shares
+        // the longer prefix
+        int d = delta(i, i + 1) - delta(i, i - 1) >= 0 ? 1 : -1;
+        int delta_min = delta(i, i - d);
+        int max_length = 2;
+        while (delta(i, i + max_length * d) > delta_min) {
+            max_length *= 2;
+        }
+        int length = 0;
+        for (int t = max_length / 2; t >= 1; t /= 2) {
+            if (delta(i, i + (length + t) * d) > delta_min) {
+                length += t;
+            }
+        }
+        int j = i + length * d;
+
+        // split where the prefix of the range ends
+        int delta_node = delta(i, j);
+        int s = 0;
+        int t = length;
+        do {
+            t = (t + 1) / 2;
+            if (delta(i, i + (s + t) * d) > delta_node) {
+                s += t;
+            }
+        } while (t > 1);
+        int split = i + s * d + std::min(d, 0);
+
+        int left = std::min(i, j) == split ? m_n - 1 + split : split;
+        int right = std::max(i, j) == split + 1 ? m_n + split : split + 1;
+        m_left[i] = left;
+        m_right[i] = right;
+        m_parent[left] = i;
+        m_parent[right] = i;
+    }
+
+    float inner_cost(int node) const
+    {
+        return m_sah.traversal_cost * m_bounds[node].surface_area()
+             + m_cost[m_left[node]] + m_cost[m_right[node]];
+    }
+
+    float leaf_cost(int node) const
+    {
+        return m_sah.leaf_cost(m_count[node]) * m_bounds[node].surface_area();
+    }
+
+    bool collapse(int node) const
+    {
+        return is_leaf(node) || (m_count[node] <= m_sah.max_leaf_size && leaf_cost(node) <= inner_cost(node));
+    }
+
+    void update(int node)
+    {
+        int left = m_left[node];
+        int right = m_right[node];
+        m_bounds[node] = m_bounds[left];
+        m_bounds[node].expand(m_bounds[right]);
+        m_count[node] = m_count[left] + m_count[right];
+        m_cost[node] = inner_cost(node);
+        if (m_count[node] <= m_sah.max_leaf_size) {
+            m_cost[node] = std::min(m_cost[node], leaf_cost(node));
+        }
+    }
+
+    // Karras and Aila, "Fast Parallel Construction of High-Quality Bounding
+    // Volume Hierarchies". The treelet grows from the root by opening its
+    // largest leaf and is then rebuilt from the best split of every subset
+    // of its leaves.
+    void restructure_treelet(int root)
+    {
+        int leaves[treelet_size] = { m_left[root], m_right[root] };
+        int num_leaves = 2;
+        int inner[treelet_size - 2];
+        int num_inner = 0;
+        while (num_leaves < treelet_size) {
+            int largest = -1;
+            float largest_area = -1.0f;
+            for (int i = 0; i < num_leaves; ++i) {
+                float area = m_bounds[leaves[i]].surface_area();
+                if (!is_leaf(leaves[i]) && area > largest_area) {
+                    largest = i;
+                    largest_area = area;
+                }
+            }
+            if (largest == -1) {
+                break;
+            }
+            int node = leaves[largest];
+            inner[num_inner++] = node;
+            leaves[largest] = m_left[node];
+            leaves[num_leaves++] = m_right[node];
+        }
+
+        constexpr int max_subsets = 1 << treelet_size;
+        int full = (1 << num_leaves) - 1;
+        aabb3 bounds[max_subsets];
+        int count[max_subsets];
+        float cost[max_subsets];
+        int split[max_subsets];
+        for (int s = 1; s <= full; ++s) {
+            int low = __builtin_ctz(s);
+            if (s == 1 << low) {
+                bounds[s] = m_bounds[leaves[low]];
+                count[s] = m_count[leaves[low]];
+                cost[s] = m_cost[leaves[low]];
+                continue;
+            }
+
+            int rest = s & (s - 1);
+            bounds[s] = bounds[rest];
+            bounds[s].expand(bounds[1 << low]);
+            count[s] = count[rest] + count[1 << low];
+
+            // the partitions holding the lowest leaf cover every split once
+            float best = numeric_limits<float>::max();
+            split[s] = 1 << low;
+            for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+                if ((p & 1 << low) && cost[p] + cost[s ^ p] < best) {
+                    best = cost[p] + cost[s ^ p];
+                    split[s] = p;
+                }
+            }
+            float area = bounds[s].surface_area();
+            cost[s] = m_sah.traversal_cost * area + best;
+            if (count[s] <= m_sah.max_leaf_size) {
+                cost[s] = std::min(cost[s], m_sah.leaf_cost(count[s]) * area);
+            }
+        }
+
+        // reuse the inner nodes of the old treelet for the new one
+        struct rebuild
+        {
+            lbvh_builder& builder;
+            const int* leaves;
+            const int* split;
+            const int* inner;
+            int next_inner;
+
+            int operator()(int s, int node)
+            {
+                if ((s & (s - 1)) == 0) {
+                    return leaves[__builtin_ctz(s)];
+                }
+                if (node == -1) {
+                    node = inner[next_inner++];
+                }
+                int left = (*this)(split[s], -1);
+                int right = (*this)(s ^ split[s], -1);
+                builder.m_left[node] = left;
+                builder.m_right[node] = right;
+                builder.m_parent[left] = node;
+                builder.m_parent[right] = node;
+                builder.update(node);
+                return node;
+            }
+        };
+        rebuild{ *this, leaves, split, inner, 0 }(full, root);
+    }
+
+    void collect_objects(int node, const vector<int>& sorted_indices, vector<int>& object_order) const
+    {
+        if (is_leaf(node)) {
+            object_order.push_back(sorted_indices[node - (m_n - 1)]);
+        } else {
+            collect_objects(m_left[node], sorted_indices, object_order);
+            collect_objects(m_right[node], sorted_indices, object_order);
+        }
+    }
+
+    int emit(int node, vector<Node>& nodes, const vector<int>& sorted_indices, vector<int>& object_order) const
+    {
+        int index = (int)nodes.size();
+        nodes.emplace_back();
+        Node cur;
+        cur.min = m_bounds[node].min;
+        cur.max = m_bounds[node].max;
+        cur.firstObjIndex = (int)object_order.size();
+        cur.left = -1;
+        cur.right = -1;
+
+        if (collapse(node)) {
+            collect_objects(node, sorted_indices, object_order);
+            cur.numObj = (int)object_order.size() - cur.firstObjIndex;
+        } else {
+            cur.numObj = 0;
+            cur.left = emit(m_left[node], nodes, sorted_indices, object_order);
+            cur.right = emit(m_right[node], nodes, sorted_indices, object_order);
+        }
+        nodes[index] = cur;
+        return index;
+    }
+
+    const vector<Code>& m_codes;
+    int m_n;
+    sah_params m_sah;
+
+    vector<int> m_left;
+    vector<int> m_right;
+    vector<int> m_parent;
+    vector<aabb3> m_bounds;
+    vector<int> m_count;
+    vector<float> m_cost;
+    vector<atomic<int>> m_visits;
+};
+
+template<typename Code>
+vector<Node> build(const vector<aabb3>& bounds, const sah_params& sah,
+                   const lbvh_params& params, vector<int>& object_order)
+{
+    int n = (int)bounds.size();
+    auto centers = aabb3::empty();
+    for (const auto& b : bounds) {
+        centers.expand({ b.center(), b.center() });
+    }
+    glm::vec3 scale;
+    for (int i = 0; i < 3; ++i) {
+        float extent = centers.max[i] - centers.min[i];
+        scale[i] = extent > 0.0f ? 1.0f / extent : 0.0f;
+    }
+
+    vector<Code> codes(n);
+    vector<int> indices(n);
+    parallel_for(n, 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            codes[i] = morton_code<Code>((bounds[i].center() - centers.min) * scale);
+            indices[i] = i;
+        }
+    });
+    radix_sort(codes, indices, params.morton_bits);
+
+    vector<aabb3> sorted_bounds(n);
+    for (int i = 0; i < n; ++i) {
+        sorted_bounds[i] = bounds[indices[i]];
+    }
+
+    lbvh_builder<Code> builder(codes, move(sorted_bounds), sah);
+    builder.build_hierarchy();
+    builder.update_bottom_up(false);
+    for (int i = 0; i < params.treelet_passes; ++i) {
+        builder.update_bottom_up(true);
+    }
+
+    vector<Node> nodes;
+    builder.emit(nodes, indices, object_order);
+    return nodes;
+}
+
+} // anonymous namespace
+
+vector<Node> build_lbvh(const object* const* objs, int n, const sah_params& sah,
+                        const lbvh_params& params, vector<int>& object_order)
+{
+    assert(params.morton_bits == 30 || params.morton_bits == 63);
+    object_order.clear();
+
+    vector<aabb3> bounds(n);
+    parallel_for(n, 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            bounds[i] = objs[i]->get_aabb();
+        }
+    });
+
+    if (n < 2) {
+        // a single leaf, empty for an empty scene
+        Node leaf;
+        auto volume = n == 1 ? bounds[0] : aabb3::empty();
+        leaf.min = volume.min;
+        leaf.max = volume.max;
+        leaf.left = -1;
+        leaf.right = -1;
+        leaf.firstObjIndex = 0;
+        leaf.numObj = n;
+        object_order.assign(n, 0);
+        return { leaf };
+    }
+
+    if (params.morton_bits == 63) {
+        return build<uint64_t>(bounds, sah, params, object_order);
+    }
+    return build<uint32_t>(bounds, sah, params, object_order);
+}
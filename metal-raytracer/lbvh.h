@@ -0,0 +1,33 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include "bvh_node.h"
+#include "scene_types.h"
+
+#include <vector>
+
+class object;
+
+// linear bvh, the objects are sorted along a morton curve through their
+// centers and the tree is read off the bits of the sorted codes. Every step
+// runs in parallel, which makes it much faster to build than bvh_node at
+// the price of a worse tree.
+struct lbvh_params
+{
+    // 30 bit codes (10 per axis) or 63 bit codes (21 per axis), the latter
+    // for huge scenes where many objects would share a 30 bit code
+    int morton_bits = 30;
+    // every pass rebuilds the treelets of up to 7 leaves into their optimal
+    // shape under the SAH, 0 keeps the tree as read off the codes
+    int treelet_passes = 0;
+};
+
+// builds the flattened tree, sphere i of the buffer the leaves refer to is
+// objs[object_order[i]]
+//
+// small subtrees are collapsed into leaves of up to sah.max_leaf_size
+// objects where the SAH favours it
+std::vector<Node> build_lbvh(const object* const* objs, int n, const sah_params& sah,
+                             const lbvh_params& params, std::vector<int>& object_order);
+
+#endif // LBVH_H
@@ -0,0 +1,246 @@
+#include "mesh.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+namespace
+{
+
+// large enough that the threads are busy, small enough that the file never
+// has to fit into memory as text
+constexpr size_t obj_block_size = 32 << 20;
+
+// pieces smaller than this are not worth a thread
+constexpr size_t obj_min_piece_size = 1 << 20;
+
+struct obj_index
+{
+    // absolute index, or relative to the first vertex of the piece
+    int value;
+    bool relative;
+};
+
+// the vertices and triangles of a piece of the file, in file order
+struct obj_piece
+{
+    std::vector<glm::vec3> positions;
+    std::vector<obj_index> indices;
+    // the first line that could not be parsed
+    std::string error;
+};
+
+bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+const char* skip_space(const char* p, const char* end)
+{
+    while (p < end && is_space(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+bool parse_vertex(const char* p, const char* end, glm::vec3& pos)
+{
+    for (int i = 0; i < 3; ++i) {
+        p = skip_space(p, end);
+        char* next;
+        // every line ends with a newline, strtof stops there at the latest
+        pos[i] = std::strtof(p, &next);
+        if (next == p) {
+            return false;
+        }
+        p = next;
+    }
+    return true;
+}
+
+bool parse_face(const char* p, const char* end, obj_piece& piece, std::vector<obj_index>& face)
+{
+    face.clear();
+    for (;;) {
+        p = skip_space(p, end);
+        if (p == end) {
+            break;
+        }
+        char* next;
+        long index = std::strtol(p, &next, 10);
+        if (next == p || index == 0) {
+            return false;
+        }
+        if (index > 0) {
+            face.push_back({ int(index - 1), false });
+        } else {
+            face.push_back({ int((long)piece.positions.size() + index), true });
+        }
+        // skip the texture coordinate and normal of the vertex
+        p = next;
+        while (p < end && !is_space(*p)) {
+            ++p;
+        }
+    }
+    if (face.size() < 3) {
+        return false;
+    }
+    for (size_t i = 1; i + 1 < face.size(); ++i) {
+        piece.indices.push_back(face[0]);
+        piece.indices.push_back(face[i]);
+        piece.indices.push_back(face[i + 1]);
+    }
+    return true;
+}
+
+void parse_piece(const char* p, const char* end, obj_piece& piece)
+{
+    std::vector<obj_index> face;
+    while (p < end) {
+        const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!line_end) {
+            line_end = end;
+        }
+        const char* line = skip_space(p, line_end);
+        bool ok = true;
+        if (line_end - line >= 2 && is_space(line[1])) {
+            if (line[0] == 'v') {
+                ok = parse_vertex(line + 1, line_end, piece.positions.emplace_back());
+            } else if (line[0] == 'f') {
+                ok = parse_face(line + 1, line_end, piece, face);
+            }
+        }
+        if (!ok) {
+            piece.error.assign(line, line_end);
+            return;
+        }
+        p = line_end + 1;
+    }
+}
+
+// splits [begin, end) into up to max_pieces ranges that end after a newline
+// and parses them in parallel
+void parse_block(const char* begin, const char* end, int max_pieces, std::vector<obj_piece>& pieces)
+{
+    size_t size = end - begin;
+    int num = (int)std::clamp<size_t>(size / obj_min_piece_size, 1, max_pieces);
+    std::vector<const char*> bounds{ begin };
+    for (int i = 1; i < num; ++i) {
+        const char* split = std::max(bounds.back(), begin + size * i / num);
+        split = static_cast<const char*>(std::memchr(split, '\n', end - split));
+        if (!split) {
+            break;
+        }
+        bounds.push_back(split + 1);
+    }
+    bounds.push_back(end);
+
+    size_t first = pieces.size();
+    pieces.resize(first + bounds.size() - 1);
+    std::atomic<size_t> next{0};
+    utils::runThreads(std::min(max_pieces, (int)bounds.size() - 1), [&](int) {
+        for (size_t i = next++; i + 1 < bounds.size(); i = next++) {
+            parse_piece(bounds[i], bounds[i + 1], pieces[first + i]);
+        }
+    });
+}
+
+} // anonymous namespace
+
+bool loadOBJ(const std::string& path, TriangleMesh& mesh)
+{
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        std::fprintf(stderr, "failed to open %s\n", path.c_str());
+        return false;
+    }
+
+    int num_threads = utils::hardwareThreads();
+    std::vector<obj_piece> pieces;
+    // one spare byte to end the last line of the file with a newline
+    std::unique_ptr<char[]> block(new char[obj_block_size + 1]);
+    size_t carry = 0;
+    for (;;) {
+        size_t size = carry + std::fread(block.get() + carry, 1, obj_block_size - carry, file);
+        bool last = size < obj_block_size;
+        if (last && std::ferror(file)) {
+            std::fprintf(stderr, "failed to read %s\n", path.c_str());
+            std::fclose(file);
+            return false;
+        }
+
+        // the incomplete line at the end goes to the next block
+        size_t parsed = size;
+        if (last) {
+            if (size > 0 && block[size - 1] != '\n') {
+                block[size++] = '\n';
+            }
+            parsed = size;
+        } else {
+            const char* newline = nullptr;
+            for (size_t i = size; i > 0 && !newline; --i) {
+                if (block[i - 1] == '\n') {
+                    newline = &block[i - 1];
+                }
+            }
+            if (!newline) {
+                std::fprintf(stderr, "%s has a line longer than %zu bytes\n", path.c_str(), obj_block_size);
+                std::fclose(file);
+                return false;
+            }
+            parsed = newline + 1 - block.get();
+        }
+
+        parse_block(block.get(), block.get() + parsed, num_threads, pieces);
+        carry = size - parsed;
+        std::memmove(block.get(), block.get() + parsed, carry);
+        if (last) {
+            break;
+        }
+    }
+    std::fclose(file);
+
+    // where the vertices and indices of every piece go in the mesh
+    std::vector<size_t> vertex_base(pieces.size() + 1, 0);
+    std::vector<size_t> index_base(pieces.size() + 1, 0);
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        if (!pieces[i].error.empty()) {
+            std::fprintf(stderr, "%s: cannot parse \"%s\"\n", path.c_str(), pieces[i].error.c_str());
+            return false;
+        }
+        vertex_base[i + 1] = vertex_base[i] + pieces[i].positions.size();
+        index_base[i + 1] = index_base[i] + pieces[i].indices.size();
+    }
+
+    long long num_vertices = (long long)vertex_base.back();
+    mesh.positions.resize(vertex_base.back());
+    mesh.indices.resize(index_base.back());
+    std::atomic<size_t> next{0};
+    std::atomic<bool> out_of_range{false};
+    utils::runThreads(std::min(num_threads, std::max(1, (int)pieces.size())), [&](int) {
+        for (size_t i = next++; i < pieces.size(); i = next++) {
+            obj_piece& piece = pieces[i];
+            std::copy(piece.positions.begin(), piece.positions.end(), mesh.positions.begin() + vertex_base[i]);
+            for (size_t j = 0; j < piece.indices.size(); ++j) {
+                const obj_index& index = piece.indices[j];
+                long long resolved = index.relative ? (long long)vertex_base[i] + index.value : index.value;
+                if (resolved < 0 || resolved >= num_vertices) {
+                    out_of_range = true;
+                    resolved = 0;
+                }
+                mesh.indices[index_base[i] + j] = (int)resolved;
+            }
+            // release the piece as soon as it is copied
+            piece = obj_piece();
+        }
+    });
+    if (out_of_range) {
+        std::fprintf(stderr, "%s has faces referring to missing vertices\n", path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+//
+//  mesh.h
+//  metal-raytracer
+//
+//  Triangle meshes read from Wavefront OBJ files.
+//
+
+#ifndef MESH_H
+#define MESH_H
+
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+struct TriangleMesh
+{
+    std::vector<glm::vec3> positions;
+    // three positions per triangle, counter clockwise seen from outside
+    std::vector<int> indices;
+
+    size_t numTriangles() const { return indices.size() / 3; }
+};
+
+// reads the vertex positions and faces of an OBJ file, polygons are split
+// into fans of triangles and everything else (normals, texture coordinates,
+// groups, materials) is skipped.
+//
+// the file is read in blocks of a fixed size, each of them is split at line
+// boundaries and parsed on all threads. Faces may refer to vertices of
+// earlier blocks with negative indices, so they are resolved to absolute
+// ones in a second parallel pass once every block knows where its vertices
+// start. Prints the reason and returns false if the file is malformed.
+bool loadOBJ(const std::string& path, TriangleMesh& mesh);
+
+#endif /* MESH_H */
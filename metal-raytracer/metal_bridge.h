@@ -12,6 +12,9 @@
 #ifndef __METAL_VERSION__
 #  include <glm/glm.hpp>
 #  include <cmath>
+// glibc's struct timex has a member named constant, make sure it is seen
+// before the macro below
+#  include <ctime>
 #  define NS glm
 #  define thread
 #  define constant const
@@ -79,6 +82,12 @@ inline T cross(T a, T b) { return NS::cross(a, b); }
 template<typename T>
 inline T tan(T a) { return NS::tan(a); }
 
+template<typename T>
+inline T sin(T a) { return NS::sin(a); }
+
+template<typename T>
+inline T cos(T a) { return NS::cos(a); }
+
 template<typename T>
 inline T saturate(T a)
 {
@@ -0,0 +1,213 @@
+#include "ray_packet.h"
+
+#include <algorithm>
+
+namespace tracer
+{
+
+namespace
+{
+
+template<int N>
+vmask<N> intersectBox(const RayPacket<N>& packet, const Node& node, vfloat<N> tmin, vfloat<N> tmax)
+{
+    for (int i = 0; i < 3; ++i) {
+        vfloat<N> t0 = (vfloat<N>(node.min[i]) - packet.origin[i]) * packet.invDir[i];
+        vfloat<N> t1 = (vfloat<N>(node.max[i]) - packet.origin[i]) * packet.invDir[i];
+        tmin = max(tmin, min(t0, t1));
+        tmax = min(tmax, max(t0, t1));
+    }
+    return tmin <= tmax;
+}
+
+// same arithmetic as intersectSphere so that packets and single rays agree
+template<int N>
+void intersectSphere(const RayPacket<N>& packet, Sphere sphere, int sphereIndex, vmask<N> active,
+                     vfloat<N> tmin, PacketHit<N>& hit)
+{
+    vfloat<N> oc[3];
+    for (int i = 0; i < 3; ++i) {
+        oc[i] = packet.origin[i] - vfloat<N>(sphere.center[i]);
+    }
+    vfloat<N> a = packet.dir[0] * packet.dir[0] + packet.dir[1] * packet.dir[1] + packet.dir[2] * packet.dir[2];
+    vfloat<N> b = oc[0] * packet.dir[0] + oc[1] * packet.dir[1] + oc[2] * packet.dir[2];
+    vfloat<N> c = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2] - vfloat<N>(sphere.radius * sphere.radius);
+    vfloat<N> discriminant = b * b - a * c;
+    active = active & (discriminant >= vfloat<N>(0.0f));
+    if (none(active)) {
+        return;
+    }
+
+    vfloat<N> sqrtDisr = sqrt(max(discriminant, vfloat<N>(0.0f)));
+    vfloat<N> tNear = (-b - sqrtDisr) / a;
+    vfloat<N> tFar = (-b + sqrtDisr) / a;
+    vmask<N> nearHit = active & (tmin <= tNear) & (tNear < hit.t);
+    vmask<N> farHit = andNot(active, nearHit) & (tmin <= tFar) & (tFar < hit.t);
+    vmask<N> hitMask = nearHit | farHit;
+    if (none(hitMask)) {
+        return;
+    }
+
+    hit.t = select(nearHit, tNear, select(farHit, tFar, hit.t));
+    for (int bits = hitMask.bits(); bits; bits &= bits - 1) {
+        hit.primIndex[__builtin_ctz(bits)] = sphereIndex;
+    }
+}
+
+// same arithmetic as intersectPlane
+template<int N>
+void intersectPlane(const RayPacket<N>& packet, Plane plane, int primIndex, vmask<N> active,
+                    vfloat<N> tmin, PacketHit<N>& hit)
+{
+    math::float3 normal(plane.normal);
+    vfloat<N> dist = vfloat<N>(normal.x) * packet.origin[0] + vfloat<N>(normal.y) * packet.origin[1] +
+                     vfloat<N>(normal.z) * packet.origin[2];
+    vfloat<N> speed = vfloat<N>(normal.x) * packet.dir[0] + vfloat<N>(normal.y) * packet.dir[1] +
+                      vfloat<N>(normal.z) * packet.dir[2];
+    vfloat<N> t = (vfloat<N>(plane.offset) - dist) / speed;
+    vmask<N> hitMask = active & (tmin <= t) & (t < hit.t);
+    if (none(hitMask)) {
+        return;
+    }
+
+    hit.t = select(hitMask, t, hit.t);
+    for (int bits = hitMask.bits(); bits; bits &= bits - 1) {
+        hit.primIndex[__builtin_ctz(bits)] = primIndex;
+    }
+}
+
+// the planes stay out of the bvh and are tested before it, like
+// Scene::closestHit does
+template<int N>
+void intersectPlanes(const Scene& scene, const RayPacket<N>& packet, vmask<N> active, vfloat<N> tmin,
+                     PacketHit<N>& hit)
+{
+    for (int i = 0; i < scene.numPlanes(); ++i) {
+        intersectPlane(packet, scene.getPlane(i), scene.firstPlaneIndex() + i, active, tmin, hit);
+    }
+}
+
+} // anonymous namespace
+
+template<int N>
+RayPacket<N> makeRayPacket(const Ray* rays, int count)
+{
+    alignas(32) float lanes[3][3][N];
+    for (int i = 0; i < N; ++i) {
+        const Ray& ray = rays[i < count ? i : count - 1];
+        for (int j = 0; j < 3; ++j) {
+            lanes[0][j][i] = ray.origin[j];
+            lanes[1][j][i] = ray.dir[j];
+            lanes[2][j][i] = 1.0f / ray.dir[j];
+        }
+    }
+
+    RayPacket<N> packet;
+    for (int j = 0; j < 3; ++j) {
+        packet.origin[j] = vfloat<N>::load(lanes[0][j]);
+        packet.dir[j] = vfloat<N>::load(lanes[1][j]);
+        packet.invDir[j] = vfloat<N>::load(lanes[2][j]);
+    }
+    return packet;
+}
+
+template<int N>
+vmask<N> intersectPacket(const Scene& scene, const RayPacket<N>& packet, vmask<N> active,
+                         float tmin, float tmax, PacketHit<N>& hit)
+{
+    // the children replace their parent, one more entry than levels
+    constexpr int MaxStackSize = MaxTraversalDepth + 1;
+    int stack[MaxStackSize];
+    stack[0] = 0;
+    int i = 1;
+
+    vfloat<N> tminLanes(tmin);
+    hit.t = vfloat<N>(tmax);
+    for (int j = 0; j < N; ++j) {
+        hit.primIndex[j] = -1;
+    }
+    intersectPlanes(scene, packet, active, tminLanes, hit);
+
+    while (i > 0) {
+        const Node& node = scene.getNode(stack[--i]);
+        vmask<N> overlap = active & intersectBox(packet, node, tminLanes, hit.t);
+        if (none(overlap)) {
+            continue;
+        }
+
+        if (node.left == -1) {
+            for (int j = 0; j < node.numObj; ++j) {
+                int sphereIndex = node.firstObjIndex + j;
+                intersectSphere(packet, scene.getSphere(sphereIndex), sphereIndex, overlap, tminLanes, hit);
+            }
+        } else {
+            // enter the child closer along the first overlapping lane first,
+            // coherent rays mostly agree on the order
+            int lane = __builtin_ctz(overlap.bits());
+            math::float3 origin(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]);
+            math::float3 dir(packet.dir[0][lane], packet.dir[1][lane], packet.dir[2][lane]);
+            const Node& left = scene.getNode(node.left);
+            const Node& right = scene.getNode(node.right);
+            float leftDist = math::dot((left.min + left.max) * 0.5f - origin, dir);
+            float rightDist = math::dot((right.min + right.max) * 0.5f - origin, dir);
+
+            MB_ASSERT(i + 1 < MaxStackSize);
+            if (leftDist < rightDist) {
+                stack[i++] = node.right;
+                stack[i++] = node.left;
+            } else {
+                stack[i++] = node.left;
+                stack[i++] = node.right;
+            }
+        }
+    }
+    return active & (hit.t < vfloat<N>(tmax));
+}
+
+template<int N>
+vmask<N> intersectPacket(const Scene& scene, const int* leaves, const float* nearDists, int numLeaves,
+                         const RayPacket<N>& packet, vmask<N> active, float tmin, float tmax, PacketHit<N>& hit)
+{
+    vfloat<N> tminLanes(tmin);
+    hit.t = vfloat<N>(tmax);
+    for (int j = 0; j < N; ++j) {
+        hit.primIndex[j] = -1;
+    }
+    intersectPlanes(scene, packet, active, tminLanes, hit);
+
+    // the furthest hit of the active lanes
+    float farthest = tmax;
+    if (scene.numPlanes() > 0) {
+        farthest = 0;
+        for (int bits = active.bits(); bits; bits &= bits - 1) {
+            farthest = std::max(farthest, hit.t[__builtin_ctz(bits)]);
+        }
+    }
+    for (int i = 0; i < numLeaves && nearDists[i] < farthest; ++i) {
+        const Node& node = scene.getNode(leaves[i]);
+        vmask<N> overlap = active & intersectBox(packet, node, tminLanes, hit.t);
+        if (none(overlap)) {
+            continue;
+        }
+        for (int j = 0; j < node.numObj; ++j) {
+            int sphereIndex = node.firstObjIndex + j;
+            intersectSphere(packet, scene.getSphere(sphereIndex), sphereIndex, overlap, tminLanes, hit);
+        }
+        farthest = 0;
+        for (int bits = active.bits(); bits; bits &= bits - 1) {
+            farthest = std::max(farthest, hit.t[__builtin_ctz(bits)]);
+        }
+    }
+    return active & (hit.t < vfloat<N>(tmax));
+}
+
+template RayPacket<4> makeRayPacket<4>(const Ray*, int);
+template RayPacket<8> makeRayPacket<8>(const Ray*, int);
+template vmask<4> intersectPacket<4>(const Scene&, const RayPacket<4>&, vmask<4>, float, float, PacketHit<4>&);
+template vmask<8> intersectPacket<8>(const Scene&, const RayPacket<8>&, vmask<8>, float, float, PacketHit<8>&);
+template vmask<4> intersectPacket<4>(const Scene&, const int*, const float*, int, const RayPacket<4>&, vmask<4>,
+                                     float, float, PacketHit<4>&);
+template vmask<8> intersectPacket<8>(const Scene&, const int*, const float*, int, const RayPacket<8>&, vmask<8>,
+                                     float, float, PacketHit<8>&);
+
+}
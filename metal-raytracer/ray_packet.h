@@ -0,0 +1,59 @@
+//
+//  ray_packet.h
+//  metal-raytracer
+//
+//  Packets of coherent rays traced together through the flattened bvh on
+//  the CPU. Every node is tested against all lanes at once and a subtree is
+//  entered as long as any active lane overlaps it.
+//
+
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "simd_types.h"
+#include "tracer.h"
+
+namespace tracer
+{
+
+constexpr int PacketWidth = SimdWidth;
+
+template<int N>
+struct RayPacket
+{
+    // structure of arrays, indexed by axis
+    vfloat<N> origin[3];
+    vfloat<N> dir[3];
+    vfloat<N> invDir[3];
+};
+
+template<int N>
+struct PacketHit
+{
+    // distance of the closest hit, tmax for lanes without one
+    vfloat<N> t;
+    // -1 for lanes without a hit
+    int primIndex[N];
+};
+
+// packs count rays, the unused lanes repeat the last ray
+template<int N>
+RayPacket<N> makeRayPacket(const Ray* rays, int count);
+
+// finds the closest sphere for every lane set in active, returns the lanes
+// that hit something
+template<int N>
+vmask<N> intersectPacket(const Scene& scene, const RayPacket<N>& packet, vmask<N> active,
+                         float tmin, float tmax, PacketHit<N>& hit);
+
+// the same over a list of leaves in the order given, e.g. the ones a tile
+// frustum overlaps. nearDists are lower bounds of the distances at which the
+// lanes enter the leaves and ascending, the leaves beyond the hits of all
+// lanes are skipped.
+template<int N>
+vmask<N> intersectPacket(const Scene& scene, const int* leaves, const float* nearDists, int numLeaves,
+                         const RayPacket<N>& packet, vmask<N> active, float tmin, float tmax, PacketHit<N>& hit);
+
+}
+
+#endif /* RAY_PACKET_H */
@@ -0,0 +1,119 @@
+#include "sah_binning.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+namespace
+{
+
+constexpr int bin_num = 32;
+
+} // anonymous namespace
+
+int sah_split(sah_ref* refs, int n, const sah_params& params, aabb3& volume)
+{
+    // find the aabb of the current node and the bounds of the centers the
+    // bins are spread over
+    volume = aabb3::empty();
+    auto centers = aabb3::empty();
+    for (int i = 0; i < n; ++i) {
+        volume.expand(refs[i].bounds);
+        centers.expand({ refs[i].center, refs[i].center });
+    }
+
+    if (n <= 1) {
+        return 0;
+    }
+
+    struct bin
+    {
+        aabb3 bounds = aabb3::empty();
+        int count = 0;
+    };
+
+    // bin the centers along every axis in one pass
+    bin bins[3][bin_num];
+    glm::vec3 scale;
+    for (int i = 0; i < 3; ++i) {
+        float extent = centers.max[i] - centers.min[i];
+        scale[i] = extent > 0.0f ? bin_num / extent : 0.0f;
+    }
+    auto bin_index = [&](const sah_ref& ref, int axis) {
+        int b = (int)((ref.center[axis] - centers.min[axis]) * scale[axis]);
+        return std::min(b, bin_num - 1);
+    };
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < 3; ++i) {
+            auto& b = bins[i][bin_index(refs[j], i)];
+            b.bounds.expand(refs[j].bounds);
+            ++b.count;
+        }
+    }
+
+    // use SAH to pick the best plane between two bins
+    float min_cost = numeric_limits<float>::max();
+    int split_axis = -1;
+    int split_bin = 0;
+    for (int i = 0; i < 3; ++i) {
+        if (scale[i] == 0.0f) {
+            continue;
+        }
+
+        // cost of the right side of every plane
+        float right_costs[bin_num];
+        auto bb = aabb3::empty();
+        int count = 0;
+        for (int j = bin_num - 1; j > 0; --j) {
+            bb.expand(bins[i][j].bounds);
+            count += bins[i][j].count;
+            right_costs[j] = count > 0 ? bb.surface_area() * params.leaf_tests(count) : -1.0f;
+        }
+
+        bb = aabb3::empty();
+        count = 0;
+        for (int j = 0; j < bin_num - 1; ++j) {
+            bb.expand(bins[i][j].bounds);
+            count += bins[i][j].count;
+            if (count == 0 || right_costs[j + 1] < 0.0f) {
+                continue;
+            }
+            float cost = bb.surface_area() * params.leaf_tests(count) + right_costs[j + 1];
+            if (cost < min_cost) {
+                min_cost = cost;
+                split_axis = i;
+                split_bin = j;
+            }
+        }
+    }
+
+    // the sweep leaves out the constant factors, scale the best split to the
+    // cost of a ray entering this node and compare it against a leaf
+    float area = volume.surface_area();
+    if (n <= params.max_leaf_size) {
+        float leaf_cost = params.leaf_cost(n);
+        float split_cost = params.traversal_cost + params.intersection_cost * min_cost / area;
+        if (split_axis == -1 || !(area > 0.0f) || leaf_cost <= split_cost) {
+            return 0;
+        }
+    }
+
+    if (split_axis == -1) {
+        // every center is at the same spot, split in the middle
+        return n / 2;
+    }
+    auto mid = partition(refs, refs + n, [&](const sah_ref& ref) {
+        return bin_index(ref, split_axis) <= split_bin;
+    });
+    return (int)(mid - refs);
+}
+
+int sah_spawn_depth()
+{
+    // a few levels more than needed to occupy every thread so that uneven
+    // subtrees still keep them busy
+    return (int)ceil(log2((float)utils::hardwareThreads())) + 2;
+}
@@ -0,0 +1,28 @@
+#ifndef SAH_BINNING_H
+#define SAH_BINNING_H
+
+#include "aabb.h"
+#include "bvh_node.h"
+
+// an object with its bounds fetched once, the SAH builders reorder these
+// instead of calling get_aabb over and over
+struct sah_ref
+{
+    aabb3 bounds;
+    glm::vec3 center;
+    // index of the object in the input of the build
+    int index;
+};
+
+// finds the bounds of the refs and partitions them at the cheapest plane
+// between 32 bins of their centers along any axis, returns the number of
+// refs moved to the front or 0 if they are better kept in one leaf
+int sah_split(sah_ref* refs, int n, const sah_params& params, aabb3& volume);
+
+// number of levels in which a build hands subtrees to other threads
+int sah_spawn_depth();
+
+// subtrees with fewer refs are never built on another thread
+constexpr int sah_min_parallel_refs = 4096;
+
+#endif // SAH_BINNING_H
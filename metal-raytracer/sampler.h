@@ -0,0 +1,294 @@
+//
+//  sampler.h
+//  metal-raytracer
+//
+//  Sample generators the ray tracer can draw its random numbers from. Like
+//  Random they provide
+//
+//      void startSample(math::uint2 pixel, uint sampleIndex)
+//      float next()
+//      math::float2 inUnitRect()
+//      math::float3 inUnitSphere()
+//
+//  where startSample() is called before the first number of every sample
+//  and every following call takes the next dimension of that sample.
+//
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "metal_bridge.h"
+
+namespace tracer
+{
+
+constant constexpr float Pi = 3.14159265358979f;
+
+// seed of the random sequence of a pixel, neighbouring pixels get unrelated
+// seeds
+inline uint pixelSeed(uint seed, int x, int y, int width)
+{
+    uint h = seed ^ (uint)(x + y * width) * 0x9E3779B9u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+inline uint hashCombine(uint seed, uint value)
+{
+    return pixelSeed(seed, (int)value, 0, 0);
+}
+
+// maps three uniform numbers to a point distributed uniformly in the unit
+// ball, in closed form instead of rejecting points of the cube
+inline math::float3 sampleUnitBall(float u0, float u1, float u2)
+{
+    float z = 1.0f - 2.0f * u0;
+    float r = math::sqrt(math::max(0.0f, 1.0f - z * z));
+    float phi = 2.0f * Pi * u1;
+    float radius = math::pow(u2, 1.0f / 3.0f);
+    return radius * math::float3(r * math::cos(phi), r * math::sin(phi), z);
+}
+
+inline uint reverseBits(uint x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// the hash of Burley's "Practical Hash-based Owen Scrambling", it only lets
+// lower bits affect higher ones, so on a bit reversed value it is a nested
+// uniform scramble
+inline uint laineKarrasPermutation(uint x, uint seed)
+{
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1u;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return x;
+}
+
+inline uint owenScramble(uint x, uint seed)
+{
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// the first two dimensions of the Sobol sequence, Owen scrambled. Both are
+// built bit reversed, which the scramble needs anyway: the first dimension
+// is the reversed index and the generator matrix of the second is Pascal's
+// triangle mod 2, whose product with the index is a superset parity sum
+// over the bit positions.
+inline uint scrambledSobol0(uint index, uint seed)
+{
+    return reverseBits(laineKarrasPermutation(index, seed));
+}
+
+inline uint scrambledSobol1(uint index, uint seed)
+{
+    index ^= (index >> 1) & 0x55555555u;
+    index ^= (index >> 2) & 0x33333333u;
+    index ^= (index >> 4) & 0x0f0f0f0fu;
+    index ^= (index >> 8) & 0x00ff00ffu;
+    index ^= (index >> 16) & 0x0000ffffu;
+    return reverseBits(laineKarrasPermutation(index, seed));
+}
+
+inline float toUnitFloat(uint x)
+{
+    return float(x >> 8) / 16777216.0f;
+}
+
+inline uint mulhi32(uint a, uint b)
+{
+#ifdef __METAL_VERSION__
+    return metal::mulhi(a, b);
+#else
+    return (uint)(((unsigned long long)a * b) >> 32);
+#endif
+}
+
+// Philox4x32-10 from Salmon et al., "Parallel Random Numbers: As Easy as
+// 1, 2, 3", maps every counter to four independent random words, so any
+// number of any sample can be drawn without drawing the ones before it
+inline math::uint4 philox(math::uint4 counter, math::uint2 key)
+{
+    for (int round = 0; round < 10; ++round) {
+        uint hi0 = mulhi32(0xD2511F53u, counter.x);
+        uint lo0 = 0xD2511F53u * counter.x;
+        uint hi1 = mulhi32(0xCD9E8D57u, counter.z);
+        uint lo1 = 0xCD9E8D57u * counter.z;
+        counter = math::uint4(hi1 ^ counter.y ^ key.x, lo1, hi0 ^ counter.w ^ key.y, lo0);
+        key += math::uint2(0x9E3779B9u, 0xBB67AE85u);
+    }
+    return counter;
+}
+
+// counter based, the numbers of a sample depend only on the seed, the pixel,
+// the sample index and how many were drawn before in the same sample, which
+// makes a render independent of threads, tiles and how the samples are split
+// into runs
+class PhiloxSampler
+{
+public:
+    PhiloxSampler(uint seed)
+        : m_key(seed, 0x5851F42Du)
+        , m_counter(0)
+    {}
+
+    void startSample(math::uint2 pixel, uint sampleIndex)
+    {
+        m_counter = math::uint4(pixel.x, pixel.y, sampleIndex, 0);
+    }
+
+    float next()
+    {
+        return toUnitFloat(draw().x);
+    }
+
+    math::float2 inUnitRect()
+    {
+        math::uint4 r = draw();
+        return math::float2(toUnitFloat(r.x), toUnitFloat(r.y));
+    }
+
+    math::float3 inUnitSphere()
+    {
+        math::uint4 r = draw();
+        return sampleUnitBall(toUnitFloat(r.x), toUnitFloat(r.y), toUnitFloat(r.z));
+    }
+private:
+    // the last word of the counter numbers the draws within the sample
+    math::uint4 draw()
+    {
+        math::uint4 r = philox(m_counter, m_key);
+        ++m_counter.w;
+        return r;
+    }
+
+    math::uint2 m_key;
+    math::uint4 m_counter;
+};
+
+// Owen scrambled Sobol points, every pair of dimensions is its own shuffled
+// and scrambled copy of the first two Sobol dimensions, keyed by the pixel
+// and the dimension. The samples of a pixel are stratified in each pair
+// while pixels and pairs stay uncorrelated.
+class SobolSampler
+{
+public:
+    SobolSampler(uint seed)
+        : m_seed(seed)
+        , m_pixelSeed(seed)
+        , m_index(0)
+        , m_dimension(0)
+    {}
+
+    void startSample(math::uint2 pixel, uint sampleIndex)
+    {
+        m_pixelSeed = hashCombine(hashCombine(m_seed, pixel.x), pixel.y);
+        m_index = sampleIndex;
+        m_dimension = 0;
+    }
+
+    float next()
+    {
+        uint seed = hashCombine(m_pixelSeed, m_dimension++);
+        uint index = owenScramble(m_index, seed);
+        return toUnitFloat(scrambledSobol0(index, hashCombine(seed, 1)));
+    }
+
+    math::float2 inUnitRect()
+    {
+        uint seed = hashCombine(m_pixelSeed, m_dimension++);
+        uint index = owenScramble(m_index, seed);
+        return math::float2(toUnitFloat(scrambledSobol0(index, hashCombine(seed, 1))),
+                            toUnitFloat(scrambledSobol1(index, hashCombine(seed, 2))));
+    }
+
+    math::float3 inUnitSphere()
+    {
+        math::float2 u = inUnitRect();
+        return sampleUnitBall(u.x, u.y, next());
+    }
+private:
+    uint m_seed;
+    uint m_pixelSeed;
+    uint m_index;
+    uint m_dimension;
+};
+
+// every pixel shares one scrambled Sobol sequence and shifts it by the value
+// of a tiled blue noise mask, moved by a different offset for each
+// dimension. Neighbouring pixels are shifted apart as far as possible, which
+// leaves the remaining error as high frequency noise that is much less
+// visible at low sample counts.
+class BlueNoiseSampler
+{
+public:
+    // mask holds size * size values in [0, 1)
+    BlueNoiseSampler(constant float* mask, int size, uint seed)
+        : m_mask(mask)
+        , m_size(size)
+        , m_seed(seed)
+        , m_pixel(0)
+        , m_index(0)
+        , m_dimension(0)
+    {}
+
+    void startSample(math::uint2 pixel, uint sampleIndex)
+    {
+        m_pixel = pixel;
+        m_index = sampleIndex;
+        m_dimension = 0;
+    }
+
+    float next()
+    {
+        uint seed = hashCombine(m_seed, m_dimension);
+        uint index = owenScramble(m_index, seed);
+        return shift(toUnitFloat(scrambledSobol0(index, hashCombine(seed, 1))), m_dimension++);
+    }
+
+    math::float2 inUnitRect()
+    {
+        uint seed = hashCombine(m_seed, m_dimension);
+        uint index = owenScramble(m_index, seed);
+        float x = shift(toUnitFloat(scrambledSobol0(index, hashCombine(seed, 1))), m_dimension++);
+        float y = shift(toUnitFloat(scrambledSobol1(index, hashCombine(seed, 2))), m_dimension++);
+        return math::float2(x, y);
+    }
+
+    math::float3 inUnitSphere()
+    {
+        math::float2 u = inUnitRect();
+        return sampleUnitBall(u.x, u.y, next());
+    }
+private:
+    float shift(float u, uint dimension) const
+    {
+        uint offset = hashCombine(m_seed ^ 0x68bc21ebu, dimension);
+        uint x = (m_pixel.x + (offset & 0xffffu)) % (uint)m_size;
+        uint y = (m_pixel.y + (offset >> 16)) % (uint)m_size;
+        u += m_mask[x + y * m_size];
+        return u >= 1.0f ? u - 1.0f : u;
+    }
+
+    constant float* m_mask;
+    int m_size;
+    uint m_seed;
+    math::uint2 m_pixel;
+    uint m_index;
+    uint m_dimension;
+};
+
+}
+
+#endif /* SAMPLER_H */
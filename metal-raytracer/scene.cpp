@@ -1,12 +1,31 @@
 #include "scene.h"
+#include "sah_binning.h"
+#include "sampler.h"
 #include "utils.h"
 
 #include <glm/glm.hpp>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
 
 namespace 
 {
 
+void append(const SphereObject& obj, SceneBuffer& buffer)
+{
+    auto& target = buffer.objects.emplace_back();
+    target.center = obj.center;
+    target.radius = obj.radius;
+
+    auto& mat = buffer.materials.emplace_back();
+    mat.albedo = obj.albedo;
+    mat.type = obj.type;
+    mat.prop = obj.prop;
+}
+
 int flatten(const bvh_node* root, SceneBuffer& buffer)
 {
     if (!root) {
@@ -22,15 +41,7 @@ int flatten(const bvh_node* root, SceneBuffer& buffer)
     curNode.numObj = root->num_objects();
 
     for (int i = 0; i < root->num_objects(); ++i) {
-        auto obj = static_cast<const SphereObject*>(root->get_object(i));
-        auto& target = buffer.objects.emplace_back();
-        target.center = obj->center;
-        target.radius = obj->radius;
-
-        auto& mat = buffer.materials.emplace_back();
-        mat.albedo = obj->albedo;
-        mat.type = obj->type;
-        mat.prop = obj->prop;
+        append(*static_cast<const SphereObject*>(root->get_object(i)), buffer);
     }
 
     curNode.left = flatten(root->left(), buffer);
@@ -40,55 +51,373 @@ int flatten(const bvh_node* root, SceneBuffer& buffer)
     return index;
 }
 
+// the random numbers of one grid cell, drawn from a Philox stream keyed by
+// the seed and the cell
+class cell_random
+{
+public:
+    cell_random(uint seed, int a, int b)
+        : m_key(seed, 0x3C6EF372u)
+        , m_counter((uint)a, (uint)b, 0, 0)
+    {}
+
+    float operator()()
+    {
+        if (m_next == 4) {
+            m_words = tracer::philox(m_counter, m_key);
+            ++m_counter.z;
+            m_next = 0;
+        }
+        return tracer::toUnitFloat(m_words[m_next++]);
+    }
+
+private:
+    glm::uvec2 m_key;
+    glm::uvec4 m_counter;
+    glm::uvec4 m_words;
+    int m_next = 4;
+};
+
+// the small sphere of grid cell (a, b), false if the cell stays empty
+bool make_grid_sphere(uint seed, int a, int b, SphereObject& obj)
+{
+    cell_random random(seed, a, b);
+    float choose_mat = random();
+    glm::vec3 center(a + 0.9f * random(), 0.2f, b + 0.9f * random());
+    if ((center - glm::vec3(4, 0.2f, 0)).length() <= 0.9f) {
+        return false;
+    }
+    obj.center = center;
+    obj.radius = 0.2f;
+    if (choose_mat < 0.8f) {
+        obj.albedo = glm::vec3(random() * random(),
+                               random() * random(),
+                               random() * random());
+        obj.type = Diffuse;
+    } else if (choose_mat < 0.95f) {
+        obj.albedo = glm::vec3(0.5f * (1 + random()),
+                               0.5f * (1 + random()),
+                               0.5f * (1 + random()));
+        obj.prop = 0.5f * random();
+        obj.type = Metal;
+    } else {
+        obj.type = Dielectric;
+        obj.prop = 1.5f;
+    }
+    return true;
+}
+
 } // anonymous namespace
 
-Scene createScene()
+Scene createScene(int grid_size, const SceneBuildOptions& options, uint seed)
 {
     Scene scene;
-    scene.objects.emplace_back( glm::vec3(0, -1000, 0), 1000.0f, Diffuse, glm::vec3(1) * 0.5f );
-
-    const int x_count = 11, y_count = 11;
-    for (int a = -x_count; a < x_count; ++a) {
-        for (int b = -y_count; b < y_count; ++b) {
-            float choose_mat = utils::random();
-            glm::vec3 center(a + 0.9f * utils::random(), 0.2f, b + 0.9f * utils::random());
-            if ((center - glm::vec3(4, 0.2f, 0)).length() > 0.9f) {
-                SphereObject obj;
-                obj.center = center;
-                obj.radius = 0.2f;
-                if (choose_mat < 0.8f) {
-                    obj.albedo = glm::vec3(utils::random() * utils::random(),
-                                           utils::random() * utils::random(),
-                                           utils::random() * utils::random());
-                    obj.type = Diffuse;
-                } else if (choose_mat < 0.95f) {
-                    obj.albedo = glm::vec3(0.5f * (1 + utils::random()),
-                                           0.5f * (1 + utils::random()),
-                                           0.5f * (1 + utils::random()));
-                    obj.prop = 0.5f * utils::random();
-                    obj.type = Metal;
-                } else {
-                    obj.type = Dielectric;
-                    obj.prop = 1.5f;
-                }
-                scene.objects.push_back(obj);
+    scene.options = options;
+    // the ground used to be a sphere of radius 1000 below the origin, whose
+    // box held the whole scene and which nearly every ray had to test
+    scene.planes.push_back({ glm::vec3(0, 1, 0), 0.0f, { glm::vec3(0.5f), Diffuse, 0.0f } });
+
+    // every cell draws from its own stream, so the rows can be generated in
+    // parallel and still come out the same
+    const int x_count = grid_size, y_count = grid_size;
+    const int num_rows = 2 * x_count;
+    const int row_size = 2 * y_count;
+    std::vector<SphereObject> cells((size_t)num_rows * row_size);
+    std::vector<char> filled(cells.size(), 0);
+    std::atomic<int> next_row{0};
+    int num_threads = std::min(utils::hardwareThreads(), std::max(1, num_rows / 16));
+    utils::runThreads(num_threads, [&](int) {
+        for (int row = next_row++; row < num_rows; row = next_row++) {
+            for (int col = 0; col < row_size; ++col) {
+                size_t i = (size_t)row * row_size + col;
+                filled[i] = make_grid_sphere(seed, row - x_count, col - y_count, cells[i]);
             }
         }
+    });
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (filled[i]) {
+            scene.objects.push_back(cells[i]);
+        }
     }
 
     scene.objects.emplace_back( glm::vec3(0, 1, 0), 1.0f, Dielectric, glm::vec3(0), 1.5f );
     scene.objects.emplace_back( glm::vec3(-4, 1, 0), 1.0f, Diffuse, glm::vec3(0.4, 0.2, 0.1) );
     scene.objects.emplace_back( glm::vec3(4, 1, 0), 1.0f, Metal, glm::vec3(0.7, 0.6, 0.5) );
 
-    std::vector<object*> objects;
-    for (auto& o : scene.objects) {
-        objects.push_back(&o);
+    if (options.builder == BVHBuilder::SAHTree) {
+        std::vector<object*> objects;
+        for (auto& o : scene.objects) {
+            objects.push_back(&o);
+        }
+        scene.root = std::make_unique<bvh_node>(objects.data(), objects.size(), options.sah);
     }
-    scene.root = std::make_unique<bvh_node>(objects.data(), objects.size());
     return scene;
 }
 
+namespace
+{
+
+// appends the triangles of mesh scaled to the given height, with the center
+// of the bottom of its bounds at position
+void append_mesh(const TriangleMesh& mesh, int material, const glm::vec3& position, float height,
+                 std::vector<TriangleObject>& out)
+{
+    if (mesh.positions.empty()) {
+        return;
+    }
+    aabb3 bounds = aabb3::empty();
+    for (const glm::vec3& p : mesh.positions) {
+        bounds.expand(aabb3(p, p));
+    }
+    float size = bounds.max.y - bounds.min.y;
+    float scale = size > 0 ? height / size : 1.0f;
+    glm::vec3 base(bounds.center().x, bounds.min.y, bounds.center().z);
+
+    size_t first = out.size();
+    size_t n = mesh.numTriangles();
+    out.resize(first + n);
+    int num_threads = n >= 65536 ? utils::hardwareThreads() : 1;
+    utils::runThreads(num_threads, [&](int thread_index) {
+        size_t begin = n * thread_index / num_threads;
+        size_t end = n * (thread_index + 1) / num_threads;
+        for (size_t i = begin; i < end; ++i) {
+            const int* index = &mesh.indices[3 * i];
+            out[first + i] = TriangleObject((mesh.positions[index[0]] - base) * scale + position,
+                                            (mesh.positions[index[1]] - base) * scale + position,
+                                            (mesh.positions[index[2]] - base) * scale + position,
+                                            material);
+        }
+    });
+}
+
+// appends a tree that was built on its own, its child indices and the
+// first primitives of its leaves move by the offsets. Returns its root.
+int append_subtree(std::vector<Node>& nodes, const std::vector<Node>& subtree, int object_offset)
+{
+    int offset = (int)nodes.size();
+    for (Node node : subtree) {
+        if (node.left != -1) {
+            node.left += offset;
+            node.right += offset;
+        } else {
+            node.firstObjIndex += object_offset;
+        }
+        nodes.push_back(node);
+    }
+    return offset;
+}
+
+Node join_nodes(const std::vector<Node>& nodes, int left, int right)
+{
+    Node node;
+    node.min = glm::min(nodes[left].min, nodes[right].min);
+    node.max = glm::max(nodes[left].max, nodes[right].max);
+    node.left = left;
+    node.right = right;
+    node.firstObjIndex = 0;
+    node.numObj = 0;
+    return node;
+}
+
+// the most inner nodes on a way from root down to a leaf, the leaf of an
+// instance adds what bottom_depth gives for the root of its bvh
+template<typename BottomDepth>
+int subtree_depth(const std::vector<Node>& nodes, const std::vector<Instance>& instances, int root,
+                  BottomDepth&& bottom_depth)
+{
+    int depth = 0;
+    std::vector<std::pair<int, int>> stack = { { root, 0 } };
+    while (!stack.empty()) {
+        auto [index, above] = stack.back();
+        stack.pop_back();
+        const Node& node = nodes[index];
+        if (node.left != -1) {
+            stack.push_back({ node.left, above + 1 });
+            stack.push_back({ node.right, above + 1 });
+        } else if (node.right == PrimitiveInstance) {
+            depth = std::max(depth, above + bottom_depth(instances[node.firstObjIndex].root));
+        } else {
+            depth = std::max(depth, above);
+        }
+    }
+    return depth;
+}
+
+// the deepest way the traversal can take from node 0, through the
+// instances into their bottom level bvhs
+int traversal_depth(const std::vector<Node>& nodes, const std::vector<Instance>& instances)
+{
+    if (nodes.empty()) {
+        return 0;
+    }
+    // the instances of a geometry share its bvh, which is walked once
+    std::unordered_map<int, int> bottom_depths;
+    auto bottom_depth = [&](int root) {
+        auto [it, inserted] = bottom_depths.try_emplace(root, 0);
+        if (inserted) {
+            it->second = subtree_depth(nodes, instances, root, [](int) { return 0; });
+        }
+        return it->second;
+    };
+    return subtree_depth(nodes, instances, 0, bottom_depth);
+}
+
+// the box around box moved by the affine map
+aabb3 transform_box(const glm::mat4& m, const aabb3& box)
+{
+    aabb3 out = aabb3::empty();
+    for (int corner = 0; corner < 8; ++corner) {
+        glm::vec3 p((corner & 1) ? box.max.x : box.min.x,
+                    (corner & 2) ? box.max.y : box.min.y,
+                    (corner & 4) ? box.max.z : box.min.z);
+        glm::vec3 q(m * glm::vec4(p, 1.0f));
+        out.expand(aabb3(q, q));
+    }
+    return out;
+}
+
+} // anonymous namespace
+
+void addMesh(Scene& scene, const TriangleMesh& mesh, const Material& material,
+             const glm::vec3& position, float height)
+{
+    int materialIndex = (int)scene.meshMaterials.size();
+    scene.meshMaterials.push_back(material);
+    append_mesh(mesh, materialIndex, position, height, scene.triangles);
+}
+
+int addGeometry(Scene& scene, const TriangleMesh& mesh, const Material& material)
+{
+    int materialIndex = (int)scene.meshMaterials.size();
+    scene.meshMaterials.push_back(material);
+    append_mesh(mesh, materialIndex, glm::vec3(0.0f), 1.0f, scene.geometries.emplace_back().triangles);
+    return (int)scene.geometries.size() - 1;
+}
+
 SceneBuffer::SceneBuffer(const Scene& scene)
 {
-    flatten(scene.root.get(), *this);
+    buildSpheres(scene);
+    planes = scene.planes;
+    meshMaterials = scene.meshMaterials;
+    if (!scene.triangles.empty()) {
+        // the triangles get a tree of their own next to the spheres
+        std::vector<Node> triangleNodes;
+        build_flat_bvh(scene.triangles.data(), (int)scene.triangles.size(), scene.options.sah, triangleNodes, triangles);
+        peakBuildBytes += triangleNodes.capacity() * sizeof(Node) + triangles.capacity() * sizeof(Triangle);
+        if (scene.objects.empty()) {
+            nodes = std::move(triangleNodes);
+        } else {
+            std::vector<Node> sphereNodes = std::move(nodes);
+            nodes.assign(1, Node());
+            int left = append_subtree(nodes, sphereNodes, 0);
+            int right = append_subtree(nodes, triangleNodes, 0);
+            nodes[0] = join_nodes(nodes, left, right);
+        }
+    }
+    if (scene.instances.empty()) {
+        checkTraversalDepth();
+        return;
+    }
+
+    std::vector<Node> sceneNodes = std::move(nodes);
+    nodes.assign(1, Node());
+    // without spheres and triangles node 1 is left to the first geometry,
+    // whatever the builders wrote for the empty scene is dropped
+    m_hasSceneNodes = !scene.objects.empty() || !scene.triangles.empty();
+    if (m_hasSceneNodes) {
+        append_subtree(nodes, sceneNodes, 0);
+    }
+    for (const SceneGeometry& geometry : scene.geometries) {
+        std::vector<Node> geometryNodes;
+        std::vector<Triangle> geometryTriangles;
+        build_flat_bvh(geometry.triangles.data(), (int)geometry.triangles.size(), scene.options.sah,
+                       geometryNodes, geometryTriangles);
+        m_geometryRoots.push_back(append_subtree(nodes, geometryNodes, (int)triangles.size()));
+        triangles.insert(triangles.end(), geometryTriangles.begin(), geometryTriangles.end());
+    }
+    m_topLevelOffset = nodes.size();
+    buildTopLevel(scene);
+}
+
+void SceneBuffer::rebuildTopLevel(const Scene& scene)
+{
+    assert(m_topLevelOffset > 0 && scene.instances.size() > 0);
+    nodes.resize(m_topLevelOffset);
+    buildTopLevel(scene);
+}
+
+void SceneBuffer::buildTopLevel(const Scene& scene)
+{
+    int n = (int)scene.instances.size();
+    std::vector<aabb3> boxes(n);
+    for (int i = 0; i < n; ++i) {
+        const SceneInstance& instance = scene.instances[i];
+        const Node& root = nodes[m_geometryRoots[instance.geometry]];
+        boxes[i] = transform_box(instance.toWorld, aabb3(root.min, root.max));
+    }
+
+    // one instance per leaf, the traversal enters them one at a time
+    sah_params params = scene.options.sah;
+    params.max_leaf_size = 1;
+    std::vector<Node> topNodes;
+    std::vector<int> order;
+    build_flat_bvh(boxes.data(), n, params, PrimitiveInstance, topNodes, order);
+
+    instances.resize(n);
+    for (int slot = 0; slot < n; ++slot) {
+        const SceneInstance& src = scene.instances[order[slot]];
+        glm::mat4 toObject = glm::inverse(src.toWorld);
+        for (int c = 0; c < 4; ++c) {
+            instances[slot].toObject[c] = glm::vec3(toObject[c]);
+        }
+        instances[slot].root = m_geometryRoots[src.geometry];
+    }
+    int topRoot = append_subtree(nodes, topNodes, 0);
+    nodes[0] = m_hasSceneNodes ? join_nodes(nodes, 1, topRoot) : nodes[topRoot];
+    checkTraversalDepth();
+}
+
+void SceneBuffer::checkTraversalDepth() const
+{
+    // a deeper tree would overflow the fixed stacks of the traversals, which
+    // only assert in debug builds
+    int depth = traversal_depth(nodes, instances);
+    if (depth > MaxTraversalDepth) {
+        std::fprintf(stderr, "the bvh is %d nodes deep, the traversal supports at most %d\n",
+                     depth, MaxTraversalDepth);
+        std::abort();
+    }
+}
+
+void SceneBuffer::buildSpheres(const Scene& scene)
+{
+    if (scene.root) {
+        flatten(scene.root.get(), *this);
+
+        // the tree is alive next to the refs it was built from and later
+        // next to the buffer
+        size_t refBytes = scene.objects.size() * sizeof(sah_ref);
+        size_t bufferBytes = nodes.capacity() * sizeof(Node)
+                           + objects.capacity() * sizeof(Sphere)
+                           + materials.capacity() * sizeof(Material);
+        peakBuildBytes = scene.root->memory_usage() + std::max(refBytes, bufferBytes);
+        return;
+    }
+
+    if (scene.options.builder == BVHBuilder::SAH) {
+        build_flat_bvh(scene.objects.data(), (int)scene.objects.size(), scene.options.sah, *this);
+        return;
+    }
+
+    std::vector<const object*> objs;
+    for (auto& o : scene.objects) {
+        objs.push_back(&o);
+    }
+    std::vector<int> order;
+    nodes = build_lbvh(objs.data(), (int)objs.size(), scene.options.sah, scene.options.lbvh, order);
+    objects.reserve(order.size());
+    materials.reserve(order.size());
+    for (int i : order) {
+        append(scene.objects[i], *this);
+    }
 }
@@ -4,25 +4,108 @@
 #pragma once
 
 #include "bvh_node.h"
+#include "flat_bvh.h"
+#include "lbvh.h"
+#include "mesh.h"
 #include "sphere_object.h"
 #include "scene_types.h"
+#include "triangle_object.h"
 #include <vector>
 
+enum class BVHBuilder
+{
+    SAH,     // binned SAH written straight into the node array
+    SAHTree, // the same tree built as bvh_node and flattened afterwards
+    LBVH,    // morton code tree written straight into the node array
+};
+
+struct SceneBuildOptions
+{
+    BVHBuilder builder = BVHBuilder::SAH;
+    sah_params sah;
+    lbvh_params lbvh;
+};
+
+// triangles in object space, shared by all instances placing them
+struct SceneGeometry
+{
+    std::vector<TriangleObject> triangles;
+};
+
+struct SceneInstance
+{
+    int geometry;
+    glm::mat4 toWorld;
+};
+
 struct Scene
 {
     std::vector<SphereObject> objects;
+    // the unbounded primitives, which stay out of the bvh
+    std::vector<Plane> planes;
+    // the triangles of all meshes, always built with the binned SAH into a
+    // subtree of their own next to the spheres
+    std::vector<TriangleObject> triangles;
+    std::vector<Material> meshMaterials;
+    // every geometry gets a bottom level bvh of its own, the instances a top
+    // level bvh over them
+    std::vector<SceneGeometry> geometries;
+    std::vector<SceneInstance> instances;
+    // only built by BVHBuilder::SAHTree, SceneBuffer builds the others
     std::unique_ptr<bvh_node> root;
+    SceneBuildOptions options;
 };
 
+// with instances node 0 joins the rest of the scene at node 1 and the top
+// level bvh, which comes after the bottom level ones at the end of the nodes.
+// A scene of nothing but instances has no rest, node 0 is then a copy of
+// the root of the top level.
 struct SceneBuffer
 {
     SceneBuffer(const Scene& scene);
 
+    // builds the top level bvh again after the instances of the scene moved,
+    // the bottom level ones and the rest of the scene stay as they are
+    void rebuildTopLevel(const Scene& scene);
+
     std::vector<Node> nodes;
     std::vector<Sphere> objects;
     std::vector<Material> materials;
+    // the triangles of the meshes placed in world space first, the ones of
+    // the geometries after them
+    std::vector<Triangle> triangles;
+    std::vector<Material> meshMaterials;
+    std::vector<Instance> instances;
+    std::vector<Plane> planes;
+
+    // bytes held at once while building the bvh and the buffer, 0 if the
+    // builder does not track it
+    size_t peakBuildBytes = 0;
+
+private:
+    void buildSpheres(const Scene& scene);
+    void buildTopLevel(const Scene& scene);
+    // aborts if the traversal stacks cannot hold the bvh
+    void checkTraversalDepth() const;
+
+    std::vector<int> m_geometryRoots;
+    bool m_hasSceneNodes = false;
+    size_t m_topLevelOffset = 0;
 };
 
-Scene createScene();
+// grid_size is the half extent of the grid of small spheres, which holds
+// up to (2 * grid_size)^2 of them. The spheres only depend on the seed, not
+// on the number of threads generating them.
+Scene createScene(int grid_size = 11, const SceneBuildOptions& options = {}, uint seed = 1);
+
+// adds the triangles of mesh scaled to the given height, with the center of
+// the bottom of its bounds at position
+void addMesh(Scene& scene, const TriangleMesh& mesh, const Material& material,
+             const glm::vec3& position, float height);
+
+// adds the triangles of mesh as a geometry to be instanced and returns its
+// index. It is scaled to a height of 1 with the center of the bottom of its
+// bounds at the origin.
+int addGeometry(Scene& scene, const TriangleMesh& mesh, const Material& material);
 
 #endif // SCENE_H
@@ -0,0 +1,253 @@
+#include "scene_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+constexpr char cache_magic[8] = { 'M', 'B', 'S', 'C', 'E', 'N', 'E', '\0' };
+
+// written as is, reads back differently on a machine of the other byte order
+constexpr std::uint32_t cache_byte_order = 0x01020304;
+
+// every section starts at a multiple of this, so records are aligned and no
+// two sections share a cache line
+constexpr std::uint64_t section_alignment = 64;
+
+enum section_id
+{
+    section_nodes,
+    section_spheres,
+    section_materials,
+    section_triangles,
+    section_mesh_materials,
+    section_instances,
+    section_planes,
+    num_sections
+};
+
+struct cache_section
+{
+    std::uint64_t offset;
+    std::uint64_t count;
+    // sizeof the record when written, a mismatch means the file is stale
+    std::uint32_t record_size;
+    std::uint32_t reserved;
+};
+
+struct cache_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t hash;
+    std::uint64_t file_size;
+    cache_section sections[num_sections];
+};
+
+constexpr std::uint32_t record_sizes[num_sections] = {
+    sizeof(Node), sizeof(Sphere), sizeof(Material), sizeof(Triangle), sizeof(Material), sizeof(Instance),
+    sizeof(Plane)
+};
+
+std::uint64_t align_up(std::uint64_t offset)
+{
+    return (offset + section_alignment - 1) / section_alignment * section_alignment;
+}
+
+bool valid_header(const cache_header& header, std::uint64_t hash, size_t file_size)
+{
+    if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) ||
+        header.version != SceneCacheVersion ||
+        header.byte_order != cache_byte_order ||
+        header.hash != hash ||
+        header.file_size != file_size) {
+        return false;
+    }
+    for (int i = 0; i < num_sections; ++i) {
+        const cache_section& section = header.sections[i];
+        if (section.record_size != record_sizes[i] ||
+            section.offset % section_alignment != 0 ||
+            section.offset > file_size ||
+            section.count > (file_size - section.offset) / section.record_size) {
+            return false;
+        }
+    }
+    // the materials run parallel to the spheres
+    return header.sections[section_materials].count == header.sections[section_spheres].count;
+}
+
+} // anonymous namespace
+
+SceneArrays sceneArrays(const SceneBuffer& buffer)
+{
+    SceneArrays arrays;
+    arrays.nodes = buffer.nodes.data();
+    arrays.numNodes = buffer.nodes.size();
+    arrays.spheres = buffer.objects.data();
+    arrays.materials = buffer.materials.data();
+    arrays.numSpheres = buffer.objects.size();
+    arrays.triangles = buffer.triangles.data();
+    arrays.numTriangles = buffer.triangles.size();
+    arrays.meshMaterials = buffer.meshMaterials.data();
+    arrays.numMeshMaterials = buffer.meshMaterials.size();
+    arrays.instances = buffer.instances.data();
+    arrays.numInstances = buffer.instances.size();
+    arrays.planes = buffer.planes.data();
+    arrays.numPlanes = buffer.planes.size();
+    return arrays;
+}
+
+void SceneHash::add(const void* data, size_t size)
+{
+    auto mix = [this](std::uint64_t word) {
+        m_hash = (m_hash ^ word) * 0x9E3779B97F4A7C15ull;
+        m_hash ^= m_hash >> 29;
+    };
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (; size >= 8; bytes += 8, size -= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes, 8);
+        mix(word);
+    }
+    // the length goes into the last word, so that inputs that only differ
+    // by trailing zeros do not collide
+    std::uint64_t tail = 0;
+    std::memcpy(&tail, bytes, size);
+    mix(tail ^ (std::uint64_t(size) << 56));
+}
+
+bool SceneHash::addFile(const std::string& path)
+{
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    std::vector<char> block(1 << 20);
+    std::uint64_t total = 0;
+    size_t size;
+    while ((size = std::fread(block.data(), 1, block.size(), file)) > 0) {
+        add(block.data(), size);
+        total += size;
+    }
+    bool ok = !std::ferror(file);
+    std::fclose(file);
+    add(total);
+    return ok;
+}
+
+SceneCache::~SceneCache()
+{
+    close();
+}
+
+void SceneCache::close()
+{
+    if (m_data) {
+        munmap(m_data, m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_arrays = SceneArrays();
+}
+
+bool SceneCache::open(const std::string& path, std::uint64_t hash)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(cache_header)) {
+        ::close(fd);
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps the file alive on its own
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    cache_header header;
+    std::memcpy(&header, data, sizeof(header));
+    if (!valid_header(header, hash, size)) {
+        munmap(data, size);
+        return false;
+    }
+    m_data = data;
+    m_size = size;
+
+    auto section = [&](int id) {
+        return static_cast<const char*>(data) + header.sections[id].offset;
+    };
+    m_arrays.nodes = reinterpret_cast<const Node*>(section(section_nodes));
+    m_arrays.numNodes = header.sections[section_nodes].count;
+    m_arrays.spheres = reinterpret_cast<const Sphere*>(section(section_spheres));
+    m_arrays.materials = reinterpret_cast<const Material*>(section(section_materials));
+    m_arrays.numSpheres = header.sections[section_spheres].count;
+    m_arrays.triangles = reinterpret_cast<const Triangle*>(section(section_triangles));
+    m_arrays.numTriangles = header.sections[section_triangles].count;
+    m_arrays.meshMaterials = reinterpret_cast<const Material*>(section(section_mesh_materials));
+    m_arrays.numMeshMaterials = header.sections[section_mesh_materials].count;
+    m_arrays.instances = reinterpret_cast<const Instance*>(section(section_instances));
+    m_arrays.numInstances = header.sections[section_instances].count;
+    m_arrays.planes = reinterpret_cast<const Plane*>(section(section_planes));
+    m_arrays.numPlanes = header.sections[section_planes].count;
+    return true;
+}
+
+bool writeSceneCache(const std::string& path, std::uint64_t hash, const SceneBuffer& buffer)
+{
+    const void* data[num_sections] = {
+        buffer.nodes.data(), buffer.objects.data(), buffer.materials.data(),
+        buffer.triangles.data(), buffer.meshMaterials.data(), buffer.instances.data(), buffer.planes.data()
+    };
+    size_t counts[num_sections] = {
+        buffer.nodes.size(), buffer.objects.size(), buffer.materials.size(),
+        buffer.triangles.size(), buffer.meshMaterials.size(), buffer.instances.size(), buffer.planes.size()
+    };
+
+    cache_header header = {};
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = SceneCacheVersion;
+    header.byte_order = cache_byte_order;
+    header.hash = hash;
+    std::uint64_t offset = sizeof(header);
+    for (int i = 0; i < num_sections; ++i) {
+        offset = align_up(offset);
+        header.sections[i].offset = offset;
+        header.sections[i].count = counts[i];
+        header.sections[i].record_size = record_sizes[i];
+        offset += counts[i] * record_sizes[i];
+    }
+    header.file_size = offset;
+
+    std::string tmpPath = path + ".tmp" + std::to_string(getpid());
+    FILE* file = std::fopen(tmpPath.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    std::uint64_t written = sizeof(header);
+    static const char padding[section_alignment] = {};
+    for (int i = 0; i < num_sections && ok; ++i) {
+        ok = std::fwrite(padding, 1, header.sections[i].offset - written, file) == header.sections[i].offset - written;
+        size_t bytes = counts[i] * record_sizes[i];
+        ok = ok && (bytes == 0 || std::fwrite(data[i], 1, bytes, file) == bytes);
+        written = header.sections[i].offset + bytes;
+    }
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
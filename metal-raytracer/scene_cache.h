@@ -0,0 +1,89 @@
+//
+//  scene_cache.h
+//  metal-raytracer
+//
+//  Binary file holding the flattened arrays of a SceneBuffer, mapped into
+//  memory and used in place so that rendering a scene again skips
+//  generating it and building its bvh.
+//
+
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "scene.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// bump whenever the file layout, the records or the way createScene and
+// the builders make a scene change, older files are rebuilt then
+constexpr std::uint32_t SceneCacheVersion = 3;
+
+// the arrays of a scene without owning them, taken from a SceneBuffer or
+// from a mapped cache file
+struct SceneArrays
+{
+    const Node* nodes = nullptr;
+    size_t numNodes = 0;
+    const Sphere* spheres = nullptr;
+    const Material* materials = nullptr;
+    size_t numSpheres = 0;
+    const Triangle* triangles = nullptr;
+    size_t numTriangles = 0;
+    const Material* meshMaterials = nullptr;
+    size_t numMeshMaterials = 0;
+    const Instance* instances = nullptr;
+    size_t numInstances = 0;
+    const Plane* planes = nullptr;
+    size_t numPlanes = 0;
+};
+
+SceneArrays sceneArrays(const SceneBuffer& buffer);
+
+// 64 bit hash of whatever a scene is made from, e.g. its generator
+// parameters and the bytes of the meshes it loads. Not cryptographic, it
+// only has to tell different inputs apart.
+class SceneHash
+{
+public:
+    void add(const void* data, size_t size);
+
+    template<typename T>
+    void add(const T& value) { add(&value, sizeof(value)); }
+
+    // hashes the contents of a file, false if it cannot be read
+    bool addFile(const std::string& path);
+
+    std::uint64_t value() const { return m_hash; }
+private:
+    std::uint64_t m_hash = 0x6A09E667F3BCC908ull;
+};
+
+// a cache file mapped read-only, its arrays stay valid as long as it lives
+class SceneCache
+{
+public:
+    SceneCache() = default;
+    SceneCache(const SceneCache&) = delete;
+    SceneCache& operator=(const SceneCache&) = delete;
+    ~SceneCache();
+
+    // maps the file if it exists and was written by this version for a
+    // scene of the same hash, false otherwise
+    bool open(const std::string& path, std::uint64_t hash);
+
+    const SceneArrays& arrays() const { return m_arrays; }
+private:
+    void close();
+
+    void* m_data = nullptr;
+    size_t m_size = 0;
+    SceneArrays m_arrays;
+};
+
+// writes the arrays of the buffer to path, through a temporary file that is
+// renamed over it so that concurrent readers never see half a file
+bool writeSceneCache(const std::string& path, std::uint64_t hash, const SceneBuffer& buffer);
+
+#endif /* SCENE_CACHE_H */
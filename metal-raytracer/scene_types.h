@@ -18,23 +18,60 @@ enum MaterialType : int
     Dielectric
 };
 
+// a leaf holds objects of one kind only, which it keeps in place of its
+// right child. The kinds are negative so that they never look like a node
+// index, and spheres are -1 so that the leaves of the sphere builders, which
+// have no right child either, need no extra tag.
+enum PrimitiveType : int
+{
+    PrimitiveSphere = -1,
+    PrimitiveTriangle = -2,
+    // the top level leaves hold exactly one instance
+    PrimitiveInstance = -3
+};
+
 struct Node
 {
     math::packed_float3 min;
     math::packed_float3 max;
     
-    int left; // left node index
-    int right; // right node index
+    int left; // left node index, -1 for leaves
+    int right; // right node index, the PrimitiveType of a leaf
     int firstObjIndex;
     int numObj;
 };
 
+// the most inner nodes on the way from the root of the bvh down to a leaf,
+// counting the ones of the bottom level bvh below an instance. The fixed
+// traversal stacks are sized for it and SceneBuffer refuses deeper trees.
+constant constexpr int MaxTraversalDepth = 64;
+
 struct Sphere
 {
     math::packed_float3 center;
     float radius;
 };
 
+struct Triangle
+{
+    math::packed_float3 v0;
+    math::packed_float3 v1;
+    math::packed_float3 v2;
+    // index into the materials of the meshes
+    int material;
+};
+
+// a placement of a bottom level bvh, whose nodes and primitives are shared
+// by all of its instances
+struct Instance
+{
+    // affine map from world to object space, p goes to
+    // toObject[0] * p.x + toObject[1] * p.y + toObject[2] * p.z + toObject[3]
+    math::packed_float3 toObject[4];
+    // root node of the bottom level bvh
+    int root;
+};
+
 struct Material
 {
     math::packed_float3 albedo;
@@ -42,4 +79,13 @@ struct Material
     float prop;
 };
 
+// an unbounded primitive, which no box can hold, so it stays out of the bvh
+// and every ray tests it first. The points p with dot(normal, p) == offset.
+struct Plane
+{
+    math::packed_float3 normal;
+    float offset;
+    Material material;
+};
+
 #endif /* SCENE_TYPES_H */
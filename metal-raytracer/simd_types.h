@@ -0,0 +1,276 @@
+//
+//  simd_types.h
+//  metal-raytracer
+//
+//  N-wide float and mask types for the CPU tracer. 4 lanes map to SSE and
+//  8 lanes to AVX when the compiler targets them, every other configuration
+//  falls back to plain loops over arrays.
+//
+
+#ifndef SIMD_TYPES_H
+#define SIMD_TYPES_H
+
+#if defined(__AVX__)
+#  include <immintrin.h>
+#  define TRACER_SIMD_AVX 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define TRACER_SIMD_SSE 1
+#endif
+
+#include <cmath>
+
+namespace tracer
+{
+
+#if TRACER_SIMD_AVX
+constexpr int SimdWidth = 8;
+#else
+constexpr int SimdWidth = 4;
+#endif
+
+template<int N>
+struct vmask
+{
+    bool lanes[N];
+
+    vmask() = default;
+    explicit vmask(bool b)
+    {
+        for (int i = 0; i < N; ++i) {
+            lanes[i] = b;
+        }
+    }
+
+    // bit i is set if lane i is
+    int bits() const
+    {
+        int res = 0;
+        for (int i = 0; i < N; ++i) {
+            res |= (int)lanes[i] << i;
+        }
+        return res;
+    }
+
+    friend vmask operator&(vmask a, vmask b) { return apply(a, b, [](bool x, bool y) { return x && y; }); }
+    friend vmask operator|(vmask a, vmask b) { return apply(a, b, [](bool x, bool y) { return x || y; }); }
+    // a & ~b
+    friend vmask andNot(vmask a, vmask b) { return apply(a, b, [](bool x, bool y) { return x && !y; }); }
+private:
+    template<typename F>
+    static vmask apply(vmask a, vmask b, F f)
+    {
+        for (int i = 0; i < N; ++i) {
+            a.lanes[i] = f(a.lanes[i], b.lanes[i]);
+        }
+        return a;
+    }
+};
+
+template<int N>
+struct vfloat
+{
+    float lanes[N];
+
+    vfloat() = default;
+    vfloat(float f)
+    {
+        for (int i = 0; i < N; ++i) {
+            lanes[i] = f;
+        }
+    }
+
+    static vfloat load(const float* p)
+    {
+        vfloat res;
+        for (int i = 0; i < N; ++i) {
+            res.lanes[i] = p[i];
+        }
+        return res;
+    }
+
+    void store(float* p) const
+    {
+        for (int i = 0; i < N; ++i) {
+            p[i] = lanes[i];
+        }
+    }
+
+    float operator[](int i) const { return lanes[i]; }
+
+    friend vfloat operator+(vfloat a, vfloat b) { return apply(a, b, [](float x, float y) { return x + y; }); }
+    friend vfloat operator-(vfloat a, vfloat b) { return apply(a, b, [](float x, float y) { return x - y; }); }
+    friend vfloat operator*(vfloat a, vfloat b) { return apply(a, b, [](float x, float y) { return x * y; }); }
+    friend vfloat operator/(vfloat a, vfloat b) { return apply(a, b, [](float x, float y) { return x / y; }); }
+    friend vfloat operator-(vfloat a) { return vfloat(0.0f) - a; }
+    // NaN lanes take the value of b as with minps/maxps
+    friend vfloat min(vfloat a, vfloat b) { return apply(a, b, [](float x, float y) { return x < y ? x : y; }); }
+    friend vfloat max(vfloat a, vfloat b) { return apply(a, b, [](float x, float y) { return x > y ? x : y; }); }
+    friend vfloat sqrt(vfloat a) { return apply(a, a, [](float x, float) { return std::sqrt(x); }); }
+
+    friend vmask<N> operator<(vfloat a, vfloat b) { return compare(a, b, [](float x, float y) { return x < y; }); }
+    friend vmask<N> operator<=(vfloat a, vfloat b) { return compare(a, b, [](float x, float y) { return x <= y; }); }
+    friend vmask<N> operator>(vfloat a, vfloat b) { return b < a; }
+    friend vmask<N> operator>=(vfloat a, vfloat b) { return b <= a; }
+
+    // m ? a : b per lane
+    friend vfloat select(vmask<N> m, vfloat a, vfloat b)
+    {
+        for (int i = 0; i < N; ++i) {
+            b.lanes[i] = m.lanes[i] ? a.lanes[i] : b.lanes[i];
+        }
+        return b;
+    }
+private:
+    template<typename F>
+    static vfloat apply(vfloat a, vfloat b, F f)
+    {
+        for (int i = 0; i < N; ++i) {
+            a.lanes[i] = f(a.lanes[i], b.lanes[i]);
+        }
+        return a;
+    }
+
+    template<typename F>
+    static vmask<N> compare(vfloat a, vfloat b, F f)
+    {
+        vmask<N> res;
+        for (int i = 0; i < N; ++i) {
+            res.lanes[i] = f(a.lanes[i], b.lanes[i]);
+        }
+        return res;
+    }
+};
+
+#if TRACER_SIMD_SSE
+template<>
+struct vmask<4>
+{
+    __m128 v;
+
+    vmask() = default;
+    vmask(__m128 v) : v(v) {}
+    explicit vmask(bool b) : v(_mm_castsi128_ps(_mm_set1_epi32(b ? -1 : 0))) {}
+
+    int bits() const { return _mm_movemask_ps(v); }
+
+    friend vmask operator&(vmask a, vmask b) { return _mm_and_ps(a.v, b.v); }
+    friend vmask operator|(vmask a, vmask b) { return _mm_or_ps(a.v, b.v); }
+    friend vmask andNot(vmask a, vmask b) { return _mm_andnot_ps(b.v, a.v); }
+};
+
+template<>
+struct vfloat<4>
+{
+    __m128 v;
+
+    vfloat() = default;
+    vfloat(__m128 v) : v(v) {}
+    vfloat(float f) : v(_mm_set1_ps(f)) {}
+
+    static vfloat load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    float operator[](int i) const
+    {
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, v);
+        return lanes[i];
+    }
+
+    friend vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+    friend vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+    friend vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+    friend vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+    friend vfloat operator-(vfloat a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+    friend vfloat min(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+    friend vfloat max(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+    friend vfloat sqrt(vfloat a) { return _mm_sqrt_ps(a.v); }
+
+    friend vmask<4> operator<(vfloat a, vfloat b) { return _mm_cmplt_ps(a.v, b.v); }
+    friend vmask<4> operator<=(vfloat a, vfloat b) { return _mm_cmple_ps(a.v, b.v); }
+    friend vmask<4> operator>(vfloat a, vfloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+    friend vmask<4> operator>=(vfloat a, vfloat b) { return _mm_cmpge_ps(a.v, b.v); }
+
+    friend vfloat select(vmask<4> m, vfloat a, vfloat b)
+    {
+        return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v));
+    }
+};
+#endif
+
+#if TRACER_SIMD_AVX
+template<>
+struct vmask<8>
+{
+    __m256 v;
+
+    vmask() = default;
+    vmask(__m256 v) : v(v) {}
+    explicit vmask(bool b) : v(_mm256_castsi256_ps(_mm256_set1_epi32(b ? -1 : 0))) {}
+
+    int bits() const { return _mm256_movemask_ps(v); }
+
+    friend vmask operator&(vmask a, vmask b) { return _mm256_and_ps(a.v, b.v); }
+    friend vmask operator|(vmask a, vmask b) { return _mm256_or_ps(a.v, b.v); }
+    friend vmask andNot(vmask a, vmask b) { return _mm256_andnot_ps(b.v, a.v); }
+};
+
+template<>
+struct vfloat<8>
+{
+    __m256 v;
+
+    vfloat() = default;
+    vfloat(__m256 v) : v(v) {}
+    vfloat(float f) : v(_mm256_set1_ps(f)) {}
+
+    static vfloat load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+    float operator[](int i) const
+    {
+        alignas(32) float lanes[8];
+        _mm256_store_ps(lanes, v);
+        return lanes[i];
+    }
+
+    friend vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+    friend vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+    friend vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+    friend vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+    friend vfloat operator-(vfloat a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+    friend vfloat min(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+    friend vfloat max(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+    friend vfloat sqrt(vfloat a) { return _mm256_sqrt_ps(a.v); }
+
+    friend vmask<8> operator<(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    friend vmask<8> operator<=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+    friend vmask<8> operator>(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+    friend vmask<8> operator>=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+
+    friend vfloat select(vmask<8> m, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+};
+#endif
+
+template<int N>
+inline bool any(vmask<N> m) { return m.bits() != 0; }
+
+template<int N>
+inline bool none(vmask<N> m) { return m.bits() == 0; }
+
+// mask with the first n lanes set
+template<int N>
+inline vmask<N> firstLanes(int n)
+{
+    alignas(32) float lanes[N];
+    for (int i = 0; i < N; ++i) {
+        lanes[i] = (float)i;
+    }
+    return vfloat<N>::load(lanes) < vfloat<N>((float)n);
+}
+
+}
+
+#endif /* SIMD_TYPES_H */
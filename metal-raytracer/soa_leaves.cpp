@@ -0,0 +1,44 @@
+#include "soa_leaves.h"
+
+#include <limits>
+
+namespace tracer
+{
+
+template<int N>
+std::vector<SphereBlock<N>> packSphereBlocks(const Scene& scene, std::vector<Node>& nodes)
+{
+    std::vector<SphereBlock<N>> blocks;
+    for (Node& node : nodes) {
+        if (node.left != -1) {
+            continue;
+        }
+        int firstBlock = (int)blocks.size();
+        for (int first = 0; first < node.numObj; first += N) {
+            SphereBlock<N> block;
+            block.firstSphere = node.firstObjIndex + first;
+            for (int lane = 0; lane < N; ++lane) {
+                if (first + lane < node.numObj) {
+                    const Sphere& sphere = scene.getSphere(block.firstSphere + lane);
+                    for (int axis = 0; axis < 3; ++axis) {
+                        block.center[axis][lane] = sphere.center[axis];
+                    }
+                    block.radius[lane] = sphere.radius;
+                } else {
+                    for (int axis = 0; axis < 3; ++axis) {
+                        block.center[axis][lane] = std::numeric_limits<float>::quiet_NaN();
+                    }
+                    block.radius[lane] = 0.0f;
+                }
+            }
+            blocks.push_back(block);
+        }
+        node.firstObjIndex = firstBlock;
+    }
+    return blocks;
+}
+
+template std::vector<SphereBlock<4>> packSphereBlocks<4>(const Scene&, std::vector<Node>&);
+template std::vector<SphereBlock<8>> packSphereBlocks<8>(const Scene&, std::vector<Node>&);
+
+}
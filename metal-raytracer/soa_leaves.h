@@ -0,0 +1,150 @@
+//
+//  soa_leaves.h
+//  metal-raytracer
+//
+//  Leaves of the binary bvh for the CPU tracer whose spheres are packed
+//  into blocks of N, stored as structure of arrays, so that a ray is tested
+//  against all spheres of a block at once. Trees built with
+//  sah_params::leaf_width set to N keep up to N spheres in a leaf for the
+//  cost of one test, which makes them shallower.
+//
+
+#ifndef SOA_LEAVES_H
+#define SOA_LEAVES_H
+
+#include "bvh_layout.h"
+#include "simd_types.h"
+#include "tracer.h"
+
+#include <vector>
+
+namespace tracer
+{
+
+template<int N>
+struct alignas(32) SphereBlock
+{
+    // the lanes past the spheres of the leaf have NaN centers, which no ray
+    // ever hits
+    float center[3][N];
+    float radius[N];
+    // scene index of the sphere in the first lane, the others follow it
+    int firstSphere;
+};
+
+// packs the spheres of every leaf of the nodes, a copy of the ones of a
+// sphere scene, into blocks. The leaves keep their number of spheres and
+// refer to their first block instead.
+template<int N>
+std::vector<SphereBlock<N>> packSphereBlocks(const Scene& scene, std::vector<Node>& nodes);
+
+// the closest sphere of the block in [tmin, tmax) or -1, tmax receives its
+// distance. Every lane does the arithmetic of intersectSphere and ties go to
+// the first lane, so the result is the one of testing the spheres in turn.
+template<int N>
+inline int intersectBlock(const SphereBlock<N>& block, Ray ray, float tmin, float& tmax)
+{
+    vfloat<N> oc[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        oc[axis] = vfloat<N>(ray.origin[axis]) - vfloat<N>::load(block.center[axis]);
+    }
+    vfloat<N> dir[3] = { ray.dir.x, ray.dir.y, ray.dir.z };
+    vfloat<N> a(math::dot(ray.dir, ray.dir));
+    vfloat<N> b = oc[0] * dir[0] + oc[1] * dir[1] + oc[2] * dir[2];
+    vfloat<N> radius = vfloat<N>::load(block.radius);
+    vfloat<N> c = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2] - radius * radius;
+    vfloat<N> discriminant = b * b - a * c;
+    vmask<N> active = discriminant >= vfloat<N>(0.0f);
+    if (none(active)) {
+        return -1;
+    }
+
+    vfloat<N> sqrtDisr = sqrt(max(discriminant, vfloat<N>(0.0f)));
+    vfloat<N> tNear = (-b - sqrtDisr) / a;
+    vfloat<N> tFar = (-b + sqrtDisr) / a;
+    vfloat<N> tminLanes(tmin);
+    vfloat<N> tmaxLanes(tmax);
+    vmask<N> nearHit = active & (tminLanes <= tNear) & (tNear < tmaxLanes);
+    vmask<N> farHit = andNot(active, nearHit) & (tminLanes <= tFar) & (tFar < tmaxLanes);
+    int bits = (nearHit | farHit).bits();
+    if (!bits) {
+        return -1;
+    }
+
+    alignas(32) float t[N];
+    select(nearHit, tNear, tFar).store(t);
+    int lane = -1;
+    for (; bits; bits &= bits - 1) {
+        int i = __builtin_ctz(bits);
+        if (t[i] < tmax) {
+            tmax = t[i];
+            lane = i;
+        }
+    }
+    return block.firstSphere + lane;
+}
+
+// tests the spheres of a leaf a block at a time, first is the first block
+template<int N>
+struct SphereBlockLeaves
+{
+    const SphereBlock<N>* blocks;
+
+    template<typename Probe>
+    TRAVERSAL_INLINE void operator()(int first, int count, Ray ray, float tmin, float& tmax, int& primIndex,
+                                     Probe& probe) const
+    {
+        int numBlocks = (count + N - 1) / N;
+        for (int j = 0; j < numBlocks; ++j) {
+            const SphereBlock<N>& block = blocks[first + j];
+            probe(&block, sizeof(SphereBlock<N>));
+            int index = intersectBlock(block, ray, tmin, tmax);
+            if (index != -1) {
+                primIndex = index;
+            }
+        }
+    }
+};
+
+// traverses the nodes like Scene::closestHit and tests the leaves a block
+// at a time
+template<int N>
+class SoaLeafScene
+{
+public:
+    // scene provides the spheres and materials the blocks were packed from
+    SoaLeafScene(const Scene& scene, const Node* nodes, const SphereBlock<N>* blocks)
+        : m_scene(scene)
+        , m_tree(scene, nodes)
+        , m_leaves{ blocks }
+    {}
+
+    template<bool bruteForce>
+    bool hit(Ray ray, float tmin, float tmax, HitRecord& rec) const
+    {
+        if (bruteForce) {
+            return m_scene.hit<true>(ray, tmin, tmax, rec);
+        }
+        int primIndex = closestHit(ray, tmin, tmax);
+        if (primIndex != -1) {
+            rec = m_scene.getHitRecord(ray, tmax, primIndex);
+            return true;
+        }
+        return false;
+    }
+
+    // probe(address, size) is called for every node and block read
+    template<typename Probe = NoProbe>
+    int closestHit(Ray ray, float tmin, float& tmax, Probe&& probe = {}) const
+    {
+        return closestHitOrdered(m_scene, m_tree, m_leaves, ray, tmin, tmax, probe);
+    }
+private:
+    Scene m_scene;
+    BinaryTree<Node> m_tree;
+    SphereBlockLeaves<N> m_leaves;
+};
+
+}
+
+#endif /* SOA_LEAVES_H */
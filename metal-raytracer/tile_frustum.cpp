@@ -0,0 +1,113 @@
+#include "tile_frustum.h"
+
+#include <algorithm>
+
+namespace tracer
+{
+
+TileFrustum makeTileFrustum(const Camera& camera, math::float2 lo, math::float2 hi)
+{
+    // a sixteenth of a pixel is far more than the rounding of getRayDir
+    constexpr float Margin = 1.0f / 16.0f;
+    lo -= Margin;
+    hi += Margin;
+    math::float3 corners[4] = {
+        camera.getRayDir(lo),
+        camera.getRayDir(math::float2(hi.x, lo.y)),
+        camera.getRayDir(hi),
+        camera.getRayDir(math::float2(lo.x, hi.y)),
+    };
+    math::float3 center = camera.getRayDir((lo + hi) * 0.5f);
+
+    TileFrustum frustum;
+    frustum.origin = camera.getRay(lo).origin;
+    for (int i = 0; i < 4; ++i) {
+        // the screen y axis points down, so which way the corners wind
+        // depends on the camera, the center ray tells the inside
+        math::float3 normal = math::cross(corners[i], corners[(i + 1) % 4]);
+        frustum.normals[i] = math::dot(normal, center) < 0 ? -normal : normal;
+    }
+    return frustum;
+}
+
+bool overlaps(const TileFrustum& frustum, math::float3 boxMin, math::float3 boxMax)
+{
+    for (const math::float3& normal : frustum.normals) {
+        // the corner of the box furthest along the normal
+        math::float3 corner(normal.x >= 0 ? boxMax.x : boxMin.x,
+                            normal.y >= 0 ? boxMax.y : boxMin.y,
+                            normal.z >= 0 ? boxMax.z : boxMin.z);
+        if (math::dot(normal, corner - frustum.origin) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+FrustumLeaves::FrustumLeaves(const Scene& scene)
+    : m_scene(scene)
+{}
+
+int FrustumLeaves::build(const TileFrustum& frustum)
+{
+    m_sorted.clear();
+    m_stack.assign(1, 0);
+    int numTested = 0;
+    while (!m_stack.empty()) {
+        int index = m_stack.back();
+        m_stack.pop_back();
+        const Node& node = m_scene.getNode(index);
+        ++numTested;
+        if (!overlaps(frustum, node.min, node.max)) {
+            continue;
+        }
+        if (node.left != -1) {
+            m_stack.push_back(node.right);
+            m_stack.push_back(node.left);
+            continue;
+        }
+        // the distance to the nearest point of the box, shortened a little
+        // so that a hit on its surface is never beyond it after rounding
+        math::float3 d = frustum.origin - math::min(math::max(frustum.origin, math::float3(node.min)),
+                                                    math::float3(node.max));
+        m_sorted.emplace_back(math::sqrt(math::dot(d, d)) * 0.9999f, index);
+    }
+
+    // stable, so that leaves at the same distance keep the order in which
+    // Scene::closestHit would meet them
+    std::stable_sort(m_sorted.begin(), m_sorted.end(),
+                     [](const std::pair<float, int>& a, const std::pair<float, int>& b) { return a.first < b.first; });
+    m_leaves.clear();
+    m_nearDists.clear();
+    for (const auto& [dist, index] : m_sorted) {
+        m_nearDists.push_back(dist);
+        m_leaves.push_back(index);
+    }
+    return numTested;
+}
+
+int FrustumLeaves::closestHit(Ray ray, float tmin, float& tmax) const
+{
+    math::float3 invDir = 1.0f / ray.dir;
+    int primIndex = m_scene.closestPlane(ray, tmin, tmax);
+    for (size_t i = 0; i < m_leaves.size(); ++i) {
+        // the rest of the leaves all start behind the closest hit
+        if (m_nearDists[i] >= tmax) {
+            break;
+        }
+        const Node& node = m_scene.getNode(m_leaves[i]);
+        if (intersect(ray.origin, invDir, { node.min, node.max }, tmin, tmax) == -1) {
+            continue;
+        }
+        for (int j = 0; j < node.numObj; ++j) {
+            float t = intersectSphere(m_scene.getSphere(node.firstObjIndex + j), ray, tmin, tmax);
+            if (t != -1 && t < tmax) {
+                tmax = t;
+                primIndex = node.firstObjIndex + j;
+            }
+        }
+    }
+    return primIndex;
+}
+
+}
@@ -0,0 +1,68 @@
+//
+//  tile_frustum.h
+//  metal-raytracer
+//
+//  Primary rays of a tile of pixels all start at the camera and stay within
+//  the frustum through the corners of the tile. The bvh is culled against
+//  that frustum once per tile, and the primary rays of every sample only
+//  test the leaves that are left, nearest first.
+//
+
+#ifndef TILE_FRUSTUM_H
+#define TILE_FRUSTUM_H
+
+#include "tracer.h"
+
+#include <utility>
+#include <vector>
+
+namespace tracer
+{
+
+struct TileFrustum
+{
+    math::float3 origin;
+    // the four side planes go through origin, their normals point inwards
+    math::float3 normals[4];
+};
+
+// the frustum of the camera rays through the sample positions in [lo, hi],
+// widened a little so that rounding does not cull leaves its rays hit
+TileFrustum makeTileFrustum(const Camera& camera, math::float2 lo, math::float2 hi);
+
+// whether the box may overlap the frustum, boxes next to its edges may pass
+bool overlaps(const TileFrustum& frustum, math::float3 boxMin, math::float3 boxMax);
+
+// the leaves of the bvh of a sphere scene that a tile frustum overlaps,
+// sorted by their distance from the camera. They are collected once per
+// tile and reused for all of its samples, the camera does not move in
+// between.
+class FrustumLeaves
+{
+public:
+    explicit FrustumLeaves(const Scene& scene);
+
+    // returns the number of nodes tested against the frustum
+    int build(const TileFrustum& frustum);
+
+    int size() const { return (int)m_leaves.size(); }
+    const int* leaves() const { return m_leaves.data(); }
+    // per leaf a lower bound of the distance at which a ray from the origin
+    // of the frustum enters it
+    const float* nearDists() const { return m_nearDists.data(); }
+
+    // the same as Scene::closestHit for rays from the origin of the frustum
+    // within it and with normalized directions, which primary rays have
+    int closestHit(Ray ray, float tmin, float& tmax) const;
+
+private:
+    const Scene& m_scene;
+    std::vector<int> m_leaves;
+    std::vector<float> m_nearDists;
+    std::vector<int> m_stack;
+    std::vector<std::pair<float, int>> m_sorted;
+};
+
+}
+
+#endif /* TILE_FRUSTUM_H */
@@ -0,0 +1,169 @@
+#include "tile_scheduler.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+
+// padded so that the locks of different workers never share a cache line
+struct alignas(64) WorkerQueue
+{
+    mutex lock;
+    deque<int> tiles;
+};
+
+} // anonymous namespace
+
+struct TileScheduler::Impl
+{
+    vector<thread> threads;
+    vector<unique_ptr<WorkerQueue>> queues;
+    vector<Tile> tiles;
+    const Task* task = nullptr;
+
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    uint64_t generation = 0;
+    int numBusy = 0;
+    bool quit = false;
+
+    bool pop(int worker, int& tile)
+    {
+        auto& queue = *queues[worker];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tiles.empty()) {
+            return false;
+        }
+        tile = queue.tiles.front();
+        queue.tiles.pop_front();
+        return true;
+    }
+
+    bool steal(int worker, int& tile)
+    {
+        int n = (int)queues.size();
+        for (int i = 1; i < n; ++i) {
+            auto& queue = *queues[(worker + i) % n];
+            lock_guard<mutex> guard(queue.lock);
+            if (!queue.tiles.empty()) {
+                tile = queue.tiles.back();
+                queue.tiles.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // no tiles are added while a run is in flight, so a worker which finds
+    // every queue empty is done
+    void process(int worker, const atomic<bool>& cancelled)
+    {
+        int tile;
+        while (!cancelled && (pop(worker, tile) || steal(worker, tile))) {
+            (*task)(tiles[tile], worker);
+        }
+    }
+};
+
+TileScheduler::TileScheduler(int numWorkers)
+    : m_numWorkers(numWorkers > 0 ? numWorkers : utils::hardwareThreads())
+    , m_cancelled(false)
+    , m_impl(make_unique<Impl>())
+{
+    for (int i = 0; i < m_numWorkers; ++i) {
+        m_impl->queues.push_back(make_unique<WorkerQueue>());
+    }
+
+    // worker 0 is the thread calling run()
+    for (int i = 1; i < m_numWorkers; ++i) {
+        m_impl->threads.emplace_back([this, i] {
+            auto& impl = *m_impl;
+            uint64_t seen = 0;
+            for (;;) {
+                {
+                    unique_lock<mutex> guard(impl.lock);
+                    impl.wake.wait(guard, [&] { return impl.quit || impl.generation != seen; });
+                    if (impl.quit) {
+                        return;
+                    }
+                    seen = impl.generation;
+                }
+                impl.process(i, m_cancelled);
+                {
+                    lock_guard<mutex> guard(impl.lock);
+                    if (--impl.numBusy == 0) {
+                        impl.done.notify_one();
+                    }
+                }
+            }
+        });
+    }
+}
+
+TileScheduler::~TileScheduler()
+{
+    {
+        lock_guard<mutex> guard(m_impl->lock);
+        m_impl->quit = true;
+    }
+    m_impl->wake.notify_all();
+    for (auto& t : m_impl->threads) {
+        t.join();
+    }
+}
+
+bool TileScheduler::run(int width, int height, int tileSize, const Task& task)
+{
+    assert(tileSize > 0);
+    auto& impl = *m_impl;
+
+    impl.tiles.clear();
+    for (int y = 0; y < height; y += tileSize) {
+        for (int x = 0; x < width; x += tileSize) {
+            impl.tiles.push_back({ x, y, min(tileSize, width - x), min(tileSize, height - y) });
+        }
+    }
+
+    // hand every worker a contiguous block of tiles
+    int numTiles = (int)impl.tiles.size();
+    for (int i = 0; i < m_numWorkers; ++i) {
+        auto& queue = impl.queues[i]->tiles;
+        assert(queue.empty());
+        for (int j = numTiles * i / m_numWorkers; j < numTiles * (i + 1) / m_numWorkers; ++j) {
+            queue.push_back(j);
+        }
+    }
+
+    impl.task = &task;
+    {
+        lock_guard<mutex> guard(impl.lock);
+        ++impl.generation;
+        impl.numBusy = m_numWorkers - 1;
+    }
+    impl.wake.notify_all();
+
+    impl.process(0, m_cancelled);
+
+    {
+        unique_lock<mutex> guard(impl.lock);
+        impl.done.wait(guard, [&] { return impl.numBusy == 0; });
+    }
+    impl.task = nullptr;
+
+    // drop whatever a cancellation left behind
+    for (auto& queue : impl.queues) {
+        queue->tiles.clear();
+    }
+    return !m_cancelled;
+}
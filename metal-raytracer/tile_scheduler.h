@@ -0,0 +1,62 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// Splits an image into square tiles and processes them on a fixed set of
+// worker threads. Each worker owns a deque seeded with a contiguous block of
+// tiles, pops from its front and steals from the back of the others once it
+// runs dry, so neighbouring tiles stay on the same core and writes from
+// different workers rarely share a cache line.
+class TileScheduler
+{
+public:
+    struct Tile
+    {
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    // called for every tile with the index of the worker running it
+    using Task = std::function<void(const Tile& tile, int workerIndex)>;
+
+    // numWorkers includes the thread calling run(), 0 for one per hardware thread
+    explicit TileScheduler(int numWorkers = 0);
+    ~TileScheduler();
+
+    TileScheduler(const TileScheduler&) = delete;
+    TileScheduler& operator=(const TileScheduler&) = delete;
+
+    // processes all tiles of a width x height image and blocks until they are
+    // done, returns false if the run was cancelled
+    //
+    // only one run may be in flight at a time, a cancelled scheduler skips
+    // every run until resetCancel()
+    bool run(int width, int height, int tileSize, const Task& task);
+
+    // cooperative cancellation of the current run: tiles in progress finish,
+    // the remaining ones are dropped. Long tasks may poll isCancelled().
+    // Safe to call from any thread.
+    void cancel() { m_cancelled = true; }
+    // clears the cancellation of an earlier run. run() leaves it as it is,
+    // so call this when the next run is scheduled: a cancel() issued
+    // between scheduling and the start of run() then cancels that run.
+    void resetCancel() { m_cancelled = false; }
+    bool isCancelled() const { return m_cancelled; }
+
+    int numWorkers() const { return m_numWorkers; }
+private:
+    struct Impl;
+
+    int m_numWorkers;
+    std::atomic<bool> m_cancelled;
+    std::unique_ptr<Impl> m_impl;
+};
+
+#endif // TILE_SCHEDULER_H
@@ -29,12 +29,9 @@ math::float2 Random::inUnitRect()
 
 math::float3 Random::inUnitSphere()
 {
-    math::float3 res;
-    do {
-        res = math::float3(next(), next(), next());
-        res = res * 2.0f - 1.0f;
-    } while (math::dot(res, res) >= 1.0f);
-    return res;
+    float u0 = next();
+    float u1 = next();
+    return sampleUnitBall(u0, u1, next());
 }
 
 bool intersect(Ray r, AABB volume, float tmin, float tmax)
@@ -50,29 +47,7 @@ bool intersect(Ray r, AABB volume, float tmin, float tmax)
         tmin = math::max(tmin, t0);
         tmax = math::min(tmax, t1);
     }
-    return tmin < tmax;
-}
-
-float intersectSphere(Sphere sphere, Ray ray, float tmin, float tmax)
-{
-    math::float3 oc = ray.origin - sphere.center;
-    float a = math::dot(ray.dir, ray.dir);
-    float b = math::dot(oc, ray.dir);
-    float c = math::dot(oc, oc) - sphere.radius * sphere.radius;
-    float discriminant = b*b - a*c;
-    if (discriminant < 0) {
-        return -1;
-    }
-    float sqrtDisr = math::sqrt(discriminant);
-    float t = (-b - sqrtDisr) / a;
-    if (tmin <= t && t <= tmax) {
-        return t;
-    }
-    t = (-b + sqrtDisr) / a;
-    if (tmin <= t && t <= tmax) {
-        return t;
-    }
-    return -1;
+    return tmin <= tmax;
 }
 
 Camera::Camera(math::float3 pos, math::float3 lookAt, math::float3 up,
@@ -109,11 +84,127 @@ Scene::Scene(constant Node* nodes, constant Sphere* spheres, constant Material*
     , m_spheres(spheres)
     , m_materials(materials)
     , m_numSpheres(numSpheres)
+    , m_triangles(nullptr)
+    , m_meshMaterials(nullptr)
+    , m_numTriangles(0)
+    , m_instances(nullptr)
+    , m_planes(nullptr)
+    , m_numPlanes(0)
 { }
 
+int Scene::closestHit(Ray ray, float tmin, thread float& tmax) const
+{
+    int instance;
+    return closestHit(ray, tmin, tmax, instance);
+}
+
+int Scene::closestHit(Ray worldRay, float tmin, thread float& tmax, thread int& hitInstance) const
+{
+    // every inner node on the way down pushes at most its far child
+    constexpr int MaxStackSize = MaxTraversalDepth;
+    // pending far children with the distance at which the ray enters them
+    int stack[MaxStackSize];
+    float stackDist[MaxStackSize];
+    int i = 0;
+
+    Ray ray = worldRay;
+    math::float3 invDir = 1.0f / ray.dir;
+    TriangleRay triRay = makeTriangleRay(ray);
+    int primIndex = closestPlane(ray, tmin, tmax);
+    hitInstance = -1;
+    // the instance whose bottom level bvh is traversed and the size of the
+    // stack when it was entered, the entries below belong to the top level
+    int instance = -1;
+    int instanceDepth = -1;
+    int nodeIndex = 0;
+    if (intersect(ray.origin, invDir, { m_nodes[0].min, m_nodes[0].max }, tmin, tmax) == -1) {
+        return primIndex;
+    }
+
+    for (;;) {
+        constant Node& node = m_nodes[nodeIndex];
+        if (node.left == -1) {
+            // shrink tmax as soon as a primitive is hit so that the
+            // remaining subtrees behind it are culled
+            if (node.right == PrimitiveInstance) {
+                // go on in the bottom level bvh with the ray in object space
+                instance = node.firstObjIndex;
+                instanceDepth = i;
+                ray = transformRay(m_instances[instance], worldRay);
+                invDir = 1.0f / ray.dir;
+                triRay = makeTriangleRay(ray);
+                nodeIndex = m_instances[instance].root;
+                constant Node& root = m_nodes[nodeIndex];
+                if (intersect(ray.origin, invDir, { root.min, root.max }, tmin, tmax) != -1) {
+                    continue;
+                }
+            } else if (node.right == PrimitiveTriangle) {
+                for (int j = 0; j < node.numObj; ++j) {
+                    float t = intersectTriangle(getTriangle(node.firstObjIndex + j), triRay, tmin, tmax);
+                    if (t != -1 && t < tmax) {
+                        tmax = t;
+                        primIndex = m_numSpheres + node.firstObjIndex + j;
+                        hitInstance = instance;
+                    }
+                }
+            } else {
+                for (int j = 0; j < node.numObj; ++j) {
+                    float t = intersectSphere(getSphere(node.firstObjIndex + j), ray, tmin, tmax);
+                    if (t != -1 && t < tmax) {
+                        tmax = t;
+                        primIndex = node.firstObjIndex + j;
+                        hitInstance = instance;
+                    }
+                }
+            }
+        } else {
+            constant Node& left = m_nodes[node.left];
+            constant Node& right = m_nodes[node.right];
+            float leftDist = intersect(ray.origin, invDir, { left.min, left.max }, tmin, tmax);
+            float rightDist = intersect(ray.origin, invDir, { right.min, right.max }, tmin, tmax);
+            if (leftDist != -1 && rightDist != -1) {
+                // visit the nearer child first
+                bool leftFirst = leftDist <= rightDist;
+                MB_ASSERT(i < MaxStackSize);
+                stack[i] = leftFirst ? node.right : node.left;
+                stackDist[i] = leftFirst ? rightDist : leftDist;
+                ++i;
+                nodeIndex = leftFirst ? node.left : node.right;
+                continue;
+            }
+            if (leftDist != -1) {
+                nodeIndex = node.left;
+                continue;
+            }
+            if (rightDist != -1) {
+                nodeIndex = node.right;
+                continue;
+            }
+        }
+
+        // pop the next subtree which still starts before the closest hit
+        do {
+            if (i == instanceDepth) {
+                // the bottom level bvh is done, back to the top level
+                ray = worldRay;
+                invDir = 1.0f / ray.dir;
+                triRay = makeTriangleRay(ray);
+                instance = -1;
+                instanceDepth = -1;
+            }
+            if (i == 0) {
+                return primIndex;
+            }
+            --i;
+        } while (stackDist[i] >= tmax);
+        nodeIndex = stack[i];
+    }
+}
+
 int Scene::findPossibleHits(Ray ray, float tmin, float tmax, thread int hitNodes[MaxHits]) const
 {
-    constexpr int MaxStackSize = 64;
+    // the children replace their parent, one more entry than levels
+    constexpr int MaxStackSize = MaxTraversalDepth + 1;
     int num = 0;
     int stack[MaxStackSize];
     stack[0] = 0;
@@ -125,7 +216,9 @@ int Scene::findPossibleHits(Ray ray, float tmin, float tmax, thread int hitNodes
         if (intersect(ray, { node.min, node.max }, tmin, tmax)) {
             // leaf node
             if (node.left == -1) {
-                MB_ASSERT(num < MaxHits);
+                if (num == MaxHits) {
+                    break;
+                }
                 hitNodes[num++] = stack[i];
             } else {
                 MB_ASSERT(i + 1 < MaxStackSize);
@@ -137,70 +230,4 @@ int Scene::findPossibleHits(Ray ray, float tmin, float tmax, thread int hitNodes
     return num;
 }
 
-RayTracer::RayTracer(thread Random& random, thread const Camera& camera, thread const Scene& scene, math::float3 bgColor)
-    : m_random(random)
-    , m_camera(camera)
-    , m_scene(scene)
-    , m_bgColor(bgColor)
-{}
-
-bool RayTracer::diffuseScatter(math::float3 rayDir, thread const HitRecord& rec,
-                               thread math::float3& attenuation, thread math::float3& scattered) const
-{
-    scattered = math::normalize(rec.normal + m_random.inUnitSphere());
-    attenuation = rec.material.albedo;
-    return true;
-}
-
-bool RayTracer::metalScatter(math::float3 rayDir, thread const HitRecord& rec,
-                             thread math::float3& attenuation, thread math::float3& scattered) const
-{
-    scattered = rec.material.prop * m_random.inUnitSphere() + math::reflect(rayDir, rec.normal);
-    scattered = math::normalize(scattered);
-    attenuation = rec.material.albedo;
-    return math::dot(rec.normal, scattered) > 0;
-}
-
-bool RayTracer::dielectricScatter(math::float3 rayDir, thread const HitRecord& rec,
-                                  thread math::float3& attenuation, thread math::float3& scattered) const
-{
-    math::float3 uin = math::normalize(rayDir);
-    attenuation = math::float3(1);
-    
-    float index = rec.material.prop;
-    float ni_over_nt;
-    float cosine = math::dot(uin, rec.normal);
-    math::float3 normal;
-    if (cosine > 0) {
-        ni_over_nt = index;
-        normal = -rec.normal;
-    } else {
-        ni_over_nt = 1.0f / index;
-        normal = rec.normal;
-    }
-    
-    float reflect_prob;
-    math::float3 refracted = math::refract(uin, normal, ni_over_nt);
-    // if > 0, then we assume that light travels from denser material to air
-    if (cosine > 0) {
-        cosine = math::sqrt(1.0f - index * index * (1.0f - cosine * cosine));
-    } else {
-        cosine = -cosine;
-    }
-    reflect_prob = schlick(cosine, index);
-    
-    if (m_random.next() < reflect_prob) {
-        scattered = math::reflect(uin, normal);
-    } else {
-        scattered = refracted;
-    }
-    return true;
-}
-
-math::float3 RayTracer::getBackgroundColor(math::float3 dir) const
-{
-    float t = (dir.y + 1.0) * 0.5;
-    return math::mix(math::float3(1), m_bgColor, t);
-}
-
 }
@@ -10,6 +10,7 @@
 #define TRACER_H
 
 #include "metal_bridge.h"
+#include "sampler.h"
 #include "scene_types.h"
 
 namespace tracer
@@ -28,10 +29,13 @@ struct HitRecord
     Material material;
 };
 
+// a single stream of numbers per pixel, every sample continues where the
+// previous one stopped
 class Random
 {
 public:
     Random(uint seed);
+    void startSample(math::uint2, uint) {}
     float next();
     math::float2 inUnitRect();
     math::float3 inUnitSphere();
@@ -46,7 +50,172 @@ struct Ray
 };
 
 bool intersect(Ray r, AABB volume, float tmin, float tmax);
-float intersectSphere(Sphere sphere, Ray ray, float tmin, float tmax);
+
+// the two tests below run for every node and sphere a ray visits, they are
+// defined here so that the traversals of the CPU-only structures inline them
+
+// slab test with the reciprocal of the ray direction, returns the distance at
+// which the ray enters the volume or -1 if it misses it within [tmin, tmax].
+// The test is inclusive, the box of a leaf of flat axis aligned triangles
+// has no thickness along one axis.
+inline float intersect(math::float3 origin, math::float3 invDir, AABB volume, float tmin, float tmax)
+{
+    for (int i = 0; i < 3; ++i) {
+        float t0 = (volume.min[i] - origin[i]) * invDir[i];
+        float t1 = (volume.max[i] - origin[i]) * invDir[i];
+        tmin = math::max(tmin, math::min(t0, t1));
+        tmax = math::min(tmax, math::max(t0, t1));
+    }
+    return tmin <= tmax ? tmin : -1;
+}
+
+inline float intersectSphere(Sphere sphere, Ray ray, float tmin, float tmax)
+{
+    math::float3 oc = ray.origin - sphere.center;
+    float a = math::dot(ray.dir, ray.dir);
+    float b = math::dot(oc, ray.dir);
+    float c = math::dot(oc, oc) - sphere.radius * sphere.radius;
+    float discriminant = b*b - a*c;
+    if (discriminant < 0) {
+        return -1;
+    }
+    float sqrtDisr = math::sqrt(discriminant);
+    float t = (-b - sqrtDisr) / a;
+    if (tmin <= t && t <= tmax) {
+        return t;
+    }
+    t = (-b + sqrtDisr) / a;
+    if (tmin <= t && t <= tmax) {
+        return t;
+    }
+    return -1;
+}
+
+// rays parallel to the plane never cross it, their distance is not finite
+inline float intersectPlane(Plane plane, Ray ray, float tmin, float tmax)
+{
+    math::float3 normal(plane.normal);
+    float t = (plane.offset - math::dot(normal, ray.origin)) / math::dot(normal, ray.dir);
+    if (tmin <= t && t <= tmax) {
+        return t;
+    }
+    return -1;
+}
+
+// the ray of the watertight triangle test: the axis along which the
+// direction is largest becomes z and a shear turns the direction into
+// (0, 0, 1), the same for every triangle the ray is tested against
+struct TriangleRay
+{
+    math::float3 origin;
+    int kx;
+    int ky;
+    int kz;
+    math::float3 shear;
+};
+
+inline TriangleRay makeTriangleRay(Ray ray)
+{
+    TriangleRay r;
+    r.origin = ray.origin;
+    float ax = ray.dir.x < 0 ? -ray.dir.x : ray.dir.x;
+    float ay = ray.dir.y < 0 ? -ray.dir.y : ray.dir.y;
+    float az = ray.dir.z < 0 ? -ray.dir.z : ray.dir.z;
+    r.kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    r.kx = r.kz == 2 ? 0 : r.kz + 1;
+    r.ky = r.kx == 2 ? 0 : r.kx + 1;
+    // keep the winding of the triangles when looking down negative z
+    if (ray.dir[r.kz] < 0) {
+        int tmp = r.kx;
+        r.kx = r.ky;
+        r.ky = tmp;
+    }
+    r.shear = math::float3(ray.dir[r.kx] / ray.dir[r.kz],
+                           ray.dir[r.ky] / ray.dir[r.kz],
+                           1.0f / ray.dir[r.kz]);
+    return r;
+}
+
+// Woop, Benthin and Wald, watertight ray/triangle intersection. The edge
+// functions are evaluated in the 2d space of the sheared ray, where the ray
+// passes through the origin, so a ray through a shared edge or vertex sees
+// the same value from both triangles and cannot slip between them. Returns
+// the distance of the hit or -1 if it misses the triangle within
+// [tmin, tmax], both sides of the triangle are hit.
+inline float intersectTriangle(Triangle tri, TriangleRay ray, float tmin, float tmax)
+{
+    math::float3 a = tri.v0 - ray.origin;
+    math::float3 b = tri.v1 - ray.origin;
+    math::float3 c = tri.v2 - ray.origin;
+    float ax = a[ray.kx] - ray.shear.x * a[ray.kz];
+    float ay = a[ray.ky] - ray.shear.y * a[ray.kz];
+    float bx = b[ray.kx] - ray.shear.x * b[ray.kz];
+    float by = b[ray.ky] - ray.shear.y * b[ray.kz];
+    float cx = c[ray.kx] - ray.shear.x * c[ray.kz];
+    float cy = c[ray.ky] - ray.shear.y * c[ray.kz];
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+#ifndef __METAL_VERSION__
+    // an edge function that rounds to zero decides which of two triangles
+    // sharing the edge is hit, redo all of them exactly enough to tell
+    if (u == 0 || v == 0 || w == 0) {
+        u = float((double)cx * by - (double)cy * bx);
+        v = float((double)ax * cy - (double)ay * cx);
+        w = float((double)bx * ay - (double)by * ax);
+    }
+#endif
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) {
+        return -1;
+    }
+    float det = u + v + w;
+    if (det == 0) {
+        return -1;
+    }
+
+    float az = ray.shear.z * a[ray.kz];
+    float bz = ray.shear.z * b[ray.kz];
+    float cz = ray.shear.z * c[ray.kz];
+    float t = u * az + v * bz + w * cz;
+    // compare the scaled distance so that there is only one division
+    if (det < 0) {
+        t = -t;
+        det = -det;
+    }
+    if (t < tmin * det || t > tmax * det) {
+        return -1;
+    }
+    return t / det;
+}
+
+inline math::float3 transformPoint(constant Instance& instance, math::float3 p)
+{
+    return math::float3(instance.toObject[0]) * p.x + math::float3(instance.toObject[1]) * p.y +
+           math::float3(instance.toObject[2]) * p.z + math::float3(instance.toObject[3]);
+}
+
+inline math::float3 transformDir(constant Instance& instance, math::float3 dir)
+{
+    return math::float3(instance.toObject[0]) * dir.x + math::float3(instance.toObject[1]) * dir.y +
+           math::float3(instance.toObject[2]) * dir.z;
+}
+
+// the ray in the object space of the instance. Its direction is not
+// normalized again, so a hit is the same distance along both rays.
+inline Ray transformRay(constant Instance& instance, Ray ray)
+{
+    return { transformPoint(instance, ray.origin), transformDir(instance, ray.dir) };
+}
+
+// takes an object space normal to world space with the inverse transpose
+// of the object to world map, which is the transpose of toObject
+inline math::float3 transformNormal(constant Instance& instance, math::float3 normal)
+{
+    return math::float3(math::dot(math::float3(instance.toObject[0]), normal),
+                        math::dot(math::float3(instance.toObject[1]), normal),
+                        math::dot(math::float3(instance.toObject[2]), normal));
+}
 
 class Camera
 {
@@ -72,46 +241,157 @@ class Scene
 public:
     Scene(constant Node* nodes, constant Sphere* spheres, constant Material* materials, int numSpheres);
 
+    // the triangles of the meshes, the leaves tagged PrimitiveTriangle index
+    // them. Their materials are shared by all triangles of a mesh.
+    void setTriangles(constant Triangle* triangles, constant Material* meshMaterials, int numTriangles)
+    {
+        m_triangles = triangles;
+        m_meshMaterials = meshMaterials;
+        m_numTriangles = numTriangles;
+    }
+
+    // the instances the top level leaves tagged PrimitiveInstance refer to
+    void setInstances(constant Instance* instances)
+    {
+        m_instances = instances;
+    }
+
+    // the unbounded primitives next to the bvh, they are few and every
+    // closest hit search tests them all
+    void setPlanes(constant Plane* planes, int numPlanes)
+    {
+        m_planes = planes;
+        m_numPlanes = numPlanes;
+    }
+
+    // brute force only tests the spheres, triangles and planes, it does not know
+    // which triangles are instanced
     template<bool bruteForce>
     bool hit(Ray ray, float tmin, float tmax, thread HitRecord& rec) const
     {
-        int sphereIndex = -1;
+        int primIndex = -1;
+        int instance = -1;
         float minT = INFINITY;
         if (bruteForce) {
             for (int i = 0; i < m_numSpheres; ++i) {
                 float t = intersectSphere(getSphere(i), ray, tmin, tmax);
                 if (t != -1 && minT > t) {
                     minT = t;
-                    sphereIndex = i;
+                    primIndex = i;
                 }
             }
-        } else {
-            int hitNodes[MaxHits];
-            int numHitNodes = findPossibleHits(ray, tmin, tmax, hitNodes);
-            for (int i = 0; i < numHitNodes; ++i) {
-                constant Node& node = getNode(hitNodes[i]);
-                for (int j = 0; j < node.numObj; ++j) {
-                    float t = intersectSphere(getSphere(node.firstObjIndex + j), ray, tmin, tmax);
-                    if (t != -1 && minT > t) {
-                        minT = t;
-                        sphereIndex = node.firstObjIndex + j;
-                    }
+            TriangleRay triRay = makeTriangleRay(ray);
+            for (int i = 0; i < m_numTriangles; ++i) {
+                float t = intersectTriangle(getTriangle(i), triRay, tmin, tmax);
+                if (t != -1 && minT > t) {
+                    minT = t;
+                    primIndex = m_numSpheres + i;
                 }
             }
+            for (int i = 0; i < m_numPlanes; ++i) {
+                float t = intersectPlane(getPlane(i), ray, tmin, tmax);
+                if (t != -1 && minT > t) {
+                    minT = t;
+                    primIndex = firstPlaneIndex() + i;
+                }
+            }
+        } else {
+            minT = tmax;
+            primIndex = closestHit(ray, tmin, minT, instance);
         }
-        if (sphereIndex != -1) {
-            rec.pt = ray.origin + minT * ray.dir;
-            rec.normal = math::normalize(rec.pt - getSphere(sphereIndex).center);
-            rec.material = getMaterial(sphereIndex);
+        if (primIndex != -1) {
+            rec = getHitRecord(ray, minT, primIndex, instance);
             return true;
         }
         return false;
     }
+
+    // primIndex counts the spheres first, the triangles after them and the
+    // planes last, instance is the one the primitive was hit in or -1
+    HitRecord getHitRecord(Ray ray, float t, int primIndex, int instance = -1) const
+    {
+        HitRecord rec;
+        rec.pt = ray.origin + t * ray.dir;
+        // the normal is found where the primitive is stored
+        math::float3 pt = rec.pt;
+        if (instance != -1) {
+            Ray objectRay = transformRay(m_instances[instance], ray);
+            pt = objectRay.origin + t * objectRay.dir;
+        }
+
+        if (primIndex < m_numSpheres) {
+            math::float3 normal = pt - getSphere(primIndex).center;
+            if (instance != -1) {
+                normal = transformNormal(m_instances[instance], normal);
+            }
+            rec.normal = math::normalize(normal);
+            rec.material = getMaterial(primIndex);
+            return rec;
+        }
+
+        if (primIndex >= firstPlaneIndex()) {
+            constant Plane& plane = getPlane(primIndex - firstPlaneIndex());
+            rec.material = plane.material;
+            rec.normal = math::normalize(math::float3(plane.normal));
+            // as for the triangles below, both sides scatter
+            if (rec.material.type != Dielectric && math::dot(rec.normal, ray.dir) > 0) {
+                rec.normal = -rec.normal;
+            }
+            return rec;
+        }
+
+        constant Triangle& tri = getTriangle(primIndex - m_numSpheres);
+        rec.material = m_meshMaterials[tri.material];
+        math::float3 normal = math::cross(math::float3(tri.v1 - tri.v0), math::float3(tri.v2 - tri.v0));
+        if (instance != -1) {
+            normal = transformNormal(m_instances[instance], normal);
+        }
+        rec.normal = math::normalize(normal);
+        // the dielectrics tell entering from leaving by the side of the
+        // normal, which only works for counter clockwise faces of closed
+        // meshes. Everything else scatters off the side that was hit.
+        if (rec.material.type != Dielectric && math::dot(rec.normal, ray.dir) > 0) {
+            rec.normal = -rec.normal;
+        }
+        return rec;
+    }
     
+    // returns the index of the closest primitive hit within [tmin, tmax] or
+    // -1, tmax receives its distance
+    int closestHit(Ray ray, float tmin, thread float& tmax) const;
+
+    // the same, instance receives the instance the primitive was hit in or
+    // -1 if it was hit in world space
+    int closestHit(Ray ray, float tmin, thread float& tmax, thread int& instance) const;
+
+    // the closest plane within [tmin, tmax] or -1, tmax receives its
+    // distance. The traversals test the planes before the bvh, so that a
+    // plane in front culls the nodes behind it.
+    int closestPlane(Ray ray, float tmin, thread float& tmax) const
+    {
+        int primIndex = -1;
+        for (int i = 0; i < m_numPlanes; ++i) {
+            float t = intersectPlane(getPlane(i), ray, tmin, tmax);
+            if (t != -1 && t < tmax) {
+                tmax = t;
+                primIndex = firstPlaneIndex() + i;
+            }
+        }
+        return primIndex;
+    }
+
+    // collects the leaves overlapped by the ray, at most MaxHits of them.
+    // The planes are not in the bvh, callers test them with closestPlane.
     int findPossibleHits(Ray ray, float tmin, float tmax, thread int hitNodes[MaxHits]) const;
 
     int numSpheres() const { return m_numSpheres; }
+    int numTriangles() const { return m_numTriangles; }
+    int numPlanes() const { return m_numPlanes; }
+    // the primitive index of the first plane
+    int firstPlaneIndex() const { return m_numSpheres + m_numTriangles; }
     constant Sphere& getSphere(int i) const { return m_spheres[i]; }
+    constant Triangle& getTriangle(int i) const { return m_triangles[i]; }
+    constant Plane& getPlane(int i) const { return m_planes[i]; }
     constant Node& getNode(int i) const { return m_nodes[i]; }
     constant Material& getMaterial(int i) const { return m_materials[i]; }
 private:
@@ -119,6 +399,12 @@ private:
     constant Sphere* m_spheres;
     constant Material* m_materials;
     int m_numSpheres;
+    constant Triangle* m_triangles;
+    constant Material* m_meshMaterials;
+    int m_numTriangles;
+    constant Instance* m_instances;
+    constant Plane* m_planes;
+    int m_numPlanes;
 };
 
 inline float schlick(float cosine, float n)
@@ -128,81 +414,202 @@ inline float schlick(float cosine, float n)
     return r0 + (1.0f - r0) * math::pow(1.0f - cosine, 5);
 }
 
-class RayTracer
+// offset keeping scattered rays from hitting the surface they leave
+constant constexpr float MinHitDistance = 0.0001f;
+
+// bounces a path may take at most, and the ones it always takes before
+// russian roulette may end it
+constant constexpr int DefaultMaxDepth = 50;
+constant constexpr int DefaultMinDepth = 3;
+
+// the scattering of the materials, each one draws the numbers it needs from
+// random
+template<typename SamplerT>
+bool diffuseScatter(thread SamplerT& random, math::float3 /*rayDir*/, thread const HitRecord& rec,
+                    thread math::float3& attenuation, thread math::float3& scattered)
+{
+    scattered = math::normalize(rec.normal + random.inUnitSphere());
+    attenuation = rec.material.albedo;
+    return true;
+}
+
+template<typename SamplerT>
+bool metalScatter(thread SamplerT& random, math::float3 rayDir, thread const HitRecord& rec,
+                  thread math::float3& attenuation, thread math::float3& scattered)
+{
+    scattered = rec.material.prop * random.inUnitSphere() + math::reflect(rayDir, rec.normal);
+    scattered = math::normalize(scattered);
+    attenuation = rec.material.albedo;
+    return math::dot(rec.normal, scattered) > 0;
+}
+
+template<typename SamplerT>
+bool dielectricScatter(thread SamplerT& random, math::float3 rayDir, thread const HitRecord& rec,
+                       thread math::float3& attenuation, thread math::float3& scattered)
+{
+    math::float3 uin = math::normalize(rayDir);
+    attenuation = math::float3(1);
+    
+    float index = rec.material.prop;
+    float ni_over_nt;
+    float cosine = math::dot(uin, rec.normal);
+    math::float3 normal;
+    if (cosine > 0) {
+        ni_over_nt = index;
+        normal = -rec.normal;
+    } else {
+        ni_over_nt = 1.0f / index;
+        normal = rec.normal;
+    }
+    
+    float reflect_prob;
+    math::float3 refracted = math::refract(uin, normal, ni_over_nt);
+    // if > 0, then we assume that light travels from denser material to air
+    if (cosine > 0) {
+        cosine = math::sqrt(1.0f - index * index * (1.0f - cosine * cosine));
+    } else {
+        cosine = -cosine;
+    }
+    reflect_prob = schlick(cosine, index);
+    
+    if (random.next() < reflect_prob) {
+        scattered = math::reflect(uin, normal);
+    } else {
+        scattered = refracted;
+    }
+    return true;
+}
+
+inline math::float3 backgroundColor(math::float3 dir, math::float3 bgColor)
+{
+    float t = (dir.y + 1.0) * 0.5;
+    return math::mix(math::float3(1), bgColor, t);
+}
+
+// SceneT provides hit<bruteForce>() like Scene, which lets the CPU plug in
+// its own acceleration structures, SamplerT is Random or one of sampler.h
+template<typename SceneT, typename SamplerT = Random>
+class BasicRayTracer
 {
 public:
-    RayTracer(thread Random& random, thread const Camera& camera, thread const Scene& scene, math::float3 bgColor);
+    BasicRayTracer(thread SamplerT& random, thread const Camera& camera, thread const SceneT& scene, math::float3 bgColor)
+        : m_random(random)
+        , m_camera(camera)
+        , m_scene(scene)
+        , m_bgColor(bgColor)
+        , m_minDepth(DefaultMinDepth)
+        , m_maxDepth(DefaultMaxDepth)
+        , m_russianRoulette(false)
+    {}
+
+    // with russian roulette a path past minDepth bounces survives each
+    // further bounce with a probability that follows its throughput
+    void setPathDepth(int minDepth, int maxDepth, bool russianRoulette)
+    {
+        m_minDepth = minDepth;
+        m_maxDepth = maxDepth;
+        m_russianRoulette = russianRoulette;
+    }
 
     template<bool bruteForce>
     math::float3 trace(math::float2 samplePos) const
     {
-        const int MaxIter = 50;
-        
-        math::float3 color = math::float3(1);
+        int numRays;
+        return trace<bruteForce>(samplePos, numRays);
+    }
+
+    // numRays receives the number of rays cast along the path
+    template<bool bruteForce>
+    math::float3 trace(math::float2 samplePos, thread int& numRays) const
+    {
         HitRecord rec;
         Ray ray = m_camera.getRay(samplePos);
-        for (int i = 0; i < MaxIter; ++i) {
-            if (m_scene.hit<bruteForce>(ray, 0.0001f, INFINITY, rec)) {
-                math::float3 scatteredDir;
-                math::float3 attenuation;
-                bool scattered = false;
-                switch (rec.material.type) {
-                case MaterialType::Diffuse:
-                    scattered = diffuseScatter(ray.dir, rec, attenuation, scatteredDir);
-                    break;
-                    
-                case MaterialType::Metal:
-                    scattered = metalScatter(ray.dir, rec, attenuation, scatteredDir);
-                    break;
-                    
-                case MaterialType::Dielectric:
-                    scattered = dielectricScatter(ray.dir, rec, attenuation, scatteredDir);
-                    break;
-                }
-                if (scattered) {
-                    ray.origin = rec.pt;
-                    ray.dir = scatteredDir;
-                    color *= attenuation;
-                } else {
-                    color = math::float3(0);
-                    break;
-                }
-            } else {
+        bool hit = m_scene.template hit<bruteForce>(ray, MinHitDistance, INFINITY, rec);
+        return traceFrom<bruteForce>(ray, hit, rec, numRays);
+    }
+
+    // continues a path whose first intersection has already been found, e.g.
+    // by a packet of primary rays
+    template<bool bruteForce>
+    math::float3 traceFrom(Ray ray, bool hit, HitRecord rec, thread int& numRays) const
+    {
+        math::float3 color = math::float3(1);
+        numRays = 1;
+        for (int i = 0; hit;) {
+            math::float3 scatteredDir;
+            math::float3 attenuation;
+            bool scattered = false;
+            switch (rec.material.type) {
+            case MaterialType::Diffuse:
+                scattered = diffuseScatter(m_random, ray.dir, rec, attenuation, scatteredDir);
+                break;
+                
+            case MaterialType::Metal:
+                scattered = metalScatter(m_random, ray.dir, rec, attenuation, scatteredDir);
+                break;
+                
+            case MaterialType::Dielectric:
+                scattered = dielectricScatter(m_random, ray.dir, rec, attenuation, scatteredDir);
+                break;
+            }
+            if (!scattered) {
+                color = math::float3(0);
+                break;
+            }
+            ray.origin = rec.pt;
+            ray.dir = scatteredDir;
+            color *= attenuation;
+
+            if (++i == m_maxDepth) {
                 break;
             }
+            if (m_russianRoulette && i >= m_minDepth) {
+                // the survivors are weighted up by the chance they had, which
+                // keeps the estimate unbiased
+                float p = math::min(math::max(color.r, math::max(color.g, color.b)), 1.0f);
+                if (m_random.next() >= p) {
+                    return math::float3(0);
+                }
+                color /= p;
+            }
+            ++numRays;
+            hit = m_scene.template hit<bruteForce>(ray, MinHitDistance, INFINITY, rec);
         }
         
         color *= getBackgroundColor(ray.dir);
         return color;
     }
 private:
-    bool diffuseScatter(math::float3 rayDir, thread const HitRecord& rec,
-                        thread math::float3& attenuation, thread math::float3& scattered) const;
-
-    bool metalScatter(math::float3 rayDir, thread const HitRecord& rec,
-                      thread math::float3& attenuation, thread math::float3& scattered) const;
-
-    bool dielectricScatter(math::float3 rayDir, thread const HitRecord& rec,
-                           thread math::float3& attenuation, thread math::float3& scattered) const;
-
-    math::float3 getBackgroundColor(math::float3 dir) const;
+    math::float3 getBackgroundColor(math::float3 dir) const
+    {
+        return backgroundColor(dir, m_bgColor);
+    }
 
-    thread Random& m_random;
+    thread SamplerT& m_random;
     thread const Camera& m_camera;
-    thread const Scene& m_scene;
+    thread const SceneT& m_scene;
     math::float3 m_bgColor;
+    int m_minDepth;
+    int m_maxDepth;
+    bool m_russianRoulette;
 };
 
+using RayTracer = BasicRayTracer<Scene>;
+
 inline math::float3 debugTrace(thread const Scene& scene, thread const Camera& camera,
                                math::float2 samplePos)
 {
+    Ray ray = camera.getRay(samplePos);
+    // the planes come first as in closestHit, a plane that is hit counts as
+    // one primitive and hides the leaves behind it
+    float tmax = INFINITY;
+    int numHitPrims = scene.closestPlane(ray, 0, tmax) != -1 ? 1 : 0;
     int hits[MaxHits];
-    int numNodes = scene.findPossibleHits(camera.getRay(samplePos), 0, INFINITY, hits);
-    int numHitSpheres = 0;
+    int numNodes = scene.findPossibleHits(ray, 0, tmax, hits);
     for (int i = 0; i < numNodes; ++i) {
-        numHitSpheres += scene.getNode(hits[i]).numObj;
+        numHitPrims += scene.getNode(hits[i]).numObj;
     }
-    return math::float3(float(numHitSpheres) / 32.0f);
+    return math::float3(float(numHitPrims) / 32.0f);
 }
 
 }
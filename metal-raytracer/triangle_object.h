@@ -0,0 +1,33 @@
+#ifndef TRIANGLE_OBJECT_H
+#define TRIANGLE_OBJECT_H
+
+#include "object.h"
+#include <glm/glm.hpp>
+
+class TriangleObject : public object
+{
+public:
+    TriangleObject() = default;
+
+    TriangleObject(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, int material)
+        : v0(v0)
+        , v1(v1)
+        , v2(v2)
+        , material(material)
+    {
+    }
+
+    aabb3 get_aabb() const override
+    {
+        return { glm::min(v0, glm::min(v1, v2)), glm::max(v0, glm::max(v1, v2)) };
+    }
+
+    glm::vec3 v0;
+    glm::vec3 v1;
+    glm::vec3 v2;
+
+    // index into the mesh materials of the scene
+    int material;
+};
+
+#endif // TRIANGLE_OBJECT_H
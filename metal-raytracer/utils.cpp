@@ -1,13 +1,34 @@
 #include "utils.h"
 
-#include <cstdlib>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 namespace utils
 {
 
-float random()
+int hardwareThreads()
 {
-    return (float)std::rand() / RAND_MAX;
+    return (int)std::max(1u, std::thread::hardware_concurrency());
 }
 
-}
\ No newline at end of file
+void runThreads(int numThreads, const std::function<void(int)>& task)
+{
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; ++i) {
+        threads.emplace_back(task, i);
+    }
+    task(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+void parallelInvoke(const std::function<void()>& a, const std::function<void()>& b)
+{
+    std::thread t(a);
+    b();
+    t.join();
+}
+
+}
@@ -3,11 +3,24 @@
 
 #pragma once
 
+#include <functional>
+
 namespace utils
 {
 
-float random();
+// number of hardware threads, at least 1
+int hardwareThreads();
+
+// runs task(threadIndex) on numThreads threads including the calling one and
+// waits for all of them to finish
+//
+// defined out of line as metal_bridge.h turns the identifier thread into an
+// address space qualifier
+void runThreads(int numThreads, const std::function<void(int)>& task);
+
+// runs a on another thread and b on the calling one, returns when both are done
+void parallelInvoke(const std::function<void()>& a, const std::function<void()>& b);
 
 }
 
-#endif // UTILS_H
\ No newline at end of file
+#endif // UTILS_H
@@ -0,0 +1,348 @@
+//
+//  wavefront.h
+//  metal-raytracer
+//
+//  Path tracing in stages over queues of many paths for the CPU tracer.
+//  BasicRayTracer follows one path to its end and switches on the material
+//  at every bounce, here every stage runs over all rays of a bounce before
+//  the next one starts, and each material is shaded in a loop of its own.
+//
+
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "tracer.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace tracer
+{
+
+// traces one path of every pixel of a batch at once, a bounce at a time:
+//  - extend finds the closest hit of every ray in the queue, the paths that
+//    miss end in the background
+//  - sort bins the hits by the type of their material
+//  - shade scatters the hits of one type after the other
+//  - compact writes the rays of the paths that go on into the queue of the
+//    next bounce, in the order they were shaded
+// With ray sorting the secondary rays are reordered before extend, see
+// sortRays.
+// Every path draws from the sampler of its pixel in the same order as
+// BasicRayTracer does, so both render the same image.
+template<typename SceneT, typename SamplerT>
+class WavefrontTracer
+{
+public:
+    // queueSize is the number of paths in flight, the most a batch may hold
+    WavefrontTracer(const Camera& camera, const SceneT& scene, math::float3 bgColor, int queueSize)
+        : m_camera(camera)
+        , m_scene(scene)
+        , m_bgColor(bgColor)
+        , m_queueSize(queueSize)
+        , m_minDepth(DefaultMinDepth)
+        , m_maxDepth(DefaultMaxDepth)
+        , m_russianRoulette(false)
+        , m_sortRays(false)
+    {
+        m_queues[0].resize(queueSize);
+        m_queues[1].resize(queueSize);
+        m_hitPoint.resize(queueSize);
+        m_hitNormal.resize(queueSize);
+        m_hitMaterial.resize(queueSize);
+        m_hits.resize(queueSize);
+        m_sorted.resize(queueSize);
+    }
+
+    // whether the rays of every bounce after the first are sorted, which
+    // changes the order they are traced in but not the image
+    void setRaySorting(bool sortRays)
+    {
+        m_sortRays = sortRays;
+        m_keys.resize(sortRays ? 2 * m_queueSize : 0);
+        m_order.resize(sortRays ? 2 * m_queueSize : 0);
+    }
+
+    // the same as BasicRayTracer::setPathDepth
+    void setPathDepth(int minDepth, int maxDepth, bool russianRoulette)
+    {
+        m_minDepth = minDepth;
+        m_maxDepth = maxDepth;
+        m_russianRoulette = russianRoulette;
+    }
+
+    int queueSize() const { return m_queueSize; }
+
+    // traces sample sampleIndex of count pixels with their samplers, which
+    // are continued. colors[i] and numRays[i] receive the color and the
+    // number of rays of the path of pixel i.
+    template<bool bruteForce>
+    void trace(const math::uint2* pixels, SamplerT* samplers, int sampleIndex, int count,
+               math::float3* colors, int* numRays)
+    {
+        MB_ASSERT(count <= m_queueSize);
+        RayQueue* current = &m_queues[0];
+        RayQueue* next = &m_queues[1];
+        generate(pixels, samplers, sampleIndex, count, *current, numRays);
+        for (int bounce = 0; current->size > 0; ++bounce) {
+            if (m_sortRays && bounce > 0) {
+                sortRays(*current, *next);
+                std::swap(current, next);
+            }
+            int numHits = extend<bruteForce>(*current, colors);
+            int binStart[NumMaterialTypes + 1];
+            sortByMaterial(numHits, binStart);
+
+            next->size = 0;
+            shade<Diffuse>(*current, binStart[Diffuse], binStart[Diffuse + 1], samplers, colors, numRays, *next);
+            shade<Metal>(*current, binStart[Metal], binStart[Metal + 1], samplers, colors, numRays, *next);
+            shade<Dielectric>(*current, binStart[Dielectric], binStart[Dielectric + 1], samplers, colors, numRays, *next);
+            std::swap(current, next);
+        }
+    }
+
+private:
+    static constexpr int NumMaterialTypes = 3;
+
+    // the rays of the paths still going, a field per array
+    struct RayQueue
+    {
+        void resize(int n)
+        {
+            path.resize(n);
+            depth.resize(n);
+            origin.resize(n);
+            dir.resize(n);
+            throughput.resize(n);
+        }
+
+        // the pixel of the batch the path belongs to
+        std::vector<int> path;
+        // bounces so far
+        std::vector<int> depth;
+        std::vector<math::float3> origin;
+        std::vector<math::float3> dir;
+        std::vector<math::float3> throughput;
+        int size = 0;
+    };
+
+    void generate(const math::uint2* pixels, SamplerT* samplers, int sampleIndex, int count,
+                  RayQueue& queue, int* numRays)
+    {
+        for (int i = 0; i < count; ++i) {
+            math::uint2 pixel = pixels[i];
+            samplers[i].startSample(pixel, sampleIndex);
+            Ray ray = m_camera.getRay(math::float2(pixel.x, pixel.y) + samplers[i].inUnitRect());
+            queue.path[i] = i;
+            queue.depth[i] = 0;
+            queue.origin[i] = ray.origin;
+            queue.dir[i] = ray.dir;
+            queue.throughput[i] = math::float3(1);
+            numRays[i] = 1;
+        }
+        queue.size = count;
+    }
+
+    // 10 bits spread to every third bit
+    static std::uint64_t expandBits(std::uint64_t v)
+    {
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v << 8)) & 0x0300F00F;
+        v = (v | (v << 4)) & 0x030C30C3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+
+    // orders the rays along a morton curve through their origins, quantized
+    // to 10 bits per axis within the bounds of all origins, and the rays of
+    // the same cell by the octant of their direction. Rays next to each
+    // other then start close together and mostly go the same way, so they
+    // visit the same nodes while those are still cached. Binning by octant
+    // first splits up the rays leaving one spot, which missed the simulated
+    // cache more often on the generated scene.
+    void sortRays(const RayQueue& queue, RayQueue& sorted)
+    {
+        int n = queue.size;
+        math::float3 lo(INFINITY);
+        math::float3 hi(-INFINITY);
+        for (int i = 0; i < n; ++i) {
+            lo = math::min(lo, queue.origin[i]);
+            hi = math::max(hi, queue.origin[i]);
+        }
+        math::float3 extent = hi - lo;
+        math::float3 scale;
+        for (int axis = 0; axis < 3; ++axis) {
+            scale[axis] = extent[axis] > 0 ? 1023.0f / extent[axis] : 0.0f;
+        }
+
+        std::uint64_t* keys = m_keys.data();
+        int* order = m_order.data();
+        for (int i = 0; i < n; ++i) {
+            math::float3 dir = queue.dir[i];
+            std::uint64_t octant = (dir.x < 0 ? 1 : 0) | (dir.y < 0 ? 2 : 0) | (dir.z < 0 ? 4 : 0);
+            math::float3 cell = (queue.origin[i] - lo) * scale;
+            keys[i] = octant | (expandBits((std::uint64_t)cell.x) << 2
+                    | expandBits((std::uint64_t)cell.y) << 1 | expandBits((std::uint64_t)cell.z)) << 3;
+            order[i] = i;
+        }
+
+        // stable lsd radix sort of the 33 bit keys, swapping between both
+        // halves of the arrays
+        constexpr int RadixBits = 11;
+        constexpr int Radix = 1 << RadixBits;
+        std::uint64_t* keysOut = keys + m_queueSize;
+        int* orderOut = order + m_queueSize;
+        for (int shift = 0; shift < 33; shift += RadixBits) {
+            int offsets[Radix] = {};
+            for (int i = 0; i < n; ++i) {
+                ++offsets[(keys[i] >> shift) & (Radix - 1)];
+            }
+            int sum = 0;
+            for (int d = 0; d < Radix; ++d) {
+                int count = offsets[d];
+                offsets[d] = sum;
+                sum += count;
+            }
+            for (int i = 0; i < n; ++i) {
+                int j = offsets[(keys[i] >> shift) & (Radix - 1)]++;
+                keysOut[j] = keys[i];
+                orderOut[j] = order[i];
+            }
+            std::swap(keys, keysOut);
+            std::swap(order, orderOut);
+        }
+
+        for (int j = 0; j < n; ++j) {
+            int i = order[j];
+            sorted.path[j] = queue.path[i];
+            sorted.depth[j] = queue.depth[i];
+            sorted.origin[j] = queue.origin[i];
+            sorted.dir[j] = queue.dir[i];
+            sorted.throughput[j] = queue.throughput[i];
+        }
+        sorted.size = n;
+    }
+
+    // returns the number of rays that hit something, m_hits lists them
+    template<bool bruteForce>
+    int extend(const RayQueue& queue, math::float3* colors)
+    {
+        int numHits = 0;
+        for (int i = 0; i < queue.size; ++i) {
+            HitRecord rec;
+            if (m_scene.template hit<bruteForce>({ queue.origin[i], queue.dir[i] }, MinHitDistance, INFINITY, rec)) {
+                m_hitPoint[i] = rec.pt;
+                m_hitNormal[i] = rec.normal;
+                m_hitMaterial[i] = rec.material;
+                m_hits[numHits++] = i;
+            } else {
+                colors[queue.path[i]] = queue.throughput[i] * backgroundColor(queue.dir[i], m_bgColor);
+            }
+        }
+        return numHits;
+    }
+
+    // counting sort of the hits into m_sorted, the hits of material type t
+    // are [binStart[t], binStart[t + 1])
+    void sortByMaterial(int numHits, int binStart[NumMaterialTypes + 1])
+    {
+        int counts[NumMaterialTypes] = {};
+        for (int i = 0; i < numHits; ++i) {
+            ++counts[m_hitMaterial[m_hits[i]].type];
+        }
+        binStart[0] = 0;
+        for (int t = 0; t < NumMaterialTypes; ++t) {
+            binStart[t + 1] = binStart[t] + counts[t];
+        }
+        int offsets[NumMaterialTypes];
+        for (int t = 0; t < NumMaterialTypes; ++t) {
+            offsets[t] = binStart[t];
+        }
+        for (int i = 0; i < numHits; ++i) {
+            int index = m_hits[i];
+            m_sorted[offsets[m_hitMaterial[index].type]++] = index;
+        }
+    }
+
+    // scatters the hits [begin, end) of m_sorted, which all are of type, and
+    // compacts the paths that go on into next
+    template<MaterialType type>
+    void shade(const RayQueue& queue, int begin, int end, SamplerT* samplers,
+               math::float3* colors, int* numRays, RayQueue& next)
+    {
+        for (int k = begin; k < end; ++k) {
+            int i = m_sorted[k];
+            int path = queue.path[i];
+            SamplerT& sampler = samplers[path];
+            HitRecord rec;
+            rec.pt = m_hitPoint[i];
+            rec.normal = m_hitNormal[i];
+            rec.material = m_hitMaterial[i];
+
+            math::float3 scatteredDir;
+            math::float3 attenuation;
+            bool scattered;
+            if constexpr (type == Diffuse) {
+                scattered = diffuseScatter(sampler, queue.dir[i], rec, attenuation, scatteredDir);
+            } else if constexpr (type == Metal) {
+                scattered = metalScatter(sampler, queue.dir[i], rec, attenuation, scatteredDir);
+            } else {
+                scattered = dielectricScatter(sampler, queue.dir[i], rec, attenuation, scatteredDir);
+            }
+            if (!scattered) {
+                colors[path] = math::float3(0);
+                continue;
+            }
+
+            math::float3 throughput = queue.throughput[i] * attenuation;
+            int depth = queue.depth[i] + 1;
+            if (depth == m_maxDepth) {
+                colors[path] = throughput * backgroundColor(scatteredDir, m_bgColor);
+                continue;
+            }
+            if (m_russianRoulette && depth >= m_minDepth) {
+                float p = math::min(math::max(throughput.r, math::max(throughput.g, throughput.b)), 1.0f);
+                if (sampler.next() >= p) {
+                    colors[path] = math::float3(0);
+                    continue;
+                }
+                throughput /= p;
+            }
+            ++numRays[path];
+
+            int j = next.size++;
+            next.path[j] = path;
+            next.depth[j] = depth;
+            next.origin[j] = rec.pt;
+            next.dir[j] = scatteredDir;
+            next.throughput[j] = throughput;
+        }
+    }
+
+    const Camera& m_camera;
+    const SceneT& m_scene;
+    math::float3 m_bgColor;
+    int m_queueSize;
+    int m_minDepth;
+    int m_maxDepth;
+    bool m_russianRoulette;
+    bool m_sortRays;
+
+    // the rays of the current bounce and the ones of the next
+    RayQueue m_queues[2];
+    // the hits of the rays of the current queue, by queue entry
+    std::vector<math::float3> m_hitPoint;
+    std::vector<math::float3> m_hitNormal;
+    std::vector<Material> m_hitMaterial;
+    // the queue entries that hit, in queue order and sorted by material
+    std::vector<int> m_hits;
+    std::vector<int> m_sorted;
+    // sort keys and queue entries of sortRays, twice the queue size
+    std::vector<std::uint64_t> m_keys;
+    std::vector<int> m_order;
+};
+
+}
+
+#endif /* WAVEFRONT_H */
@@ -0,0 +1,186 @@
+#include "wide_bvh.h"
+
+#include "bvh_traversal.h"
+
+#include <limits>
+
+namespace tracer
+{
+
+namespace
+{
+
+float halfArea(const Node& node)
+{
+    math::float3 size = node.max - node.min;
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+template<int N>
+int collapse(const std::vector<Node>& nodes, int index, std::vector<WideNode<N>>& wideNodes)
+{
+    int wideIndex = (int)wideNodes.size();
+    wideNodes.emplace_back();
+
+    // keep opening the inner child with the largest surface area, it is the
+    // one most rays would have to descend into anyway
+    int children[N];
+    int numChildren = 0;
+    const Node& node = nodes[index];
+    if (node.left == -1) {
+        children[numChildren++] = index;
+    } else {
+        children[numChildren++] = node.left;
+        children[numChildren++] = node.right;
+        while (numChildren < N) {
+            int best = -1;
+            float bestArea = -1.0f;
+            for (int i = 0; i < numChildren; ++i) {
+                const Node& child = nodes[children[i]];
+                if (child.left != -1 && halfArea(child) > bestArea) {
+                    best = i;
+                    bestArea = halfArea(child);
+                }
+            }
+            if (best == -1) {
+                break;
+            }
+            const Node& opened = nodes[children[best]];
+            children[best] = opened.left;
+            children[numChildren++] = opened.right;
+        }
+    }
+
+    WideNode<N> wide;
+    for (int i = 0; i < N; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            wide.min[axis][i] = std::numeric_limits<float>::quiet_NaN();
+            wide.max[axis][i] = std::numeric_limits<float>::quiet_NaN();
+        }
+        wide.child[i] = -1;
+        wide.numObj[i] = 0;
+    }
+    for (int i = 0; i < numChildren; ++i) {
+        const Node& child = nodes[children[i]];
+        if (child.left == -1 && child.numObj == 0) {
+            continue;
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            wide.min[axis][i] = child.min[axis];
+            wide.max[axis][i] = child.max[axis];
+        }
+        if (child.left == -1) {
+            wide.child[i] = child.firstObjIndex;
+            wide.numObj[i] = child.numObj;
+        } else {
+            wide.child[i] = collapse(nodes, children[i], wideNodes);
+        }
+    }
+    wideNodes[wideIndex] = wide;
+    return wideIndex;
+}
+
+} // anonymous namespace
+
+template<int N>
+std::vector<WideNode<N>> collapseBVH(const std::vector<Node>& nodes)
+{
+    std::vector<WideNode<N>> wideNodes;
+    wideNodes.reserve(nodes.size() / (N - 1) + 1);
+    collapse(nodes, 0, wideNodes);
+    return wideNodes;
+}
+
+namespace
+{
+
+// the wide nodes for closestHitOrdered. Leaves are slots of their parent,
+// so a node to visit is a slot: a node index or the spheres of a leaf.
+template<int N>
+struct WideTree
+{
+    struct Ref
+    {
+        int child;
+        int numObj;
+    };
+    struct WideRay
+    {
+        vfloat<N> origin[3];
+        vfloat<N> invDir[3];
+    };
+    static constexpr int MaxChildren = N;
+
+    const WideNode<N>* nodes;
+
+    TRAVERSAL_INLINE WideRay prepare(Ray ray) const
+    {
+        WideRay wideRay;
+        for (int axis = 0; axis < 3; ++axis) {
+            wideRay.origin[axis] = vfloat<N>(ray.origin[axis]);
+            wideRay.invDir[axis] = vfloat<N>(1.0f / ray.dir[axis]);
+        }
+        return wideRay;
+    }
+
+    // the children of the root are tested right away
+    template<typename Probe>
+    TRAVERSAL_INLINE bool root(const WideRay&, float, float, Ref& ref, Probe&) const
+    {
+        ref = { 0, 0 };
+        return true;
+    }
+
+    template<typename Probe>
+    TRAVERSAL_INLINE bool leaf(Ref ref, int& first, int& count, Probe&) const
+    {
+        first = ref.child;
+        count = ref.numObj;
+        return ref.numObj > 0;
+    }
+
+    // slab test against all children at once
+    template<typename Probe>
+    TRAVERSAL_INLINE int children(Ref ref, const WideRay& ray, float tmin, float tmax, Ref* refs, float* dists,
+                                  Probe&) const
+    {
+        const WideNode<N>& node = nodes[ref.child];
+        vfloat<N> tnear(tmin);
+        vfloat<N> tfar(tmax);
+        for (int axis = 0; axis < 3; ++axis) {
+            vfloat<N> t0 = (vfloat<N>::load(node.min[axis]) - ray.origin[axis]) * ray.invDir[axis];
+            vfloat<N> t1 = (vfloat<N>::load(node.max[axis]) - ray.origin[axis]) * ray.invDir[axis];
+            tnear = max(tnear, min(t0, t1));
+            tfar = min(tfar, max(t0, t1));
+        }
+        int bits = (tnear <= tfar).bits();
+        if (!bits) {
+            return 0;
+        }
+
+        alignas(32) float near[N];
+        tnear.store(near);
+        int numChildren = 0;
+        for (; bits; bits &= bits - 1) {
+            int i = __builtin_ctz(bits);
+            refs[numChildren] = { node.child[i], node.numObj[i] };
+            dists[numChildren++] = near[i];
+        }
+        return numChildren;
+    }
+};
+
+} // anonymous namespace
+
+template<int N>
+int WideScene<N>::closestHit(Ray ray, float tmin, float& tmax) const
+{
+    return closestHitOrdered(m_scene, WideTree<N>{ m_nodes }, SphereLeaves{ m_scene }, ray, tmin, tmax, NoProbe{});
+}
+
+template std::vector<WideNode<4>> collapseBVH<4>(const std::vector<Node>&);
+template std::vector<WideNode<8>> collapseBVH<8>(const std::vector<Node>&);
+template class WideScene<4>;
+template class WideScene<8>;
+
+}
@@ -0,0 +1,74 @@
+//
+//  wide_bvh.h
+//  metal-raytracer
+//
+//  4 and 8 wide bvh for the CPU tracer. The binary tree is collapsed so that
+//  every node holds the bounds of up to N children as structure of arrays,
+//  which are tested against a ray in one go.
+//
+
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "scene.h"
+#include "simd_types.h"
+#include "tracer.h"
+
+#include <vector>
+
+namespace tracer
+{
+
+template<int N>
+struct alignas(32) WideNode
+{
+    // child bounds indexed by axis then child
+    float min[3][N];
+    float max[3][N];
+
+    // inner child: node index and numObj 0
+    // leaf child: first sphere and numObj > 0
+    // empty slot: -1 and 0, its bounds are NaN so that no slab test hits them
+    int child[N];
+    int numObj[N];
+};
+
+// collapses the flattened binary tree, the leaves keep referring to the
+// spheres of the binary leaves
+template<int N>
+std::vector<WideNode<N>> collapseBVH(const std::vector<Node>& nodes);
+
+template<int N>
+class WideScene
+{
+public:
+    // scene provides the spheres and materials the leaves refer to
+    WideScene(const Scene& scene, const WideNode<N>* nodes)
+        : m_scene(scene)
+        , m_nodes(nodes)
+    {}
+
+    template<bool bruteForce>
+    bool hit(Ray ray, float tmin, float tmax, HitRecord& rec) const
+    {
+        if (bruteForce) {
+            return m_scene.hit<true>(ray, tmin, tmax, rec);
+        }
+        int primIndex = closestHit(ray, tmin, tmax);
+        if (primIndex != -1) {
+            rec = m_scene.getHitRecord(ray, tmax, primIndex);
+            return true;
+        }
+        return false;
+    }
+
+    // same contract as Scene::closestHit
+    int closestHit(Ray ray, float tmin, float& tmax) const;
+private:
+    Scene m_scene;
+    const WideNode<N>* m_nodes;
+};
+
+}
+
+#endif /* WIDE_BVH_H */